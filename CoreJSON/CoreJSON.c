@@ -19,6 +19,41 @@
 //
 
 #include "CoreJSON.h"
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+#if CORE_JSON_USDT && defined(__linux__)
+#include <sys/sdt.h>
+#define __JSON_TRACE_PROBES 1
+#define __JSON_TRACE_PROBE(name, ...) DTRACE_PROBE2(corejson, name, __VA_ARGS__)
+#else
+#define __JSON_TRACE_PROBES 0
+#define __JSON_TRACE_PROBE(name, ...) do { } while (0)
+#endif
+
+// Monotonic time in nanoseconds, used for tracing and statistics.
+static inline uint64_t __JSONTraceGetTime(void) {
+#if defined(__APPLE__)
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0)
+    mach_timebase_info(&timebase);
+  return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
 
 // Internal helper macro for appending elements
 #define __JSON_CONSUME_AND_RETURN(create) \
@@ -75,7 +110,7 @@ inline bool __JSONStackEntryAppendValue(__JSONStackEntryRef entry, CFIndex value
   bool success = 0;
   if (entry) {
     if (entry->valuesIndex == entry->valuesSize) { // Reallocate more space
-      CFIndex largerSize = entry->valuesSize ? entry->valuesSize << 1 : CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE;
+      CFIndex largerSize = entry->valuesSize ? entry->valuesSize << 1 : CORE_JSON_MINIMUM_SIZE;
       CFIndex *largerValues = CFAllocatorReallocate(entry->allocator, entry->values, sizeof(CFIndex) * largerSize, 0);
       if (largerValues) {
         entry->valuesSize = largerSize;
@@ -94,7 +129,7 @@ inline bool __JSONStackEntryAppendKey(__JSONStackEntryRef entry, CFIndex key) {
   bool success = 0;
   if (entry) {
     if (entry->keysIndex == entry->keysSize) { // Reallocate more space
-      CFIndex largerSize = entry->keysSize ? entry->keysSize << 1 : CORE_JSON_STACK_ENTRY_KEYS_INITIAL_SIZE;
+      CFIndex largerSize = entry->keysSize ? entry->keysSize << 1 : CORE_JSON_MINIMUM_SIZE;
       CFIndex *largerKeys = CFAllocatorReallocate(entry->allocator, entry->keys, sizeof(CFIndex) * largerSize, 0);
       if (largerKeys) {
         entry->keysSize = largerSize;
@@ -211,7 +246,20 @@ inline bool __JSONStackAppendKeyAtTop(__JSONStackRef stack, CFIndex key) {
 
 inline int __JSONParserAppendStringWithBytes(void *context, const unsigned char *value, size_t length) {
   __JSONRef json = (__JSONRef)context;
-  __JSON_CONSUME_AND_RETURN(CFStringCreateWithBytes(json->allocator, value, length, kCFStringEncodingUTF8, 0));
+  
+  // Converter applies only if it's the value of the last key
+  if (json->converter) {
+    __JSONStackEntryRef top = __JSONStackGetTop(json->stack);
+    __JSONConverterRef converter = json->converter;
+    json->converter = NULL;
+    if (top && top->keysIndex == top->valuesIndex + 1) {
+      CFTypeRef converted = converter->callBack(json->allocator, value, length, converter->info);
+      if (converted) {
+        __JSON_CONSUME_AND_RETURN(converted);
+      }
+    }
+  }
+  __JSON_CONSUME_AND_RETURN(__JSONCreateStringWithBytes(json, value, length));
 }
 
 inline int __JSONParserAppendNull(void *context) {
@@ -224,24 +272,51 @@ inline int __JSONParserAppendBooleanWithInteger(void *context, int value) {
   return __JSONStackAppendValueAtTop(json->stack, __JSONElementsAppend(json, value ? kCFBooleanTrue : kCFBooleanFalse));
 }
 
-inline int __JSONParserAppendNumberWithBytes(void *context, const char *value, size_t length) {
-  __JSONRef json = (__JSONRef)context;
-  CFNumberRef number = NULL;
+inline bool __JSONNumberHasFloatDigits(const char *digits, size_t length) {
+  for (size_t i = 0; i < length; i++)
+    if (digits[i] == '.' || digits[i] == 'e' || digits[i] == 'E')
+      return 1;
+  return 0;
+}
 
-  // TODO: How to do it better? Anybody?
-  bool looksLikeFloat = 0;
-  for (int i = 0; i < length; i++)
-    if (value[i] == '.' || value[i] == 'e' || value[i] == 'E')
-      looksLikeFloat = 1;
+// Digits have to be followed by a character which can't be part of a number or NULL, which is
+// the case for yajl buffers and lazy numbers.
+inline __JSONNumberValue __JSONNumberDecode(const char *digits, size_t length) {
+  __JSONNumberValue number = { __JSONNumberHasFloatDigits(digits, length), 0, 0, 0.0 };
+  if (!number.isFloat) {
+    errno = 0;
+    number.integerValue = strtoll(digits, NULL, 10);
+    if (errno == ERANGE)
+      number.isFloat = number.overflow = 1;
+    else
+      number.doubleValue = (double)number.integerValue;
+  }
+  if (number.isFloat) {
+    number.doubleValue = strtod(digits, NULL);
+    if (number.doubleValue >= 9223372036854775807.0)
+      number.integerValue = LLONG_MAX;
+    else if (number.doubleValue <= -9223372036854775808.0)
+      number.integerValue = LLONG_MIN;
+    else
+      number.integerValue = (long long)number.doubleValue;
+  }
+  return number;
+}
 
-  if (looksLikeFloat) {
-    double value_ = strtod((char *)value, NULL);
-    number = CFNumberCreate(json->allocator, kCFNumberDoubleType, &value_);
-  } else {
-    long long value_ = strtoll((char *)value, NULL, 0);
-    number = CFNumberCreate(json->allocator, kCFNumberLongLongType, &value_);
+inline int __JSONParserAppendNumberWithBytes(void *context, const char *value, size_t length) {
+  __JSONRef json = (__JSONRef)context;
+  if (json->lazyNumbers) {
+    __JSON_CONSUME_AND_RETURN(__JSONLazyNumberCreate(json->allocator, value, length));
   }
   
+  // Integers out of long long range are kept as doubles rather than saturated
+  CFNumberRef number = NULL;
+  __JSONNumberValue value_ = __JSONNumberDecode(value, length);
+  if (value_.isFloat)
+    number = CFNumberCreate(json->allocator, kCFNumberDoubleType, &value_.doubleValue);
+  else
+    number = CFNumberCreate(json->allocator, kCFNumberLongLongType, &value_.integerValue);
+  
   __JSON_CONSUME_AND_RETURN(number);
 }
 
@@ -258,7 +333,9 @@ inline int __JSONParserAppendNumberWithDouble(void *context, double value) {
 // LOOK OUT! Appending to key array, not the value array
 inline int __JSONParserAppendMapKeyWithBytes(void *context, const unsigned char *value, size_t length) {
   __JSONRef json = (__JSONRef)context;
-  CFTypeRef __json_element = CFStringCreateWithBytes(json->allocator, value, length, kCFStringEncodingUTF8, 0);
+  CFTypeRef __json_element = __JSONCreateStringWithBytes(json, value, length);
+  if (json->converters)
+    json->converter = CFDictionaryGetValue(json->converters, __json_element);
   int __json_return = __JSONStackAppendKeyAtTop(json->stack, __JSONElementsAppend(json, __json_element));
   CFRelease(__json_element);
   return __json_return;
@@ -274,7 +351,13 @@ inline int __JSONParserAppendMapStart(void *context) {
   __JSONStackAppendValueAtTop(json->stack, index);
   
   // Push this element as the new container
-  __JSONStackEntryRef entry = __JSONStackEntryCreate(json->allocator, index, CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE, CORE_JSON_STACK_ENTRY_KEYS_INITIAL_SIZE);
+  __JSONStackEntryRef entry = NULL;
+  if (json->shape) {
+    CFIndex size = __JSONShapeGetSize(json->shape->mapSizes, json->stack->index, CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE);
+    entry = __JSONStackEntryCreate(json->scratchAllocator, index, size, size);
+  } else {
+    entry = __JSONStackEntryCreate(json->scratchAllocator, index, CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE, CORE_JSON_STACK_ENTRY_KEYS_INITIAL_SIZE);
+  }
   __JSONStackPush(json->stack, entry);
   __JSONStackEntryRelease(entry);
   return 1;
@@ -285,12 +368,23 @@ inline int __JSONParserAppendMapEnd(void *context) {
   __JSONRef json = (__JSONRef)context;
   __JSONStackEntryRef entry = __JSONStackPop(json->stack);
   if (entry) {
+    if (json->shape)
+      __JSONShapeObserve(json->shape->observedMapSizes, json->stack->index, entry->valuesIndex);
     if (entry->keysIndex == entry->valuesIndex) {
       CFTypeRef *keys = __JSONStackEntryCreateKeys(entry, json->elements);
       if (keys) {
         CFTypeRef *values = __JSONStackEntryCreateValues(entry, json->elements);
         if (values) {
-          json->elements[entry->index] = CFDictionaryCreate(json->allocator, keys, values, entry->keysIndex, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+          CFTypeRef object = NULL;
+          if (json->compactObjects && entry->keysIndex <= CORE_JSON_COMPACT_OBJECT_MAXIMUM_SIZE)
+            object = __JSONCompactObjectCreate(json->allocator, keys, values, entry->keysIndex);
+          if (object == NULL) {
+            if (json->containers)
+              object = __JSONContainerTableCreateDictionary(json->allocator, json->containers, keys, values, entry->keysIndex);
+            else
+              object = CFDictionaryCreate(json->allocator, keys, values, entry->keysIndex, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+          }
+          json->elements[entry->index] = object;
           CFAllocatorDeallocate(entry->allocator, values);
           success = 1;
         }
@@ -316,7 +410,8 @@ inline int __JSONParserAppendArrayStart(void *context) {
   __JSONStackAppendValueAtTop(json->stack, index);
   
   // Push this element as the new container
-  __JSONStackEntryRef entry = __JSONStackEntryCreate(json->allocator, index, CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE, 0);
+  CFIndex size = json->shape ? __JSONShapeGetSize(json->shape->arraySizes, json->stack->index, CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE) : CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE;
+  __JSONStackEntryRef entry = __JSONStackEntryCreate(json->scratchAllocator, index, size, 0);
   __JSONStackPush(json->stack, entry);
   __JSONStackEntryRelease(entry);
   
@@ -328,9 +423,14 @@ inline int __JSONParserAppendArrayEnd(void *context) {
   __JSONRef json = (__JSONRef)context;
   __JSONStackEntryRef entry = __JSONStackPop(json->stack);
   if (entry) {
+    if (json->shape)
+      __JSONShapeObserve(json->shape->observedArraySizes, json->stack->index, entry->valuesIndex);
     CFTypeRef *values = __JSONStackEntryCreateValues(entry, json->elements); // TODO: change allocation to here.
     if (values) {
-      json->elements[entry->index] = CFArrayCreate(json->allocator, values, entry->valuesIndex, &kCFTypeArrayCallBacks);
+      if (json->containers)
+        json->elements[entry->index] = __JSONContainerTableCreateArray(json->allocator, json->containers, values, entry->valuesIndex);
+      else
+        json->elements[entry->index] = CFArrayCreate(json->allocator, values, entry->valuesIndex, &kCFTypeArrayCallBacks);
       CFAllocatorDeallocate(entry->allocator, values);
       success = 1;
     }
@@ -343,7 +443,7 @@ inline CFIndex __JSONElementsAppend(__JSONRef json, CFTypeRef value) {
   CFIndex index = json->elementsIndex;
   if (json->elementsIndex == json->elementsSize) { // Reallocate
     CFIndex largerSize = json->elementsSize ? json->elementsSize << 1 : CORE_JSON_ELEMENTS_INITIAL_SIZE;
-    CFTypeRef *largerElements = CFAllocatorReallocate(json->allocator, json->elements, sizeof(CFTypeRef) * largerSize, 0);
+    CFTypeRef *largerElements = CFAllocatorReallocate(json->scratchAllocator, json->elements, sizeof(CFTypeRef) * largerSize, 0);
     if (largerElements) {
       json->elementsSize = largerSize;
       json->elements = largerElements;
@@ -368,276 +468,4741 @@ inline void *__JSONAllocatorReallocate(void *ctx, void *ptr, size_t sz) {
   return CFAllocatorReallocate(ctx, ptr, sz, 0);
 }
 
-inline __JSONRef __JSONCreate(CFAllocatorRef allocator, JSONReadOptions options) {
-  __JSONRef json = CFAllocatorAllocate(allocator, sizeof(__JSON), 0);
-  if (json) {
-    json->allocator = allocator ? CFRetain(allocator) : NULL;
-    json->retainCount = 1;
-    
-    json->yajlAllocFuncs.ctx     = (void *)json->allocator;
-    json->yajlAllocFuncs.malloc  = __JSONAllocatorAllocate;
-    json->yajlAllocFuncs.realloc = __JSONAllocatorReallocate;
-    json->yajlAllocFuncs.free    = __JSONAllocatorDeallocate;
-    
-    json->yajlParserCallbacks.yajl_null        = __JSONParserAppendNull;
-    json->yajlParserCallbacks.yajl_boolean     = __JSONParserAppendBooleanWithInteger;
-    
-    // Set number or integer and double. Never all 3.
-    json->yajlParserCallbacks.yajl_number      = __JSONParserAppendNumberWithBytes;
-    json->yajlParserCallbacks.yajl_integer     = NULL; // __JSONParserAppendNumberWithLong
-    json->yajlParserCallbacks.yajl_double      = NULL; // __JSONParserAppendNumberWithDouble
-    
-    json->yajlParserCallbacks.yajl_start_map   = __JSONParserAppendMapStart;
-    json->yajlParserCallbacks.yajl_map_key     = __JSONParserAppendMapKeyWithBytes;
-    json->yajlParserCallbacks.yajl_end_map     = __JSONParserAppendMapEnd;
-    
-    json->yajlParserCallbacks.yajl_start_array = __JSONParserAppendArrayStart;
-    json->yajlParserCallbacks.yajl_end_array   = __JSONParserAppendArrayEnd;
+#pragma Scratch arena allocator
+
+#define __JSON_ARENA_ALIGNMENT 16
+
+static inline CFIndex __JSONArenaChunkHeaderSize(void) {
+  return (sizeof(__JSONArenaChunk) + __JSON_ARENA_ALIGNMENT - 1) & ~(__JSON_ARENA_ALIGNMENT - 1);
+}
+
+// Size class k holds blocks of 2^k bytes, including alignment sized header with the class.
+static inline CFIndex __JSONArenaSizeClass(CFIndex size) {
+  CFIndex k = 5;
+  while (k < CORE_JSON_ARENA_SIZE_CLASSES - 1 && ((CFIndex)1 << k) < size + __JSON_ARENA_ALIGNMENT)
+    k++;
+  return k;
+}
+
+static void *__JSONArenaAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  __JSONArenaRef arena = (__JSONArenaRef)info;
+  CFIndex k = __JSONArenaSizeClass(size);
+  CFIndex blockSize = (CFIndex)1 << k;
+  unsigned char *block = arena->freeLists[k];
+  if (block) {
+    arena->freeLists[k] = *(void **)(block + __JSON_ARENA_ALIGNMENT);
+  } else {
     
-    json->yajlParserCallbacks.yajl_string      = __JSONParserAppendStringWithBytes;
+    // Move to the next retained chunk or insert a new one after the current one
+    if (arena->current == NULL || arena->offset + blockSize > arena->current->size) {
+      __JSONArenaChunkRef next = arena->current ? arena->current->next : arena->first;
+      if (next == NULL || __JSONArenaChunkHeaderSize() + blockSize > next->size) {
+        CFIndex chunkSize = __JSONArenaChunkHeaderSize() + blockSize;
+        if (chunkSize < CORE_JSON_ARENA_CHUNK_SIZE)
+          chunkSize = CORE_JSON_ARENA_CHUNK_SIZE;
+        __JSONArenaChunkRef chunk = CFAllocatorAllocate(arena->allocator, chunkSize, 0);
+        if (chunk == NULL)
+          return NULL;
+        chunk->size = chunkSize;
+        chunk->next = next;
+        if (arena->current)
+          arena->current->next = chunk;
+        else
+          arena->first = chunk;
+        next = chunk;
+      }
+      arena->current = next;
+      arena->offset = __JSONArenaChunkHeaderSize();
+    }
+    block = (unsigned char *)arena->current + arena->offset;
+    arena->offset += blockSize;
+  }
+#if CORE_JSON_STATISTICS
+  arena->allocationsCount++;
+  arena->allocatedSize += blockSize;
+#endif
+  *(CFIndex *)block = k;
+  return block + __JSON_ARENA_ALIGNMENT;
+}
+
+static void __JSONArenaDeallocate(void *ptr, void *info) {
+  __JSONArenaRef arena = (__JSONArenaRef)info;
+  unsigned char *block = (unsigned char *)ptr - __JSON_ARENA_ALIGNMENT;
+  CFIndex k = *(CFIndex *)block;
+  *(void **)ptr = arena->freeLists[k];
+  arena->freeLists[k] = block;
+}
+
+static void *__JSONArenaReallocate(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info) {
+  CFIndex k = *(CFIndex *)((unsigned char *)ptr - __JSON_ARENA_ALIGNMENT);
+  if (__JSONArenaSizeClass(newsize) == k)
+    return ptr;
+  void *newptr = __JSONArenaAllocate(newsize, hint, info);
+  if (newptr) {
+    CFIndex size = ((CFIndex)1 << k) - __JSON_ARENA_ALIGNMENT;
+    memcpy(newptr, ptr, size < newsize ? size : newsize);
+    __JSONArenaDeallocate(ptr, info);
+  }
+  return newptr;
+}
+
+static void __JSONArenaRelease(const void *info) {
+  __JSONArenaRef arena = (__JSONArenaRef)info;
+  CFAllocatorRef allocator = arena->allocator;
+  while (arena->first) {
+    __JSONArenaChunkRef next = arena->first->next;
+    CFAllocatorDeallocate(allocator, arena->first);
+    arena->first = next;
+  }
+  CFAllocatorDeallocate(allocator, arena);
+  if (allocator)
+    CFRelease(allocator);
+}
+
+// Creates arena allocator backed by allocator, chunks are allocated on first use.
+inline CFAllocatorRef __JSONArenaAllocatorCreate(CFAllocatorRef allocator) {
+  CFAllocatorRef arenaAllocator = NULL;
+  __JSONArenaRef arena = CFAllocatorAllocate(allocator, sizeof(__JSONArena), 0);
+  if (arena) {
+    memset(arena, 0, sizeof(__JSONArena));
+    arena->allocator = allocator ? CFRetain(allocator) : NULL;
+    CFAllocatorContext context = { 0, arena, NULL, __JSONArenaRelease, NULL, __JSONArenaAllocate, __JSONArenaReallocate, __JSONArenaDeallocate, NULL };
+    if (NULL == (arenaAllocator = CFAllocatorCreate(allocator, &context)))
+      __JSONArenaRelease(arena);
+  }
+  return arenaAllocator;
+}
+
+// Drops all allocated blocks. Chunks are kept for reuse up to CORE_JSON_ARENA_RETAINED_SIZE,
+// so in the usual case this is just a pointer reset.
+inline void __JSONArenaAllocatorReset(CFAllocatorRef arenaAllocator) {
+  CFAllocatorContext context;
+  CFAllocatorGetContext(arenaAllocator, &context);
+  __JSONArenaRef arena = (__JSONArenaRef)context.info;
+  arena->current = NULL;
+  arena->offset = 0;
+  memset(arena->freeLists, 0, sizeof(arena->freeLists));
+  if (arena->first && arena->first->next) {
+    CFIndex size = arena->first->size;
+    __JSONArenaChunkRef chunk = arena->first;
+    while (chunk->next && size + chunk->next->size <= CORE_JSON_ARENA_RETAINED_SIZE) {
+      chunk = chunk->next;
+      size += chunk->size;
+    }
+    while (chunk->next) {
+      __JSONArenaChunkRef next = chunk->next->next;
+      CFAllocatorDeallocate(arena->allocator, chunk->next);
+      chunk->next = next;
+    }
+  }
+}
+
+#pragma Region allocator
+
+static void *__JSONRegionAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  __JSONRegionRef region = (__JSONRegionRef)info;
+  CFIndex blockSize = (size + __JSON_ARENA_ALIGNMENT - 1) & ~(__JSON_ARENA_ALIGNMENT - 1);
+  if (region->current == NULL || region->offset + blockSize > region->current->size) {
     
-    json->elementsIndex = 0;
-    json->elementsSize = CORE_JSON_ELEMENTS_INITIAL_SIZE;
-    if (NULL == (json->elements = CFAllocatorAllocate(json->allocator, sizeof(CFTypeRef) * json->elementsSize, 0)))
-      json = __JSONRelease(json);
+    // Chunks grow with the document, so small documents stay small
+    CFIndex chunkSize = region->current ? region->current->size << 1 : CORE_JSON_REGION_CHUNK_INITIAL_SIZE;
+    if (chunkSize > CORE_JSON_REGION_CHUNK_MAXIMUM_SIZE)
+      chunkSize = CORE_JSON_REGION_CHUNK_MAXIMUM_SIZE;
+    if (chunkSize < __JSONArenaChunkHeaderSize() + blockSize)
+      chunkSize = __JSONArenaChunkHeaderSize() + blockSize;
+    __JSONArenaChunkRef chunk = CFAllocatorAllocate(region->allocator, chunkSize, 0);
+    if (chunk == NULL)
+      return NULL;
+    chunk->size = chunkSize;
+    chunk->next = NULL;
+    if (region->current)
+      region->current->next = chunk;
+    else
+      region->first = chunk;
+    region->current = chunk;
+    region->offset = __JSONArenaChunkHeaderSize();
+    region->size += chunkSize;
+  }
+  region->last = (unsigned char *)region->current + region->offset;
+  region->offset += blockSize;
+  return region->last;
+}
 
-    if (json)
-      if (NULL == (json->stack = __JSONStackCreate(json->allocator, CORE_JSON_STACK_INITIAL_SIZE)))
-        json = __JSONRelease(json);
+static void __JSONRegionDeallocate(void *ptr, void *info) {
+}
+
+// Blocks don't have headers, the last block is resized in place, others are copied up to the
+// end of the chunk they are in.
+static void *__JSONRegionReallocate(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info) {
+  __JSONRegionRef region = (__JSONRegionRef)info;
+  CFIndex blockSize = (newsize + __JSON_ARENA_ALIGNMENT - 1) & ~(__JSON_ARENA_ALIGNMENT - 1);
+  if (ptr == region->last && (unsigned char *)ptr - (unsigned char *)region->current + blockSize <= region->current->size) {
+    region->offset = (unsigned char *)ptr - (unsigned char *)region->current + blockSize;
+    return ptr;
   }
-  return json;
+  CFIndex size = newsize;
+  for (__JSONArenaChunkRef chunk = region->first; chunk; chunk = chunk->next)
+    if ((unsigned char *)ptr > (unsigned char *)chunk && (unsigned char *)ptr < (unsigned char *)chunk + chunk->size) {
+      CFIndex available = (unsigned char *)chunk + (chunk == region->current ? region->offset : chunk->size) - (unsigned char *)ptr;
+      if (size > available)
+        size = available;
+      break;
+    }
+  void *newptr = __JSONRegionAllocate(newsize, hint, info);
+  if (newptr)
+    memcpy(newptr, ptr, size);
+  return newptr;
 }
 
-inline __JSONRef __JSONRelease(__JSONRef json) {
-  if (json) {
-    if (--json->retainCount == 0) {
-      CFAllocatorRef allocator = json->allocator;
-      
-      if (json->elements) {
-        while (--json->elementsIndex >= 0)
-          CFRelease(json->elements[json->elementsIndex]);
-        CFAllocatorDeallocate(allocator, json->elements);
-      }
-      
-      if (json->stack)
-        json->stack = __JSONStackRelease(json->stack);
-      
-      CFAllocatorDeallocate(allocator, json);
-      
-      if (allocator)
-        CFRelease(allocator);
-      
-      json = NULL;
+inline __JSONRegionRef __JSONRegionCreate(CFAllocatorRef allocator) {
+  __JSONRegionRef region = CFAllocatorAllocate(allocator, sizeof(__JSONRegion), 0);
+  if (region) {
+    region->allocator = allocator ? CFRetain(allocator) : NULL;
+    region->first = NULL;
+    region->current = NULL;
+    region->offset = 0;
+    region->last = NULL;
+    region->size = 0;
+  }
+  return region;
+}
+
+// Frees all objects allocated in the region at once.
+inline void __JSONRegionDestroy(__JSONRegionRef region) {
+  if (region) {
+    CFAllocatorRef allocator = region->allocator;
+    while (region->first) {
+      __JSONArenaChunkRef next = region->first->next;
+      CFAllocatorDeallocate(allocator, region->first);
+      region->first = next;
     }
+    CFAllocatorDeallocate(allocator, region);
+    if (allocator)
+      CFRelease(allocator);
   }
-  return json;
 }
 
-inline bool __JSONParseWithString(__JSONRef json, CFStringRef string, CFErrorRef *error) {
-  bool success = 1;
-  json->yajlParser = yajl_alloc(&json->yajlParserCallbacks, &json->yajlAllocFuncs, (void *)json);
-  if (json->yajlParser) {
-//  yajl_config(json->yajlParser, yajl_allow_comments, kJSONReadOptionAllowComments | options ? 1 : 0);
-//  yajl_config(json->yajlParser, yajl_dont_validate_strings, kJSONReadOptionCheckUTF8 | options ? 1 : 0);
+// The allocator object is allocated in the region itself (kCFAllocatorUseContext), objects
+// created with it keep it retained until the region is destroyed.
+inline CFAllocatorRef __JSONRegionAllocatorCreate(__JSONRegionRef region) {
+  CFAllocatorContext context = { 0, region, NULL, NULL, NULL, __JSONRegionAllocate, __JSONRegionReallocate, __JSONRegionDeallocate, NULL };
+  return CFAllocatorCreate(kCFAllocatorUseContext, &context);
+}
+
+#pragma String table
+
+// FNV-1a
+static inline CFHashCode __JSONStringTableHash(const unsigned char *value, size_t length) {
+  CFHashCode hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ value[i]) * 16777619u;
+  return hash;
+}
+
+// Returns retained string, shared with previous byte identical strings if it's short enough.
+inline CFStringRef __JSONStringTableCreateString(CFAllocatorRef allocator, __JSONStringTableRef table, const unsigned char *value, size_t length) {
+  if (length > CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH)
+    return CFStringCreateWithBytes(allocator, value, length, kCFStringEncodingUTF8, 0);
   
-    CFDataRef data = CFStringCreateExternalRepresentation(json->allocator, string, kCFStringEncodingUTF8, 0);
-    if (data) {
-      if ((json->yajlParserStatus = yajl_parse(json->yajlParser, CFDataGetBytePtr(data), CFDataGetLength(data))) != yajl_status_ok) {
-        if (error) {
-          success = 0;
-          
-          unsigned char * str = yajl_get_error(json->yajlParser, 1, CFDataGetBytePtr(data), CFDataGetLength(data));
-          fprintf(stderr, "%s", (const char *) str);
-          yajl_free_error(json->yajlParser, str);
-          
-          *error = CFErrorCreateWithUserInfoKeysAndValues(json->allocator, CFSTR("com.github.mirek.CoreJSON"), (CFIndex)json->yajlParserStatus, (const void *) { kCFErrorDescriptionKey }, (const void *) { CFSTR("Test") }, 1);
-        }
-        // TODO: Error stuff
-        //printf("ERROR: %s\n", yajl_get_error(json->yajlParser, 1, __JSONUTF8StringGetBuffer(utf8), __JSONUTF8StringGetMaximumSize(utf8)));
-      }
-    
-      json->yajlParserStatus = yajl_complete_parse(json->yajlParser);
-      CFRelease(data);
-    } else {
-      success = 0;
-      // TODO: data is 0
+  CFHashCode hash = __JSONStringTableHash(value, length);
+  CFIndex i = hash & (CORE_JSON_STRING_TABLE_SIZE - 1);
+  while (table->slots[i].string) {
+    __JSONStringTableSlot *slot = &table->slots[i];
+    if (slot->hash == hash && slot->length == (CFIndex)length && memcmp(slot->bytes, value, length) == 0) {
+      table->savedCount++;
+      table->savedSize += length;
+      return CFRetain(slot->string);
     }
-    yajl_free(json->yajlParser);
-    json->yajlParser = NULL;
-  } else {
-    
-    // TODO: Couldn't allocate
-    *error = CFErrorCreate(json->allocator, CFSTR("com.github.mirek.CoreJSON"), -1, NULL);
-    success = 0;
+    i = (i + 1) & (CORE_JSON_STRING_TABLE_SIZE - 1);
   }
   
-  return success;
+  CFStringRef string = CFStringCreateWithBytes(allocator, value, length, kCFStringEncodingUTF8, 0);
+  if (string && table->count < (CORE_JSON_STRING_TABLE_SIZE >> 2) * 3) {
+    __JSONStringTableSlot *slot = &table->slots[i];
+    slot->hash = hash;
+    slot->length = length;
+    slot->string = string;
+    memcpy(slot->bytes, value, length);
+    table->count++;
+  }
+  return string;
 }
 
-inline CFTypeRef JSONCreateWithString(CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, CFErrorRef *error) {
-  CFTypeRef result = NULL;
-  __JSONRef json = NULL;
-  if ((json = __JSONCreate(allocator, options))) {
-    __JSONParseWithString(json, string, error);
-    if ((result = __JSONCreateObject(json))) {
-      // TODO: Set error
+#pragma Strings
+
+// Short strings are shared with kJSONReadOptionUniqueStrings. Others are created without copying
+// if bytes point into pinned input - yajl passes strings without escapes straight from the input
+// buffer, decoded strings come from its own buffer.
+inline CFStringRef __JSONCreateStringWithBytes(__JSONRef json, const unsigned char *value, size_t length) {
+  if (json->strings && length <= CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH)
+    return __JSONStringTableCreateString(json->allocator, json->strings, value, length);
+  if (json->bytesDeallocator && value >= json->bytes && value + length <= json->bytes + json->bytesLength)
+    return CFStringCreateWithBytesNoCopy(json->allocator, value, length, kCFStringEncodingUTF8, 0, json->bytesDeallocator);
+  return CFStringCreateWithBytes(json->allocator, value, length, kCFStringEncodingUTF8, 0);
+}
+
+static void *__JSONBytesDeallocatorAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  return NULL;
+}
+
+static void __JSONBytesDeallocatorDeallocate(void *ptr, void *info) {
+}
+
+// Contents deallocator for no copy strings. Each string retains it, the allocator retains data
+// and releases it when the last string is gone.
+inline CFAllocatorRef __JSONBytesDeallocatorCreate(CFAllocatorRef allocator, CFDataRef data) {
+  CFAllocatorContext context = {
+    0, (void *)data, CFRetain, CFRelease, NULL,
+    __JSONBytesDeallocatorAllocate, NULL, __JSONBytesDeallocatorDeallocate, NULL
+  };
+  return CFAllocatorCreate(allocator, &context);
+}
+
+#pragma Compact objects
+
+#define __JSON_COMPACT_OBJECT_MAGIC 0x4a534f4e
+
+static void *__JSONCompactObjectDeallocatorAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  return NULL;
+}
+
+static void __JSONCompactObjectDeallocatorDeallocate(void *ptr, void *info) {
+  __JSONCompactObject *object = (__JSONCompactObject *)ptr;
+  CFAllocatorRef allocator = object->allocator;
+  for (CFIndex i = 0; i < object->count << 1; i++)
+    CFRelease(object->entries[i]);
+  CFAllocatorDeallocate(allocator, object);
+  if (allocator)
+    CFRelease(allocator);
+}
+
+static pthread_once_t __JSONCompactObjectDeallocatorOnce = PTHREAD_ONCE_INIT;
+static CFAllocatorRef __JSONCompactObjectDeallocator = NULL;
+
+static void __JSONCompactObjectDeallocatorInitialize(void) {
+  CFAllocatorContext context = {
+    0, NULL, NULL, NULL, NULL,
+    __JSONCompactObjectDeallocatorAllocate, NULL, __JSONCompactObjectDeallocatorDeallocate, NULL
+  };
+  __JSONCompactObjectDeallocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+}
+
+// Returns NULL if keys are not unique, dictionary should be created instead.
+inline CFDataRef __JSONCompactObjectCreate(CFAllocatorRef allocator, CFTypeRef *keys, CFTypeRef *values, CFIndex count) {
+  for (CFIndex i = 1; i < count; i++)
+    for (CFIndex j = 0; j < i; j++)
+      if (CFEqual(keys[i], keys[j]))
+        return NULL;
+  
+  pthread_once(&__JSONCompactObjectDeallocatorOnce, __JSONCompactObjectDeallocatorInitialize);
+  CFIndex size = sizeof(__JSONCompactObject) + sizeof(CFTypeRef) * (count << 1);
+  __JSONCompactObject *object = CFAllocatorAllocate(allocator, size, 0);
+  CFDataRef data = NULL;
+  if (object) {
+    object->magic = __JSON_COMPACT_OBJECT_MAGIC;
+    object->bytes = object;
+    object->allocator = allocator ? CFRetain(allocator) : NULL;
+    object->count = count;
+    for (CFIndex i = 0; i < count; i++) {
+      object->entries[i] = CFRetain(keys[i]);
+      object->entries[count + i] = CFRetain(values[i]);
     }
-    __JSONRelease(json);
+    if (NULL == (data = CFDataCreateWithBytesNoCopy(allocator, (const UInt8 *)object, size, __JSONCompactObjectDeallocator)))
+      __JSONCompactObjectDeallocatorDeallocate(object, NULL);
   }
-  return result;
+  return data;
 }
 
-inline CFTypeRef __JSONCreateObject(__JSONRef json) {
-  return (json && json->elements && json->elementsIndex && *json->elements) ? CFRetain(*json->elements) : NULL;
+inline __JSONCompactObjectRef __JSONCompactObjectGet(CFTypeRef value) {
+  if (value && CFGetTypeID(value) == CFDataGetTypeID() && CFDataGetLength(value) >= (CFIndex)sizeof(__JSONCompactObject)) {
+    __JSONCompactObjectRef object = (__JSONCompactObjectRef)CFDataGetBytePtr(value);
+    if (object->magic == __JSON_COMPACT_OBJECT_MAGIC && object->bytes == object)
+      return object;
+  }
+  return NULL;
 }
 
-#pragma Generator
+inline bool JSONObjectIsCompact(CFTypeRef object) {
+  return __JSONCompactObjectGet(object) != NULL;
+}
 
-inline void __JSONGeneratorAppendString(CFAllocatorRef allocator, yajl_gen *g, CFStringRef value) {
-  CFDataRef data = CFStringCreateExternalRepresentation(allocator, value, kCFStringEncodingUTF8, 0);
-  if (data) {
-    yajl_gen_string(*g, CFDataGetBytePtr(data), CFDataGetLength(data));
-    CFRelease(data);
+inline CFIndex JSONObjectGetCount(CFTypeRef object) {
+  __JSONCompactObjectRef compact = __JSONCompactObjectGet(object);
+  return compact ? compact->count : CFDictionaryGetCount(object);
+}
+
+inline CFTypeRef JSONObjectGetValue(CFTypeRef object, CFTypeRef key) {
+  __JSONCompactObjectRef compact = __JSONCompactObjectGet(object);
+  if (compact) {
+    for (CFIndex i = 0; i < compact->count; i++)
+      if (compact->entries[i] == key)
+        return compact->entries[compact->count + i];
+    for (CFIndex i = 0; i < compact->count; i++)
+      if (CFEqual(compact->entries[i], key))
+        return compact->entries[compact->count + i];
+    return NULL;
+  }
+  return CFDictionaryGetValue(object, key);
+}
+
+inline void JSONObjectGetKeysAndValues(CFTypeRef object, CFTypeRef *keys, CFTypeRef *values) {
+  __JSONCompactObjectRef compact = __JSONCompactObjectGet(object);
+  if (compact) {
+    for (CFIndex i = 0; i < compact->count; i++) {
+      if (keys)
+        keys[i] = compact->entries[i];
+      if (values)
+        values[i] = compact->entries[compact->count + i];
+    }
   } else {
-    // TODO: Error
+    CFDictionaryGetKeysAndValues(object, keys, values);
   }
 }
 
-inline void __JSONGeneratorAppendDoubleTypeNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
-  double value_ = 0.0;
-  CFNumberGetValue(value, kCFNumberDoubleType, &value_);
-  yajl_gen_double(*g, value_);
+inline CFDictionaryRef JSONObjectCreateDictionary(CFAllocatorRef allocator, CFTypeRef object) {
+  __JSONCompactObjectRef compact = __JSONCompactObjectGet(object);
+  if (compact)
+    return CFDictionaryCreate(allocator, (const void **)compact->entries, (const void **)compact->entries + compact->count, compact->count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  return CFDictionaryCreateCopy(allocator, object);
 }
 
-inline void __JSONGeneratorAppendLongLongTypeNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
-  long long value_ = 0;
-  CFNumberGetValue(value, kCFNumberLongLongType, &value_);
-  char buffer[21]; // Maximum string length is "±9223372036854775807\0"
-  int length = sprintf(buffer, "%lld", value_);
-  yajl_gen_number(*g, buffer, length);
+#pragma Lazy numbers
+
+static const char __JSONLazyNumberTag = 0;
+
+// Bytes are assembled on the stack and copied inline into the data object, longer numbers go
+// through a temporary buffer.
+inline CFDataRef __JSONLazyNumberCreate(CFAllocatorRef allocator, const char *digits, size_t length) {
+  CFIndex size = offsetof(__JSONLazyNumber, digits) + length + 1;
+  UInt8 buffer[128];
+  __JSONLazyNumber *number = size <= (CFIndex)sizeof(buffer) ? (__JSONLazyNumber *)buffer : CFAllocatorAllocate(allocator, size, 0);
+  CFDataRef data = NULL;
+  if (number) {
+    number->tag = &__JSONLazyNumberTag;
+    number->length = length;
+    memcpy(number->digits, digits, length);
+    number->digits[length] = 0;
+    
+    // Only long integers can overflow, shorter ones are not decoded here
+    number->isFloat = __JSONNumberHasFloatDigits(digits, length) || (length > 18 && __JSONNumberDecode(number->digits, length).overflow);
+    data = CFDataCreate(allocator, (const UInt8 *)number, size);
+    if ((UInt8 *)number != buffer)
+      CFAllocatorDeallocate(allocator, number);
+  }
+  return data;
 }
 
-inline void __JSONGeneratorAppendNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
-  if (CFNumberIsFloatType(value))
-    __JSONGeneratorAppendDoubleTypeNumber(allocator, g, value);
-  else
-    __JSONGeneratorAppendLongLongTypeNumber(allocator, g, value);
+inline __JSONLazyNumberRef __JSONLazyNumberGet(CFTypeRef value) {
+  if (value && CFGetTypeID(value) == CFDataGetTypeID() && CFDataGetLength(value) > (CFIndex)offsetof(__JSONLazyNumber, digits)) {
+    __JSONLazyNumberRef number = (__JSONLazyNumberRef)CFDataGetBytePtr(value);
+    if (number->tag == &__JSONLazyNumberTag && CFDataGetLength(value) == (CFIndex)offsetof(__JSONLazyNumber, digits) + number->length + 1)
+      return number;
+  }
+  return NULL;
 }
 
-inline void __JSONGeneratorAppendArray(CFAllocatorRef allocator, yajl_gen *g, CFArrayRef value) {
-  yajl_gen_array_open(*g);
-  CFIndex n = CFArrayGetCount(value);
-  CFTypeRef *values = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
-  CFArrayGetValues(value, CFRangeMake(0, n), values);
-  for (CFIndex i = 0; i < n; i++)
-    __JSONGeneratorAppendValue(allocator, g, values[i]);
-  CFAllocatorDeallocate(allocator, values);
-  yajl_gen_array_close(*g);
+inline bool JSONNumberIsLazy(CFTypeRef number) {
+  return __JSONLazyNumberGet(number) != NULL;
 }
 
-inline void __JSONGeneratorAppendDictionary(CFAllocatorRef allocator, yajl_gen *g, CFDictionaryRef value) {
-  yajl_gen_map_open(*g);
-  CFIndex n = CFDictionaryGetCount(value);
-  CFTypeRef *keys = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
-  CFTypeRef *values = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
-  CFDictionaryGetKeysAndValues(value, keys, values);
-  for (CFIndex i = 0; i < n; i++) {
-    __JSONGeneratorAppendValue(allocator, g, keys[i]); // TODO: append as string
-    __JSONGeneratorAppendValue(allocator, g, values[i]);
+inline bool JSONNumberIsFloatType(CFTypeRef number) {
+  __JSONLazyNumberRef lazy = __JSONLazyNumberGet(number);
+  return lazy ? lazy->isFloat : CFNumberIsFloatType(number);
+}
+
+inline bool JSONNumberGetLongLong(CFTypeRef number, long long *value) {
+  __JSONLazyNumberRef lazy = __JSONLazyNumberGet(number);
+  if (lazy) {
+    __JSONNumberValue value_ = __JSONNumberDecode(lazy->digits, lazy->length);
+    *value = value_.integerValue;
+    return !value_.isFloat || (value_.doubleValue >= -9223372036854775808.0 && value_.doubleValue < 9223372036854775808.0 && (double)value_.integerValue == value_.doubleValue);
   }
-  CFAllocatorDeallocate(allocator, values);
-  CFAllocatorDeallocate(allocator, keys);
-  yajl_gen_map_close(*g);
+  return CFNumberGetValue(number, kCFNumberLongLongType, value);
 }
 
-inline void __JSONGeneratorAppendAttributedString(CFAllocatorRef allocator, yajl_gen *g, CFAttributedStringRef value) {
-  __JSONGeneratorAppendString(allocator, g, CFAttributedStringGetString(value));
+inline double JSONNumberGetDouble(CFTypeRef number) {
+  double value = 0;
+  __JSONLazyNumberRef lazy = __JSONLazyNumberGet(number);
+  if (lazy)
+    value = strtod(lazy->digits, NULL);
+  else
+    CFNumberGetValue(number, kCFNumberDoubleType, &value);
+  return value;
 }
 
-inline void __JSONGeneratorAppendBoolean(CFAllocatorRef allocator, yajl_gen *g, CFBooleanRef value) {
-  yajl_gen_bool(*g, CFBooleanGetValue(value));
+// Returns retained number for CFNumberRef, otherwise creates the same number the parser would.
+inline CFNumberRef JSONNumberCreateNumber(CFAllocatorRef allocator, CFTypeRef number) {
+  __JSONLazyNumberRef lazy = __JSONLazyNumberGet(number);
+  if (lazy) {
+    __JSONNumberValue value = __JSONNumberDecode(lazy->digits, lazy->length);
+    if (value.isFloat)
+      return CFNumberCreate(allocator, kCFNumberDoubleType, &value.doubleValue);
+    else
+      return CFNumberCreate(allocator, kCFNumberLongLongType, &value.integerValue);
+  }
+  return CFRetain(number);
 }
 
-inline void __JSONGeneratorAppendNull(CFAllocatorRef allocator, yajl_gen *g, CFNullRef value) {
-  yajl_gen_null(*g);
+#pragma Container table
+
+static inline CFHashCode __JSONContainerTableHashValue(__JSONContainerTableRef table, CFTypeRef value) {
+  CFTypeID typeID = CFGetTypeID(value);
+  if (typeID == table->arrayTypeID || typeID == table->dictionaryTypeID)
+    return (CFHashCode)value >> 4;
+  return CFHash(value) * 31 + typeID;
 }
 
-inline void __JSONGeneratorAppendURL(CFAllocatorRef allocator, yajl_gen *g, CFURLRef value) {
-  __JSONGeneratorAppendString(allocator, g, CFURLGetString(value));
+// Child containers are equal only if they're the same object, so the comparison never recurses.
+// Numbers have to match in float-ness as well, 1 and 1.0 are generated differently.
+static inline bool __JSONContainerTableEqualValues(__JSONContainerTableRef table, CFTypeRef a, CFTypeRef b) {
+  if (a == b)
+    return 1;
+  CFTypeID typeID = CFGetTypeID(a);
+  if (typeID != CFGetTypeID(b) || typeID == table->arrayTypeID || typeID == table->dictionaryTypeID)
+    return 0;
+  if (typeID == CFNumberGetTypeID() && CFNumberIsFloatType(a) != CFNumberIsFloatType(b))
+    return 0;
+  return CFEqual(a, b);
 }
 
-inline void __JSONGeneratorAppendUUID(CFAllocatorRef allocator, yajl_gen *g, CFUUIDRef value) {
-  CFStringRef string = CFUUIDCreateString(allocator, value);
-  __JSONGeneratorAppendString(allocator, g, string);
-  CFRelease(string);
+static inline bool __JSONContainerTableEqualArray(__JSONContainerTableRef table, CFTypeRef container, CFTypeRef *values, CFIndex count) {
+  if (CFGetTypeID(container) != table->arrayTypeID || CFArrayGetCount(container) != count)
+    return 0;
+  for (CFIndex i = 0; i < count; i++)
+    if (!__JSONContainerTableEqualValues(table, CFArrayGetValueAtIndex(container, i), values[i]))
+      return 0;
+  return 1;
 }
 
-inline void __JSONGeneratorAppendValue(CFAllocatorRef allocator, yajl_gen *g, CFTypeRef value) {
-  if (value) {
-    CFTypeID typeID = CFGetTypeID(value);
-         if (typeID == CFStringGetTypeID())           __JSONGeneratorAppendString           (allocator, g, value);
-    else if (typeID == CFNumberGetTypeID())           __JSONGeneratorAppendNumber           (allocator, g, value);
-    else if (typeID == CFArrayGetTypeID())            __JSONGeneratorAppendArray            (allocator, g, value);
-    else if (typeID == CFDictionaryGetTypeID())       __JSONGeneratorAppendDictionary       (allocator, g, value);
-    else if (typeID == CFAttributedStringGetTypeID()) __JSONGeneratorAppendAttributedString (allocator, g, value);
-//    else if (typeID == CFBagGetTypeID())              __JSONGeneratorAppendBag              (allocator, g, value);
-//    else if (typeID == CFBinaryHeapGetTypeID())       __JSONGeneratorAppendBinaryHeap       (allocator, g, value);
-//    else if (typeID == CFBitVectorGetTypeID())        __JSONGeneratorAppendBitVector        (allocator, g, value);
-    else if (typeID == CFBooleanGetTypeID())          __JSONGeneratorAppendBoolean          (allocator, g, value);
-//    else if (typeID == CFDataGetTypeID())             __JSONGeneratorAppendData             (allocator, g, value);
-//    else if (typeID == CFDateGetTypeID())             __JSONGeneratorAppendDate             (allocator, g, value);
-    else if (typeID == CFNullGetTypeID())             __JSONGeneratorAppendNull             (allocator, g, value);
-//    else if (typeID == CFSetGetTypeID())              __JSONGeneratorAppendSet              (allocator, g, value);
-//    else if (typeID == CFTreeGetTypeID())             __JSONGeneratorAppendTree             (allocator, g, value);
-    else if (typeID == CFURLGetTypeID())              __JSONGeneratorAppendURL              (allocator, g, value);
-    else if (typeID == CFUUIDGetTypeID())             __JSONGeneratorAppendUUID             (allocator, g, value);
+static inline bool __JSONContainerTableEqualDictionary(__JSONContainerTableRef table, CFTypeRef container, CFTypeRef *keys, CFTypeRef *values, CFIndex count) {
+  if (CFGetTypeID(container) != table->dictionaryTypeID || CFDictionaryGetCount(container) != count)
+    return 0;
+  for (CFIndex i = 0; i < count; i++) {
+    CFTypeRef value = CFDictionaryGetValue(container, keys[i]);
+    if (value == NULL || !__JSONContainerTableEqualValues(table, value, values[i]))
+      return 0;
   }
+  return 1;
 }
 
-inline CFStringRef JSONCreateString(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, CFErrorRef *error) {
-  yajl_alloc_funcs yajlAllocFuncs;
-  yajlAllocFuncs.ctx = (void *)allocator;
-  yajlAllocFuncs.malloc = __JSONAllocatorAllocate;
-  yajlAllocFuncs.free = __JSONAllocatorDeallocate;
-  yajlAllocFuncs.realloc = __JSONAllocatorReallocate;
-//  yajl_gen_config yajlGenConfig;
-//  yajlGenConfig.beautify     = options | kJSONWriteOptionIndent ? 1 : 0;
-//  yajlGenConfig.indentString = options | kJSONWriteOptionIndent ? "  " : 0;
-  yajl_gen yajlGen = yajl_gen_alloc(&yajlAllocFuncs);
-  __JSONGeneratorAppendValue(allocator, &yajlGen, value);
-  const unsigned char *buffer = NULL;
-  size_t length = 0;
-  switch (yajl_gen_get_buf(yajlGen, &buffer, &length)) {
-    case yajl_gen_status_ok: // no error
-      break;
+// Returns slot index of the matching container or of the empty slot where it should be inserted.
+static inline CFIndex __JSONContainerTableFind(__JSONContainerTableRef table, CFHashCode hash, CFTypeRef *keys, CFTypeRef *values, CFIndex count) {
+  CFIndex i = hash & (CORE_JSON_CONTAINER_TABLE_SIZE - 1);
+  while (table->slots[i].value) {
+    __JSONContainerTableSlot *slot = &table->slots[i];
+    if (slot->hash == hash) {
+      if (keys ?
+          __JSONContainerTableEqualDictionary(table, slot->value, keys, values, count) :
+          __JSONContainerTableEqualArray(table, slot->value, values, count))
+        return i;
+    }
+    i = (i + 1) & (CORE_JSON_CONTAINER_TABLE_SIZE - 1);
+  }
+  return i;
+}
 
-    case yajl_gen_keys_must_be_strings: // at a point where a map key is generated, a function other than yajl_gen_string was called 
-      break;
-      
-    case yajl_max_depth_exceeded: //  YAJL's maximum generation depth was exceeded. See YAJL_MAX_DEPTH
-      break;
-      
-    case yajl_gen_in_error_state: // A generator function (yajl_gen_XXX) was called while in an error state
-      break;
-      
-    case yajl_gen_generation_complete: // A complete JSON document has been generated
-      break;
-      
-    case yajl_gen_invalid_number: // yajl_gen_double was passed an invalid floating point value (infinity or NaN)
-      break;
-      
-    case yajl_gen_invalid_string: // returned from yajl_gen_string() when the yajl_gen_validate_utf8 option is enabled and an invalid was passed by client code.
-      break;
-      
-    case yajl_gen_no_buf: // A print callback was passed in, so there is no internal buffer to get from
-      break;
+static inline CFTypeRef __JSONContainerTableCreate(CFAllocatorRef allocator, __JSONContainerTableRef table, CFTypeRef *keys, CFTypeRef *values, CFIndex count) {
+  if (table->arrayTypeID == 0) {
+    table->arrayTypeID = CFArrayGetTypeID();
+    table->dictionaryTypeID = CFDictionaryGetTypeID();
+  }
+  
+  // Dictionaries are unordered, pairs are combined with order independent sum
+  CFHashCode hash = count;
+  for (CFIndex i = 0; i < count; i++) {
+    if (keys)
+      hash += (__JSONContainerTableHashValue(table, keys[i]) * 16777619u) ^ __JSONContainerTableHashValue(table, values[i]);
+    else
+      hash = hash * 31 + __JSONContainerTableHashValue(table, values[i]);
+  }
+  hash = keys ? ~hash : hash;
+  
+  CFIndex i = __JSONContainerTableFind(table, hash, keys, values, count);
+  __JSONContainerTableSlot *slot = &table->slots[i];
+  if (slot->value) {
+    table->savedCount++;
+    table->savedValuesCount += count;
+    return CFRetain(slot->value);
+  }
+  
+  CFTypeRef container = keys ?
+    (CFTypeRef)CFDictionaryCreate(allocator, keys, values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks) :
+    (CFTypeRef)CFArrayCreate(allocator, values, count, &kCFTypeArrayCallBacks);
+  if (container && table->count < (CORE_JSON_CONTAINER_TABLE_SIZE >> 2) * 3) {
+    slot->hash = hash;
+    slot->value = container;
+    table->count++;
+  }
+  return container;
+}
+
+// Returns retained array, shared with a previous identical array if there was one.
+inline CFArrayRef __JSONContainerTableCreateArray(CFAllocatorRef allocator, __JSONContainerTableRef table, CFTypeRef *values, CFIndex count) {
+  return __JSONContainerTableCreate(allocator, table, NULL, values, count);
+}
+
+// Returns retained dictionary, shared with a previous identical dictionary if there was one.
+inline CFDictionaryRef __JSONContainerTableCreateDictionary(CFAllocatorRef allocator, __JSONContainerTableRef table, CFTypeRef *keys, CFTypeRef *values, CFIndex count) {
+  return __JSONContainerTableCreate(allocator, table, keys, values, count);
+}
+
+#pragma Shape statistics
+
+inline void __JSONShapeInitialize(__JSONShapeRef shape) {
+  shape->elementsSize = CORE_JSON_ELEMENTS_INITIAL_SIZE;
+  for (CFIndex i = 0; i < CORE_JSON_STACK_INITIAL_SIZE; i++) {
+    shape->arraySizes[i] = CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE;
+    shape->mapSizes[i] = CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE;
+    shape->observedArraySizes[i] = 0;
+    shape->observedMapSizes[i] = 0;
+  }
+}
+
+inline CFIndex __JSONShapeGetSize(CFIndex *sizes, CFIndex depth, CFIndex defaultSize) {
+  return depth < CORE_JSON_STACK_INITIAL_SIZE ? sizes[depth] : defaultSize;
+}
+
+inline void __JSONShapeObserve(CFIndex *observedSizes, CFIndex depth, CFIndex size) {
+  if (depth < CORE_JSON_STACK_INITIAL_SIZE && observedSizes[depth] < size)
+    observedSizes[depth] = size;
+}
+
+static inline CFIndex __JSONShapeLearnSize(CFIndex size, CFIndex observedSize) {
+  return observedSize >= size ? observedSize : (size + observedSize) >> 1;
+}
+
+// Updates learned sizes with sizes observed during successful parse and starts observing again.
+inline void __JSONShapeLearn(__JSONShapeRef shape, CFIndex elementsCount) {
+  shape->elementsSize = __JSONShapeLearnSize(shape->elementsSize, elementsCount);
+  if (shape->elementsSize < CORE_JSON_MINIMUM_SIZE)
+    shape->elementsSize = CORE_JSON_MINIMUM_SIZE;
+  for (CFIndex i = 0; i < CORE_JSON_STACK_INITIAL_SIZE; i++) {
+    shape->arraySizes[i] = __JSONShapeLearnSize(shape->arraySizes[i], shape->observedArraySizes[i]);
+    shape->mapSizes[i] = __JSONShapeLearnSize(shape->mapSizes[i], shape->observedMapSizes[i]);
+    shape->observedArraySizes[i] = 0;
+    shape->observedMapSizes[i] = 0;
+  }
+}
+
+#pragma Statistics
+
+#if CORE_JSON_STATISTICS
+
+typedef struct {
+  uint64_t            time;
+  CFIndex             elementsSize;
+  __JSONStackEntryRef top;
+  CFIndex             topSize;
+} __JSONStatisticsSample;
+
+static inline void __JSONStatisticsSampleBegin(__JSONRef json, __JSONStatisticsSample *sample) {
+  sample->elementsSize = json->elementsSize;
+  sample->top = __JSONStackGetTop(json->stack);
+  sample->topSize = sample->top ? sample->top->valuesSize + sample->top->keysSize : 0;
+  sample->time = __JSONTraceGetTime();
+}
+
+// Regrowth of the top stack entry can be checked only if it's still on the stack.
+static inline void __JSONStatisticsSampleEnd(__JSONRef json, __JSONStatisticsSample *sample, CFTimeInterval *time, bool popped) {
+  JSONParserStatistics *statistics = json->statistics;
+  *time += (__JSONTraceGetTime() - sample->time) / 1e9;
+  if (json->elementsSize != sample->elementsSize)
+    statistics->elementsRegrowsCount++;
+  if (!popped && sample->top && sample->top->valuesSize + sample->top->keysSize != sample->topSize)
+    statistics->stackRegrowsCount++;
+  if (json->stack->index > statistics->maximumDepth)
+    statistics->maximumDepth = json->stack->index;
+}
+
+// Parser callbacks wrapped with counting and timing, installed only when statistics are enabled.
+#define __JSON_STATISTICS_CALLBACK(name, arguments, call, counter, time, popped) \
+  static int __JSONStatistics##name arguments { \
+    __JSONRef json = (__JSONRef)context; \
+    __JSONStatisticsSample sample; \
+    __JSONStatisticsSampleBegin(json, &sample); \
+    int result = call; \
+    __JSONStatisticsSampleEnd(json, &sample, &json->statistics->time, popped); \
+    counter; \
+    return result; \
+  }
+
+__JSON_STATISTICS_CALLBACK(AppendNull,
+                           (void *context),
+                           __JSONParserAppendNull(context),
+                           json->statistics->nullsCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendBooleanWithInteger,
+                           (void *context, int value),
+                           __JSONParserAppendBooleanWithInteger(context, value),
+                           json->statistics->booleansCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendNumberWithBytes,
+                           (void *context, const char *value, size_t length),
+                           __JSONParserAppendNumberWithBytes(context, value, length),
+                           json->statistics->numbersCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendStringWithBytes,
+                           (void *context, const unsigned char *value, size_t length),
+                           __JSONParserAppendStringWithBytes(context, value, length),
+                           json->statistics->stringsCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendMapKeyWithBytes,
+                           (void *context, const unsigned char *value, size_t length),
+                           __JSONParserAppendMapKeyWithBytes(context, value, length),
+                           json->statistics->keysCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendMapStart,
+                           (void *context),
+                           __JSONParserAppendMapStart(context),
+                           json->statistics->dictionariesCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendMapEnd,
+                           (void *context),
+                           __JSONParserAppendMapEnd(context),
+                           (void)0, containersTime, 1)
+__JSON_STATISTICS_CALLBACK(AppendArrayStart,
+                           (void *context),
+                           __JSONParserAppendArrayStart(context),
+                           json->statistics->arraysCount++, constructionTime, 0)
+__JSON_STATISTICS_CALLBACK(AppendArrayEnd,
+                           (void *context),
+                           __JSONParserAppendArrayEnd(context),
+                           (void)0, containersTime, 1)
+
+static inline void __JSONStatisticsInstallCallbacks(__JSONRef json) {
+  json->yajlParserCallbacks.yajl_null        = __JSONStatisticsAppendNull;
+  json->yajlParserCallbacks.yajl_boolean     = __JSONStatisticsAppendBooleanWithInteger;
+  json->yajlParserCallbacks.yajl_number      = __JSONStatisticsAppendNumberWithBytes;
+  json->yajlParserCallbacks.yajl_string      = __JSONStatisticsAppendStringWithBytes;
+  json->yajlParserCallbacks.yajl_map_key     = __JSONStatisticsAppendMapKeyWithBytes;
+  json->yajlParserCallbacks.yajl_start_map   = __JSONStatisticsAppendMapStart;
+  json->yajlParserCallbacks.yajl_end_map     = __JSONStatisticsAppendMapEnd;
+  json->yajlParserCallbacks.yajl_start_array = __JSONStatisticsAppendArrayStart;
+  json->yajlParserCallbacks.yajl_end_array   = __JSONStatisticsAppendArrayEnd;
+}
+
+static inline __JSONArenaRef __JSONStatisticsGetArena(__JSONRef json) {
+  CFAllocatorContext context;
+  CFAllocatorGetContext(json->scratchAllocator, &context);
+  return (__JSONArenaRef)context.info;
+}
+
+#endif
+
+#pragma Limits
+
+// Returned objects keep the budget allocator and can be used from other threads, counting is
+// atomic for that reason, even though only the parse reads the count.
+static void *__JSONBudgetAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  __JSONBudgetRef budget = (__JSONBudgetRef)info;
+  __atomic_fetch_add(&budget->allocatedSize, size, __ATOMIC_RELAXED);
+  return CFAllocatorAllocate(budget->allocator, size, hint);
+}
+
+// Grown blocks are counted with their new size, budget is an upper bound then.
+static void *__JSONBudgetReallocate(void *ptr, CFIndex size, CFOptionFlags hint, void *info) {
+  __JSONBudgetRef budget = (__JSONBudgetRef)info;
+  __atomic_fetch_add(&budget->allocatedSize, size, __ATOMIC_RELAXED);
+  return CFAllocatorReallocate(budget->allocator, ptr, size, hint);
+}
+
+static void __JSONBudgetDeallocate(void *ptr, void *info) {
+  CFAllocatorDeallocate(((__JSONBudgetRef)info)->allocator, ptr);
+}
+
+static void __JSONBudgetRelease(const void *info) {
+  __JSONBudgetRef budget = (__JSONBudgetRef)info;
+  CFAllocatorRef allocator = budget->allocator;
+  CFAllocatorDeallocate(allocator, budget);
+  if (allocator)
+    CFRelease(allocator);
+}
+
+// Created objects keep the budget allocator for their whole life (CF objects can't change their
+// allocator), it forwards to allocator after parsing as well.
+inline CFAllocatorRef __JSONBudgetAllocatorCreate(CFAllocatorRef allocator, __JSONBudgetRef *budget) {
+  CFAllocatorRef budgetAllocator = NULL;
+  __JSONBudgetRef budget_ = CFAllocatorAllocate(allocator, sizeof(__JSONBudget), 0);
+  if (budget_) {
+    budget_->allocator = allocator ? CFRetain(allocator) : NULL;
+    budget_->allocatedSize = 0;
+    CFAllocatorContext context = { 0, budget_, NULL, __JSONBudgetRelease, NULL, __JSONBudgetAllocate, __JSONBudgetReallocate, __JSONBudgetDeallocate, NULL };
+    if (NULL == (budgetAllocator = CFAllocatorCreate(allocator, &context)))
+      __JSONBudgetRelease(budget_);
+    else
+      *budget = budget_;
+  }
+  return budgetAllocator;
+}
+
+static inline bool __JSONLimitsFail(__JSONRef json, JSONErrorKind kind) {
+  json->limitError = kind;
+  return 0;
+}
+
+// Checks budgets before a value or key is appended to the top container. Allocated size is
+// checked after the fact, so it can be exceeded by allocations of a single callback.
+static inline bool __JSONLimitsCheckElement(__JSONRef json, CFIndex length, bool isKey) {
+  const JSONParseLimits *limits = json->limits;
+  __JSONStackEntryRef top = NULL;
+  if (limits->maximumElements && json->elementsIndex >= limits->maximumElements)
+    return __JSONLimitsFail(json, kJSONErrorKindElementsLimit);
+  if (limits->maximumStringLength && length > limits->maximumStringLength)
+    return __JSONLimitsFail(json, kJSONErrorKindStringLengthLimit);
+  if (limits->maximumContainerSize && (top = __JSONStackGetTop(json->stack)) && (isKey ? top->keysIndex : top->valuesIndex) >= limits->maximumContainerSize)
+    return __JSONLimitsFail(json, kJSONErrorKindContainerSizeLimit);
+  if (json->budget && __atomic_load_n(&json->budget->allocatedSize, __ATOMIC_RELAXED) > limits->maximumAllocatedSize)
+    return __JSONLimitsFail(json, kJSONErrorKindAllocatedSizeLimit);
+  return 1;
+}
+
+static inline bool __JSONLimitsCheckContainer(__JSONRef json) {
+  if (json->limits->maximumDepth && json->stack->index >= json->limits->maximumDepth)
+    return __JSONLimitsFail(json, kJSONErrorKindDepthLimit);
+  return __JSONLimitsCheckElement(json, 0, 0);
+}
+
+// Parser callbacks wrapped with limit checks, installed only when parsing with limits. Wrapped
+// callbacks are called through limitedCallbacks, so they can be statistics callbacks as well.
+#define __JSON_LIMITS_CALLBACK(name, arguments, check, call) \
+  static int __JSONLimits##name arguments { \
+    __JSONRef json = (__JSONRef)context; \
+    return (check) && json->limitedCallbacks.call; \
+  }
+
+__JSON_LIMITS_CALLBACK(AppendNull,
+                       (void *context),
+                       __JSONLimitsCheckElement(json, 0, 0),
+                       yajl_null(context))
+__JSON_LIMITS_CALLBACK(AppendBooleanWithInteger,
+                       (void *context, int value),
+                       __JSONLimitsCheckElement(json, 0, 0),
+                       yajl_boolean(context, value))
+__JSON_LIMITS_CALLBACK(AppendNumberWithBytes,
+                       (void *context, const char *value, size_t length),
+                       __JSONLimitsCheckElement(json, (CFIndex)length, 0),
+                       yajl_number(context, value, length))
+__JSON_LIMITS_CALLBACK(AppendStringWithBytes,
+                       (void *context, const unsigned char *value, size_t length),
+                       __JSONLimitsCheckElement(json, (CFIndex)length, 0),
+                       yajl_string(context, value, length))
+__JSON_LIMITS_CALLBACK(AppendMapKeyWithBytes,
+                       (void *context, const unsigned char *value, size_t length),
+                       __JSONLimitsCheckElement(json, (CFIndex)length, 1),
+                       yajl_map_key(context, value, length))
+__JSON_LIMITS_CALLBACK(AppendMapStart,
+                       (void *context),
+                       __JSONLimitsCheckContainer(json),
+                       yajl_start_map(context))
+__JSON_LIMITS_CALLBACK(AppendArrayStart,
+                       (void *context),
+                       __JSONLimitsCheckContainer(json),
+                       yajl_start_array(context))
+
+static inline void __JSONLimitsInstallCallbacks(__JSONRef json) {
+  json->limitedCallbacks = json->yajlParserCallbacks;
+  json->yajlParserCallbacks.yajl_null        = __JSONLimitsAppendNull;
+  json->yajlParserCallbacks.yajl_boolean     = __JSONLimitsAppendBooleanWithInteger;
+  json->yajlParserCallbacks.yajl_number      = __JSONLimitsAppendNumberWithBytes;
+  json->yajlParserCallbacks.yajl_string      = __JSONLimitsAppendStringWithBytes;
+  json->yajlParserCallbacks.yajl_map_key     = __JSONLimitsAppendMapKeyWithBytes;
+  json->yajlParserCallbacks.yajl_start_map   = __JSONLimitsAppendMapStart;
+  json->yajlParserCallbacks.yajl_start_array = __JSONLimitsAppendArrayStart;
+}
+
+#pragma Tracing
+
+static JSONTraceBeginCallBack  __JSONTraceBeginCallBack   = NULL;
+static JSONTraceEndCallBack    __JSONTraceEndCallBack     = NULL;
+static uint64_t                __JSONTraceMinimumTime     = 0;
+static void                   *__JSONTraceInfo            = NULL;
+static bool                    __JSONTraceCallBacksSet    = 0;
+static bool                    __JSONTraceHistogramsSet   = 0;
+static __JSONTraceHistogramRef __JSONTraceHistograms      = NULL;
+static pthread_key_t           __JSONTraceHistogramKey;
+static pthread_once_t          __JSONTraceHistogramOnce   = PTHREAD_ONCE_INIT;
+
+// Values below 8 have their own buckets, above that each power of two is split into 8 buckets.
+static inline CFIndex __JSONTraceGetBucket(uint64_t value) {
+  CFIndex bucket = 0;
+  if (value < 8) {
+    bucket = (CFIndex)value;
+  } else {
+    CFIndex exponent = 63 - __builtin_clzll(value);
+    bucket = (exponent - 2) * 8 + (CFIndex)((value >> (exponent - 3)) & 7);
+    if (bucket >= CORE_JSON_TRACE_HISTOGRAM_BUCKETS)
+      bucket = CORE_JSON_TRACE_HISTOGRAM_BUCKETS - 1;
+  }
+  return bucket;
+}
+
+// Highest value counted in the bucket.
+static inline uint64_t __JSONTraceGetBucketValue(CFIndex bucket) {
+  uint64_t value = bucket;
+  if (bucket >= 8) {
+    CFIndex exponent = bucket / 8 + 2;
+    value = ((uint64_t)(8 + bucket % 8) << (exponent - 3)) + ((uint64_t)1 << (exponent - 3)) - 1;
+  }
+  return value;
+}
+
+// Thread exited, histogram keeps its counts and can be taken over by another thread.
+static void __JSONTraceHistogramRelinquish(void *value) {
+  __atomic_store_n(&((__JSONTraceHistogramRef)value)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void __JSONTraceHistogramInitialize(void) {
+  pthread_key_create(&__JSONTraceHistogramKey, __JSONTraceHistogramRelinquish);
+}
+
+// Histogram of the current thread, reuses a histogram of an exited thread or pushes a new one
+// to the global list. Histograms are never freed, there's at most one per concurrent thread.
+static inline __JSONTraceHistogramRef __JSONTraceHistogramGetCurrent(void) {
+  pthread_once(&__JSONTraceHistogramOnce, __JSONTraceHistogramInitialize);
+  __JSONTraceHistogramRef histogram = pthread_getspecific(__JSONTraceHistogramKey);
+  if (histogram == NULL) {
+    for (histogram = __atomic_load_n(&__JSONTraceHistograms, __ATOMIC_ACQUIRE); histogram; histogram = histogram->next) {
+      int inUse = 0;
+      if (__atomic_compare_exchange_n(&histogram->inUse, &inUse, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    }
+    if (histogram == NULL && (histogram = CFAllocatorAllocate(NULL, sizeof(__JSONTraceHistogram), 0))) {
+      memset(histogram, 0, sizeof(__JSONTraceHistogram));
+      histogram->inUse = 1;
+      histogram->next = __atomic_load_n(&__JSONTraceHistograms, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&__JSONTraceHistograms, &histogram->next, histogram, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    }
+    if (histogram)
+      pthread_setspecific(__JSONTraceHistogramKey, histogram);
+  }
+  return histogram;
+}
+
+static inline void __JSONTraceHistogramRecord(JSONTraceOperation operation, CFIndex size, uint64_t time) {
+  __JSONTraceHistogramRef histogram = __JSONTraceHistogramGetCurrent();
+  if (histogram) {
+    uint64_t *count = &histogram->counts[operation][JSONTraceGetSizeClass(size)][__JSONTraceGetBucket(time)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Sizes are reported in UTF-8 bytes for all operations. Strings are measured only when
+// somebody observes the size, otherwise kCFNotFound is reported.
+static inline CFIndex __JSONTraceGetStringSize(CFStringRef string) {
+  CFIndex size = kCFNotFound;
+  if (__JSON_TRACE_PROBES || __JSONTraceCallBacksSet || __JSONTraceHistogramsSet) {
+    const char *bytes = CFStringGetCStringPtr(string, kCFStringEncodingASCII);
+    if (bytes)
+      size = strlen(bytes);
+    else
+      CFStringGetBytes(string, CFRangeMake(0, CFStringGetLength(string)), kCFStringEncodingUTF8, 0, 0, NULL, 0, &size);
+  }
+  return size;
+}
+
+// Without callbacks and histograms tracing costs two loads and a branch (and nops of probes).
+inline void __JSONTraceBegin(__JSONTrace *trace, JSONTraceOperation operation, CFIndex size) {
+  if (operation == kJSONTraceOperationParse)
+    __JSON_TRACE_PROBE(parse_begin, size, 0);
+  else
+    __JSON_TRACE_PROBE(generate_begin, size, 0);
+  trace->context = NULL;
+  if (__JSONTraceCallBacksSet || __JSONTraceHistogramsSet) {
+    if (__JSONTraceBeginCallBack)
+      trace->context = __JSONTraceBeginCallBack(operation, size, __JSONTraceInfo);
+    trace->time = __JSONTraceGetTime();
+  } else {
+    trace->time = 0;
+  }
+}
+
+inline void __JSONTraceEnd(__JSONTrace *trace, JSONTraceOperation operation, CFIndex size, bool success) {
+  if (operation == kJSONTraceOperationParse)
+    __JSON_TRACE_PROBE(parse_end, size, success);
+  else
+    __JSON_TRACE_PROBE(generate_end, size, success);
+  if (trace->time) {
+    uint64_t time = __JSONTraceGetTime() - trace->time;
+    if (__JSONTraceHistogramsSet)
+      __JSONTraceHistogramRecord(operation, size, time);
+    if (__JSONTraceEndCallBack && (__JSONTraceBeginCallBack || time >= __JSONTraceMinimumTime))
+      __JSONTraceEndCallBack(operation, size, success, time / 1e9, trace->context, __JSONTraceInfo);
+  }
+}
+
+inline void JSONTraceSetCallBacks(JSONTraceBeginCallBack begin, JSONTraceEndCallBack end, CFTimeInterval minimumTime, void *info) {
+  __JSONTraceCallBacksSet = 0;
+  __JSONTraceBeginCallBack = begin;
+  __JSONTraceEndCallBack = end;
+  __JSONTraceMinimumTime = minimumTime > 0 ? (uint64_t)(minimumTime * 1e9) : 0;
+  __JSONTraceInfo = info;
+  __JSONTraceCallBacksSet = begin || end;
+}
+
+inline void JSONTraceSetHistogramsEnabled(bool enabled) {
+  __JSONTraceHistogramsSet = enabled;
+}
+
+inline JSONTraceSizeClass JSONTraceGetSizeClass(CFIndex size) {
+  JSONTraceSizeClass sizeClass = kJSONTraceSizeClassTiny;
+  if (size >= 1024) {
+    CFIndex exponent = 63 - __builtin_clzll((uint64_t)size);
+    sizeClass = (exponent - 10) / 4 + 1;
+    if (sizeClass > kJSONTraceSizeClassHuge)
+      sizeClass = kJSONTraceSizeClassHuge;
+  }
+  return sizeClass;
+}
+
+// Sums counts of all threads, returns total count.
+static inline uint64_t __JSONTraceGetCounts(JSONTraceOperation operation, JSONTraceSizeClass sizeClass, uint64_t *counts) {
+  uint64_t total = 0;
+  memset(counts, 0, sizeof(uint64_t) * CORE_JSON_TRACE_HISTOGRAM_BUCKETS);
+  for (__JSONTraceHistogramRef histogram = __atomic_load_n(&__JSONTraceHistograms, __ATOMIC_ACQUIRE); histogram; histogram = histogram->next) {
+    for (CFIndex i = 0; i < CORE_JSON_TRACE_HISTOGRAM_BUCKETS; i++) {
+      uint64_t count = __atomic_load_n(&histogram->counts[operation][sizeClass][i], __ATOMIC_RELAXED);
+      counts[i] += count;
+      total += count;
+    }
+  }
+  return total;
+}
+
+inline uint64_t JSONTraceGetCount(JSONTraceOperation operation, JSONTraceSizeClass sizeClass) {
+  uint64_t counts[CORE_JSON_TRACE_HISTOGRAM_BUCKETS];
+  return __JSONTraceGetCounts(operation, sizeClass, counts);
+}
+
+inline CFTimeInterval JSONTraceGetPercentile(JSONTraceOperation operation, JSONTraceSizeClass sizeClass, double percentile) {
+  CFTimeInterval time = 0;
+  uint64_t counts[CORE_JSON_TRACE_HISTOGRAM_BUCKETS];
+  uint64_t total = __JSONTraceGetCounts(operation, sizeClass, counts);
+  if (total) {
+    uint64_t rank = (uint64_t)ceil(total * (percentile < 0 ? 0 : percentile > 100 ? 100 : percentile) / 100);
+    uint64_t count = 0;
+    CFIndex i = 0;
+    while (i < CORE_JSON_TRACE_HISTOGRAM_BUCKETS - 1 && ((count += counts[i]) < rank || count == 0))
+      i++;
+    time = __JSONTraceGetBucketValue(i) / 1e9;
+  }
+  return time;
+}
+
+inline void JSONTraceResetHistograms(void) {
+  for (__JSONTraceHistogramRef histogram = __atomic_load_n(&__JSONTraceHistograms, __ATOMIC_ACQUIRE); histogram; histogram = histogram->next)
+    for (CFIndex i = 0; i < 2 * CORE_JSON_TRACE_SIZE_CLASSES * CORE_JSON_TRACE_HISTOGRAM_BUCKETS; i++)
+      __atomic_store_n(&histogram->counts[0][0][i], 0, __ATOMIC_RELAXED);
+}
+
+inline __JSONRef __JSONCreate(CFAllocatorRef allocator, JSONReadOptions options) {
+  return __JSONCreateWithContext(allocator, NULL, NULL, options);
+}
+
+// With maximumAllocatedSize objects and scratch memory (unless scratchAllocator is given) are
+// allocated through a budget allocator backed by allocator.
+inline __JSONRef __JSONCreateWithLimits(CFAllocatorRef allocator, CFAllocatorRef scratchAllocator, __JSONShapeRef shape, JSONReadOptions options, const JSONParseLimits *limits) {
+  __JSONRef json = NULL;
+  if (limits && limits->maximumAllocatedSize) {
+    __JSONBudgetRef budget = NULL;
+    CFAllocatorRef budgetAllocator = __JSONBudgetAllocatorCreate(allocator, &budget);
+    if (budgetAllocator) {
+      if ((json = __JSONCreateWithContext(budgetAllocator, scratchAllocator, shape, options)))
+        json->budget = budget;
+      CFRelease(budgetAllocator);
+    }
+  } else {
+    json = __JSONCreateWithContext(allocator, scratchAllocator, shape, options);
+  }
+  if (json)
+    json->limits = limits;
+  return json;
+}
+
+// Scratch memory is allocated from scratchAllocator arena, or a new arena backed by allocator
+// if it's NULL. The arena is reset when json is released. Containers are presized with optional
+// shape, which records sizes of parsed containers as well.
+inline __JSONRef __JSONCreateWithContext(CFAllocatorRef allocator, CFAllocatorRef scratchAllocator, __JSONShapeRef shape, JSONReadOptions options) {
+  __JSONRef json = CFAllocatorAllocate(allocator, sizeof(__JSON), 0);
+  if (json) {
+    json->allocator = allocator ? CFRetain(allocator) : NULL;
+    json->retainCount = 1;
+    json->scratchAllocator = scratchAllocator ? CFRetain(scratchAllocator) : __JSONArenaAllocatorCreate(json->allocator);
+    json->elements = NULL;
+    json->stack = NULL;
+    json->shape = shape;
+    json->strings = NULL;
+    json->containers = NULL;
+    json->bytes = NULL;
+    json->bytesLength = 0;
+    json->bytesDeallocator = NULL;
+    json->compactObjects = (options & kJSONReadOptionCompactObjects) != 0;
+    json->lazyNumbers = (options & kJSONReadOptionLazyNumbers) != 0;
+    json->converters = NULL;
+    json->converter = NULL;
+    json->statistics = NULL;
+    json->limits = NULL;
+    json->budget = NULL;
+    json->limitError = kJSONErrorKindNone;
+    
+    json->yajlAllocFuncs.ctx     = (void *)json->scratchAllocator;
+    json->yajlAllocFuncs.malloc  = __JSONAllocatorAllocate;
+    json->yajlAllocFuncs.realloc = __JSONAllocatorReallocate;
+    json->yajlAllocFuncs.free    = __JSONAllocatorDeallocate;
+    
+    json->yajlParserCallbacks.yajl_null        = __JSONParserAppendNull;
+    json->yajlParserCallbacks.yajl_boolean     = __JSONParserAppendBooleanWithInteger;
+    
+    // Set number or integer and double. Never all 3.
+    json->yajlParserCallbacks.yajl_number      = __JSONParserAppendNumberWithBytes;
+    json->yajlParserCallbacks.yajl_integer     = NULL; // __JSONParserAppendNumberWithLong
+    json->yajlParserCallbacks.yajl_double      = NULL; // __JSONParserAppendNumberWithDouble
+    
+    json->yajlParserCallbacks.yajl_start_map   = __JSONParserAppendMapStart;
+    json->yajlParserCallbacks.yajl_map_key     = __JSONParserAppendMapKeyWithBytes;
+    json->yajlParserCallbacks.yajl_end_map     = __JSONParserAppendMapEnd;
+    
+    json->yajlParserCallbacks.yajl_start_array = __JSONParserAppendArrayStart;
+    json->yajlParserCallbacks.yajl_end_array   = __JSONParserAppendArrayEnd;
+    
+    json->yajlParserCallbacks.yajl_string      = __JSONParserAppendStringWithBytes;
+    
+    json->elementsIndex = 0;
+    json->elementsSize = shape ? shape->elementsSize : CORE_JSON_ELEMENTS_INITIAL_SIZE;
+    if (NULL == json->scratchAllocator || NULL == (json->elements = CFAllocatorAllocate(json->scratchAllocator, sizeof(CFTypeRef) * json->elementsSize, 0)))
+      json = __JSONRelease(json);
+
+    if (json)
+      if (NULL == (json->stack = __JSONStackCreate(json->scratchAllocator, CORE_JSON_STACK_INITIAL_SIZE)))
+        json = __JSONRelease(json);
+
+    if (json && (options & kJSONReadOptionUniqueStrings)) {
+      if ((json->strings = CFAllocatorAllocate(json->scratchAllocator, sizeof(__JSONStringTable), 0)))
+        memset(json->strings, 0, sizeof(__JSONStringTable));
+      else
+        json = __JSONRelease(json);
+    }
+    
+    if (json && (options & kJSONReadOptionUniqueContainers)) {
+      if ((json->containers = CFAllocatorAllocate(json->scratchAllocator, sizeof(__JSONContainerTable), 0)))
+        memset(json->containers, 0, sizeof(__JSONContainerTable));
+      else
+        json = __JSONRelease(json);
+    }
+  }
+  return json;
+}
+
+inline __JSONRef __JSONRelease(__JSONRef json) {
+  if (json) {
+    if (--json->retainCount == 0) {
+      CFAllocatorRef allocator = json->allocator;
+      
+      if (json->elements) {
+        while (--json->elementsIndex >= 0)
+          CFRelease(json->elements[json->elementsIndex]);
+        CFAllocatorDeallocate(json->scratchAllocator, json->elements);
+      }
+      
+      if (json->stack)
+        json->stack = __JSONStackRelease(json->stack);
+      
+      if (json->strings)
+        CFAllocatorDeallocate(json->scratchAllocator, json->strings);
+      
+      if (json->containers)
+        CFAllocatorDeallocate(json->scratchAllocator, json->containers);
+      
+      if (json->bytesDeallocator)
+        CFRelease(json->bytesDeallocator);
+      
+      // All scratch memory is dropped at once
+      if (json->scratchAllocator) {
+        __JSONArenaAllocatorReset(json->scratchAllocator);
+        CFRelease(json->scratchAllocator);
+      }
+      
+      CFAllocatorDeallocate(allocator, json);
+      
+      if (allocator)
+        CFRelease(allocator);
+      
+      json = NULL;
+    }
+  }
+  return json;
+}
+
+#pragma Errors
+
+// yajl 2 public API doesn't expose error codes, kind is recovered from the short error message.
+inline JSONErrorKind __JSONParserGetErrorKind(yajl_handle parser, yajl_status status) {
+  JSONErrorKind kind = kJSONErrorKindSyntax;
+  if (status == yajl_status_client_canceled) {
+    kind = kJSONErrorKindCanceled;
+  } else {
+    const char *message = (const char *)yajl_get_error(parser, 0, NULL, 0);
+    if (message) {
+      if (strncmp(message, "lexical", 7) == 0)
+        kind = strstr(message, "UTF8") ? kJSONErrorKindInvalidUTF8 : kJSONErrorKindLexical;
+      else if (strstr(message, "premature EOF"))
+        kind = kJSONErrorKindTruncated;
+      else if (strstr(message, "trailing garbage"))
+        kind = kJSONErrorKindTrailingGarbage;
+      yajl_free_error(parser, (unsigned char *)message);
+    }
+  }
+  return kind;
+}
+
+// Parses a chunk of input starting at offset, fills error if parsing failed.
+inline yajl_status __JSONParserParse(yajl_handle parser, const UInt8 *bytes, CFIndex length, CFIndex offset, JSONParseError *error) {
+  yajl_status status = yajl_parse(parser, bytes, length);
+  if (status != yajl_status_ok) {
+    error->kind = __JSONParserGetErrorKind(parser, status);
+    error->offset = offset + yajl_get_bytes_consumed(parser);
+  }
+  return status;
+}
+
+// Completes parsing after the last chunk, errors are reported at the end of input.
+inline yajl_status __JSONParserComplete(yajl_handle parser, CFIndex offset, JSONParseError *error) {
+  yajl_status status = yajl_complete_parse(parser);
+  if (status != yajl_status_ok) {
+    error->kind = __JSONParserGetErrorKind(parser, status);
+    error->offset = offset;
+  }
+  return status;
+}
+
+// Line and column are added to user info only if bytes are available.
+inline CFErrorRef __JSONErrorCreate(CFAllocatorRef allocator, JSONParseError error, const UInt8 *bytes, CFIndex length) {
+  CFErrorRef result = NULL;
+  CFIndex line = 0;
+  CFIndex column = 0;
+  CFIndex count = 2;
+  CFStringRef description = NULL;
+  if (bytes) {
+    JSONParseErrorGetLineAndColumn(error, bytes, length, &line, &column);
+    description = CFStringCreateWithFormat(allocator, NULL, CFSTR("%@ at line %ld, column %ld"), JSONParseErrorGetDescription(error), (long)line, (long)column);
+    count = 4;
+  } else {
+    description = CFRetain(JSONParseErrorGetDescription(error));
+  }
+  CFNumberRef offsetNumber = CFNumberCreate(allocator, kCFNumberCFIndexType, &error.offset);
+  CFNumberRef lineNumber = CFNumberCreate(allocator, kCFNumberCFIndexType, &line);
+  CFNumberRef columnNumber = CFNumberCreate(allocator, kCFNumberCFIndexType, &column);
+  if (description && offsetNumber && lineNumber && columnNumber) {
+    const void *keys[] = { kCFErrorDescriptionKey, kJSONErrorOffsetKey, kJSONErrorLineKey, kJSONErrorColumnKey };
+    const void *values[] = { description, offsetNumber, lineNumber, columnNumber };
+    result = CFErrorCreateWithUserInfoKeysAndValues(allocator, kJSONErrorDomain, error.kind, keys, values, count);
+  }
+  if (columnNumber)
+    CFRelease(columnNumber);
+  if (lineNumber)
+    CFRelease(lineNumber);
+  if (offsetNumber)
+    CFRelease(offsetNumber);
+  if (description)
+    CFRelease(description);
+  return result;
+}
+
+inline void JSONParseErrorGetLineAndColumn(JSONParseError error, const UInt8 *bytes, CFIndex length, CFIndex *line, CFIndex *column) {
+  CFIndex line_ = 1;
+  CFIndex column_ = 1;
+  CFIndex n = error.offset < length ? error.offset : length;
+  for (CFIndex i = 0; i < n; i++) {
+    if (bytes[i] == '\n') {
+      line_++;
+      column_ = 1;
+    } else if ((bytes[i] & 0xc0) != 0x80) { // Skip UTF-8 continuation bytes
+      column_++;
+    }
+  }
+  if (line)
+    *line = line_;
+  if (column)
+    *column = column_;
+}
+
+inline CFStringRef JSONParseErrorGetDescription(JSONParseError error) {
+  switch (error.kind) {
+    case kJSONErrorKindNone:            return CFSTR("No error");
+    case kJSONErrorKindSyntax:          return CFSTR("Unexpected token");
+    case kJSONErrorKindLexical:         return CFSTR("Invalid character, escape or number");
+    case kJSONErrorKindInvalidUTF8:     return CFSTR("Invalid UTF-8");
+    case kJSONErrorKindTruncated:       return CFSTR("Premature end of input");
+    case kJSONErrorKindTrailingGarbage: return CFSTR("Trailing garbage");
+    case kJSONErrorKindCanceled:        return CFSTR("Parse canceled");
+    case kJSONErrorKindOutOfMemory:     return CFSTR("Out of memory");
+    case kJSONErrorKindBytesLimit:         return CFSTR("Input is too long");
+    case kJSONErrorKindElementsLimit:      return CFSTR("Too many elements");
+    case kJSONErrorKindDepthLimit:         return CFSTR("Nesting is too deep");
+    case kJSONErrorKindStringLengthLimit:  return CFSTR("String is too long");
+    case kJSONErrorKindContainerSizeLimit: return CFSTR("Array or object is too large");
+    case kJSONErrorKindAllocatedSizeLimit: return CFSTR("Allocated size limit exceeded");
+    case kJSONErrorKindFile:               return CFSTR("File or stream can't be read or written");
+    case kJSONErrorKindSnapshot:           return CFSTR("Snapshot is corrupted or of other version");
+    case kJSONErrorKindCompression:        return CFSTR("Compressed input is corrupted");
+    case kJSONErrorKindGenerator:          return CFSTR("Value can't be generated");
+  }
+  return CFSTR("Unknown error");
+}
+
+#pragma Parsing
+
+inline bool __JSONParseWithString(__JSONRef json, CFStringRef string, CFErrorRef *error) {
+  bool success = 0;
+  CFDataRef data = NULL;
+  
+  // UTF-8 is at least as long as the string, too long input is rejected before converting it
+  if (json->limits && json->limits->maximumBytes && CFStringGetLength(string) > json->limits->maximumBytes) {
+    if (error)
+      *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindBytesLimit, json->limits->maximumBytes }, NULL, 0);
+  } else if ((data = CFStringCreateExternalRepresentation(json->scratchAllocator, string, kCFStringEncodingUTF8, 0))) {
+    success = __JSONParseWithBytes(json, CFDataGetBytePtr(data), CFDataGetLength(data), error);
+    CFRelease(data);
+  } else if (error) {
+    *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindOutOfMemory, 0 }, NULL, 0);
+  }
+  return success;
+}
+
+// Errors are created with the default allocator, they outlive json which may be allocated
+// from a document region.
+inline bool __JSONParseWithBytes(__JSONRef json, const UInt8 *bytes, CFIndex length, CFErrorRef *error) {
+  JSONParseError parseError = { kJSONErrorKindNone, 0 };
+#if CORE_JSON_STATISTICS
+  JSONParserStatistics *statistics = json->statistics;
+  __JSONArenaRef arena = NULL;
+  CFIndex allocationsCount = 0, allocatedSize = 0;
+  CFTimeInterval callbacksTime = 0;
+  uint64_t time = 0;
+  if (statistics) {
+    __JSONStatisticsInstallCallbacks(json);
+    arena = __JSONStatisticsGetArena(json);
+    allocationsCount = arena->allocationsCount;
+    allocatedSize = arena->allocatedSize;
+    callbacksTime = statistics->constructionTime + statistics->containersTime;
+    time = __JSONTraceGetTime();
+  }
+#endif
+  if (json->limits)
+    __JSONLimitsInstallCallbacks(json);
+  if (json->limits && json->limits->maximumBytes && length > json->limits->maximumBytes) {
+    parseError.kind = kJSONErrorKindBytesLimit;
+    parseError.offset = json->limits->maximumBytes;
+  } else if ((json->yajlParser = yajl_alloc(&json->yajlParserCallbacks, &json->yajlAllocFuncs, (void *)json))) {
+//  yajl_config(json->yajlParser, yajl_allow_comments, kJSONReadOptionAllowComments | options ? 1 : 0);
+//  yajl_config(json->yajlParser, yajl_dont_validate_strings, kJSONReadOptionCheckUTF8 | options ? 1 : 0);
+  
+    if ((json->yajlParserStatus = __JSONParserParse(json->yajlParser, bytes, length, 0, &parseError)) == yajl_status_ok)
+      json->yajlParserStatus = __JSONParserComplete(json->yajlParser, length, &parseError);
+    yajl_free(json->yajlParser);
+    json->yajlParser = NULL;
+    
+#if CORE_JSON_STATISTICS
+    if (statistics) {
+      statistics->lexingTime += (__JSONTraceGetTime() - time) / 1e9 - (statistics->constructionTime + statistics->containersTime - callbacksTime);
+      statistics->bytesCount += length;
+      statistics->scratchAllocationsCount += arena->allocationsCount - allocationsCount;
+      statistics->scratchAllocatedSize += arena->allocatedSize - allocatedSize;
+    }
+#endif
+  } else {
+    parseError.kind = kJSONErrorKindOutOfMemory;
+  }
+  
+  // Limit checks abort parsing by failing the callback
+  if (parseError.kind == kJSONErrorKindCanceled && json->limitError != kJSONErrorKindNone)
+    parseError.kind = json->limitError;
+  
+  if (parseError.kind != kJSONErrorKindNone && error)
+    *error = __JSONErrorCreate(NULL, parseError, parseError.kind == kJSONErrorKindOutOfMemory ? NULL : bytes, length);
+  
+  return parseError.kind == kJSONErrorKindNone;
+}
+
+#pragma Validation
+
+inline void *__JSONValidatorAllocate(void *ctx, size_t sz) {
+  __JSONValidatorMemory *memory = (__JSONValidatorMemory *)ctx;
+  CFIndex words = (CFIndex)((sz + sizeof(CFIndex) - 1) / sizeof(CFIndex));
+  void *ptr = NULL;
+  if (memory->index + 1 + words <= (CFIndex)(sizeof(memory->words) / sizeof(CFIndex))) {
+    memory->last = memory->index;
+    memory->words[memory->index] = (CFIndex)sz;
+    ptr = &memory->words[memory->index + 1];
+    memory->index += 1 + words;
+  } else {
+    ptr = CFAllocatorAllocate(NULL, sz, 0);
+  }
+  return ptr;
+}
+
+static inline bool __JSONValidatorMemoryContains(__JSONValidatorMemory *memory, void *ptr) {
+  return (CFIndex *)ptr >= memory->words && (CFIndex *)ptr < memory->words + sizeof(memory->words) / sizeof(CFIndex);
+}
+
+inline void __JSONValidatorDeallocate(void *ctx, void *ptr) {
+  __JSONValidatorMemory *memory = (__JSONValidatorMemory *)ctx;
+  if (ptr) {
+    if (!__JSONValidatorMemoryContains(memory, ptr)) {
+      CFAllocatorDeallocate(NULL, ptr);
+    } else if ((CFIndex *)ptr - memory->words - 1 == memory->last) {
+      memory->index = memory->last;
+      memory->last = -1;
+    }
+  }
+}
+
+inline void *__JSONValidatorReallocate(void *ctx, void *ptr, size_t sz) {
+  __JSONValidatorMemory *memory = (__JSONValidatorMemory *)ctx;
+  void *result = NULL;
+  if (ptr == NULL) {
+    result = __JSONValidatorAllocate(ctx, sz);
+  } else if (!__JSONValidatorMemoryContains(memory, ptr)) {
+    result = CFAllocatorReallocate(NULL, ptr, sz, 0);
+  } else {
+    CFIndex block = (CFIndex *)ptr - memory->words - 1;
+    CFIndex words = (CFIndex)((sz + sizeof(CFIndex) - 1) / sizeof(CFIndex));
+    if (block == memory->last && block + 1 + words <= (CFIndex)(sizeof(memory->words) / sizeof(CFIndex))) {
+      memory->words[block] = (CFIndex)sz;
+      memory->index = block + 1 + words;
+      result = ptr;
+    } else if ((result = __JSONValidatorAllocate(ctx, sz))) {
+      memcpy(result, ptr, (size_t)memory->words[block] < sz ? (size_t)memory->words[block] : sz);
+    }
+  }
+  return result;
+}
+
+// Parses without creating objects, callbacks are optional.
+inline bool __JSONValidateWithBytes(const UInt8 *bytes, CFIndex length, const yajl_callbacks *callbacks, void *context, JSONParseError *error) {
+  JSONParseError parseError = { kJSONErrorKindNone, 0 };
+  __JSONValidatorMemory memory;
+  memory.index = 0;
+  memory.last = -1;
+  yajl_alloc_funcs allocFuncs;
+  allocFuncs.ctx     = (void *)&memory;
+  allocFuncs.malloc  = __JSONValidatorAllocate;
+  allocFuncs.realloc = __JSONValidatorReallocate;
+  allocFuncs.free    = __JSONValidatorDeallocate;
+  yajl_handle parser = yajl_alloc(callbacks, &allocFuncs, context);
+  if (parser) {
+    if (__JSONParserParse(parser, bytes, length, 0, &parseError) == yajl_status_ok)
+      __JSONParserComplete(parser, length, &parseError);
+    yajl_free(parser);
+  } else {
+    parseError.kind = kJSONErrorKindOutOfMemory;
+  }
+  if (error)
+    *error = parseError;
+  return parseError.kind == kJSONErrorKindNone;
+}
+
+inline bool __JSONValidateWithString(CFStringRef string, const yajl_callbacks *callbacks, void *context, JSONParseError *error) {
+  JSONParseError parseError = { kJSONErrorKindNone, 0 };
+  __JSONValidatorMemory memory;
+  memory.index = 0;
+  memory.last = -1;
+  yajl_alloc_funcs allocFuncs;
+  allocFuncs.ctx     = (void *)&memory;
+  allocFuncs.malloc  = __JSONValidatorAllocate;
+  allocFuncs.realloc = __JSONValidatorReallocate;
+  allocFuncs.free    = __JSONValidatorDeallocate;
+  yajl_handle parser = yajl_alloc(callbacks, &allocFuncs, context);
+  if (parser) {
+    UInt8 buffer[CORE_JSON_VALIDATOR_CHUNK_SIZE];
+    CFIndex length = CFStringGetLength(string);
+    CFIndex index = 0;
+    CFIndex offset = 0;
+    
+    // Characters are never split between chunks, yajl buffers tokens which are
+    while (parseError.kind == kJSONErrorKindNone && index < length) {
+      CFIndex usedLength = 0;
+      CFIndex convertedLength = CFStringGetBytes(string, CFRangeMake(index, length - index), kCFStringEncodingUTF8, 0, 0, buffer, sizeof(buffer), &usedLength);
+      if (convertedLength > 0) {
+        __JSONParserParse(parser, buffer, usedLength, offset, &parseError);
+        index += convertedLength;
+        offset += usedLength;
+      } else {
+        parseError.kind = kJSONErrorKindInvalidUTF8; // Unpaired surrogate
+        parseError.offset = offset;
+      }
+    }
+    if (parseError.kind == kJSONErrorKindNone)
+      __JSONParserComplete(parser, offset, &parseError);
+    yajl_free(parser);
+  } else {
+    parseError.kind = kJSONErrorKindOutOfMemory;
+  }
+  if (error)
+    *error = parseError;
+  return parseError.kind == kJSONErrorKindNone;
+}
+
+inline bool JSONValidateWithBytes(const UInt8 *bytes, CFIndex length, JSONParseError *error) {
+  return __JSONValidateWithBytes(bytes, length, NULL, NULL, error);
+}
+
+inline bool JSONValidateWithString(CFStringRef string, JSONParseError *error) {
+  return __JSONValidateWithString(string, NULL, NULL, error);
+}
+
+#pragma Events
+
+static int __JSONEventsNull(void *context) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->null == NULL || events->callBacks->null(events->info, events->depth);
+}
+
+static int __JSONEventsBoolean(void *context, int value) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->boolean == NULL || events->callBacks->boolean(events->info, value != 0, events->depth);
+}
+
+// Decoded the same way as numbers of created objects, integers out of range are passed as floats.
+static int __JSONEventsNumber(void *context, const char *value, size_t length) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  if (events->callBacks->number == NULL)
+    return 1;
+  __JSONNumberValue number = __JSONNumberDecode(value, length);
+  return events->callBacks->number(events->info, (const UInt8 *)value, (CFIndex)length, number.isFloat, number.integerValue, number.doubleValue, events->depth);
+}
+
+static int __JSONEventsString(void *context, const unsigned char *value, size_t length) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->string == NULL || events->callBacks->string(events->info, value, (CFIndex)length, events->depth);
+}
+
+static int __JSONEventsKey(void *context, const unsigned char *value, size_t length) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->key == NULL || events->callBacks->key(events->info, value, (CFIndex)length, events->depth);
+}
+
+// Container start and end events have depth of the container, its elements one more.
+static int __JSONEventsObjectStart(void *context) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->startObject == NULL || events->callBacks->startObject(events->info, events->depth++);
+}
+
+static int __JSONEventsObjectEnd(void *context) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->endObject == NULL || events->callBacks->endObject(events->info, --events->depth);
+}
+
+static int __JSONEventsArrayStart(void *context) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->startArray == NULL || events->callBacks->startArray(events->info, events->depth++);
+}
+
+static int __JSONEventsArrayEnd(void *context) {
+  __JSONEventsRef events = (__JSONEventsRef)context;
+  return events->callBacks->endArray == NULL || events->callBacks->endArray(events->info, --events->depth);
+}
+
+static const yajl_callbacks __JSONEventsCallbacks = {
+  __JSONEventsNull,
+  __JSONEventsBoolean,
+  NULL,
+  NULL,
+  __JSONEventsNumber,
+  __JSONEventsString,
+  __JSONEventsObjectStart,
+  __JSONEventsKey,
+  __JSONEventsObjectEnd,
+  __JSONEventsArrayStart,
+  __JSONEventsArrayEnd
+};
+
+// Depth is kept even for events without callbacks, so it's right for the ones with them.
+inline bool JSONParseEventsWithBytes(const UInt8 *bytes, CFIndex length, const JSONEventCallBacks *callBacks, void *info, JSONParseError *error) {
+  __JSONEvents events = { callBacks, info, 0 };
+  return __JSONValidateWithBytes(bytes, length, &__JSONEventsCallbacks, &events, error);
+}
+
+inline bool JSONParseEventsWithString(CFStringRef string, const JSONEventCallBacks *callBacks, void *info, JSONParseError *error) {
+  __JSONEvents events = { callBacks, info, 0 };
+  return __JSONValidateWithString(string, &__JSONEventsCallbacks, &events, error);
+}
+
+#pragma Public API
+
+inline CFTypeRef JSONCreateWithString(CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, CFErrorRef *error) {
+  return JSONCreateWithStringAndLimits(allocator, string, options, NULL, error);
+}
+
+inline CFTypeRef JSONCreateWithData(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, CFErrorRef *error) {
+  return JSONCreateWithDataAndLimits(allocator, data, options, NULL, error);
+}
+
+inline CFTypeRef JSONCreateWithStringAndLimits(CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  CFIndex size = __JSONTraceGetStringSize(string);
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, size);
+  if ((json = __JSONCreateWithLimits(allocator, NULL, NULL, options, limits))) {
+    if (__JSONParseWithString(json, string, error))
+      result = __JSONCreateObject(json);
+    __JSONRelease(json);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, size, result != NULL);
+  return result;
+}
+
+inline CFTypeRef JSONCreateWithDataAndLimits(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, CFDataGetLength(data));
+  if ((json = __JSONCreateWithLimits(allocator, NULL, NULL, options, limits))) {
+    if (options & kJSONReadOptionNoCopyStrings) {
+      json->bytes = CFDataGetBytePtr(data);
+      json->bytesLength = CFDataGetLength(data);
+      json->bytesDeallocator = __JSONBytesDeallocatorCreate(json->allocator, data);
+    }
+    if (__JSONParseWithBytes(json, CFDataGetBytePtr(data), CFDataGetLength(data), error))
+      result = __JSONCreateObject(json);
+    __JSONRelease(json);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, CFDataGetLength(data), result != NULL);
+  return result;
+}
+
+inline CFTypeRef __JSONCreateObject(__JSONRef json) {
+  return (json && json->elements && json->elementsIndex && *json->elements) ? CFRetain(*json->elements) : NULL;
+}
+
+#pragma Generator
+
+// Records the first failed yajl_gen call of the generator, append callbacks don't return status.
+inline void __JSONGeneratorDidAppend(yajl_gen *g, yajl_gen_status status) {
+  __JSONGeneratorRef generator = __JSONGeneratorGetWithYAJLGen(g);
+  if (status != yajl_gen_status_ok && generator->status == yajl_gen_status_ok)
+    generator->status = status;
+}
+
+inline void __JSONGeneratorAppendString(CFAllocatorRef allocator, yajl_gen *g, CFStringRef value) {
+  CFDataRef data = CFStringCreateExternalRepresentation(allocator, value, kCFStringEncodingUTF8, 0);
+  if (data) {
+    __JSONGeneratorDidAppend(g, yajl_gen_string(*g, CFDataGetBytePtr(data), CFDataGetLength(data)));
+    CFRelease(data);
+  } else {
+    __JSONGeneratorGetWithYAJLGen(g)->skipped = 1;
+  }
+}
+
+inline void __JSONGeneratorAppendDoubleTypeNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
+  double value_ = 0.0;
+  CFNumberGetValue(value, kCFNumberDoubleType, &value_);
+  __JSONGeneratorDidAppend(g, yajl_gen_double(*g, value_));
+}
+
+inline void __JSONGeneratorAppendLongLongTypeNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
+  long long value_ = 0;
+  CFNumberGetValue(value, kCFNumberLongLongType, &value_);
+  char buffer[21]; // Maximum string length is "±9223372036854775807\0"
+  int length = sprintf(buffer, "%lld", value_);
+  __JSONGeneratorDidAppend(g, yajl_gen_number(*g, buffer, length));
+}
+
+inline void __JSONGeneratorAppendNumber(CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value) {
+  if (CFNumberIsFloatType(value))
+    __JSONGeneratorAppendDoubleTypeNumber(allocator, g, value);
+  else
+    __JSONGeneratorAppendLongLongTypeNumber(allocator, g, value);
+}
+
+inline void __JSONGeneratorAppendArray(CFAllocatorRef allocator, yajl_gen *g, CFArrayRef value) {
+  CFIndex n = CFArrayGetCount(value);
+  CFTypeRef *values = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
+  CFArrayGetValues(value, CFRangeMake(0, n), values);
+  if (!__JSONGeneratorAppendValuesInParallel(__JSONGeneratorGetWithYAJLGen(g), NULL, values, n)) {
+    __JSONGeneratorDidAppend(g, yajl_gen_array_open(*g));
+    for (CFIndex i = 0; i < n; i++)
+      __JSONGeneratorAppendValue(allocator, g, values[i]);
+    __JSONGeneratorDidAppend(g, yajl_gen_array_close(*g));
+  }
+  CFAllocatorDeallocate(allocator, values);
+}
+
+inline void __JSONGeneratorAppendDictionary(CFAllocatorRef allocator, yajl_gen *g, CFDictionaryRef value) {
+  CFIndex n = CFDictionaryGetCount(value);
+  CFTypeRef *keys = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
+  CFTypeRef *values = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
+  CFDictionaryGetKeysAndValues(value, keys, values);
+  if (!__JSONGeneratorAppendValuesInParallel(__JSONGeneratorGetWithYAJLGen(g), keys, values, n)) {
+    __JSONGeneratorDidAppend(g, yajl_gen_map_open(*g));
+    for (CFIndex i = 0; i < n; i++) {
+      __JSONGeneratorAppendValue(allocator, g, keys[i]); // TODO: append as string
+      __JSONGeneratorAppendValue(allocator, g, values[i]);
+    }
+    __JSONGeneratorDidAppend(g, yajl_gen_map_close(*g));
+  }
+  CFAllocatorDeallocate(allocator, values);
+  CFAllocatorDeallocate(allocator, keys);
+}
+
+inline void __JSONGeneratorAppendAttributedString(CFAllocatorRef allocator, yajl_gen *g, CFAttributedStringRef value) {
+  __JSONGeneratorAppendString(allocator, g, CFAttributedStringGetString(value));
+}
+
+inline void __JSONGeneratorAppendBoolean(CFAllocatorRef allocator, yajl_gen *g, CFBooleanRef value) {
+  __JSONGeneratorDidAppend(g, yajl_gen_bool(*g, CFBooleanGetValue(value)));
+}
+
+inline void __JSONGeneratorAppendNull(CFAllocatorRef allocator, yajl_gen *g, CFNullRef value) {
+  __JSONGeneratorDidAppend(g, yajl_gen_null(*g));
+}
+
+inline void __JSONGeneratorAppendURL(CFAllocatorRef allocator, yajl_gen *g, CFURLRef value) {
+  __JSONGeneratorAppendString(allocator, g, CFURLGetString(value));
+}
+
+inline void __JSONGeneratorAppendUUID(CFAllocatorRef allocator, yajl_gen *g, CFUUIDRef value) {
+  CFStringRef string = CFUUIDCreateString(allocator, value);
+  __JSONGeneratorAppendString(allocator, g, string);
+  CFRelease(string);
+}
+
+inline void __JSONGeneratorAppendCompactObject(CFAllocatorRef allocator, yajl_gen *g, CFDataRef value) {
+  __JSONCompactObjectRef object = __JSONCompactObjectGet(value);
+  __JSONGeneratorDidAppend(g, yajl_gen_map_open(*g));
+  for (CFIndex i = 0; i < object->count; i++) {
+    __JSONGeneratorAppendValue(allocator, g, object->entries[i]);
+    __JSONGeneratorAppendValue(allocator, g, object->entries[object->count + i]);
+  }
+  __JSONGeneratorDidAppend(g, yajl_gen_map_close(*g));
+}
+
+// Lazy numbers are generated with original digits
+inline void __JSONGeneratorAppendLazyNumber(CFAllocatorRef allocator, yajl_gen *g, CFDataRef value) {
+  __JSONLazyNumberRef number = __JSONLazyNumberGet(value);
+  __JSONGeneratorDidAppend(g, yajl_gen_number(*g, number->digits, number->length));
+}
+
+static const char     __JSONGeneratorBase64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char           __JSONGeneratorBase64Table[4096][2];
+static pthread_once_t __JSONGeneratorBase64TableOnce = PTHREAD_ONCE_INIT;
+
+static void __JSONGeneratorBase64TableInitialize(void) {
+  for (int i = 0; i < 4096; i++) {
+    __JSONGeneratorBase64Table[i][0] = __JSONGeneratorBase64Alphabet[i >> 6];
+    __JSONGeneratorBase64Table[i][1] = __JSONGeneratorBase64Alphabet[i & 0x3f];
+  }
+}
+
+// Compact objects are generated as objects, lazy numbers as numbers, other data as base64 strings
+inline void __JSONGeneratorAppendData(CFAllocatorRef allocator, yajl_gen *g, CFDataRef value) {
+  if (__JSONCompactObjectGet(value)) {
+    __JSONGeneratorAppendCompactObject(allocator, g, value);
+    return;
+  }
+  if (__JSONLazyNumberGet(value)) {
+    __JSONGeneratorAppendLazyNumber(allocator, g, value);
+    return;
+  }
+  pthread_once(&__JSONGeneratorBase64TableOnce, __JSONGeneratorBase64TableInitialize);
+  const UInt8 *bytes = CFDataGetBytePtr(value);
+  CFIndex n = CFDataGetLength(value);
+  CFIndex length = ((n + 2) / 3) * 4;
+  unsigned char *buffer = CFAllocatorAllocate(allocator, length ? length : 1, 0);
+  if (buffer) {
+    unsigned char *p = buffer;
+    CFIndex i = 0;
+    
+    // Two table lookups, 12 bits each, per 3 bytes
+    for (; i + 2 < n; i += 3, p += 4) {
+      UInt32 triple = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+      memcpy(p, __JSONGeneratorBase64Table[triple >> 12], 2);
+      memcpy(p + 2, __JSONGeneratorBase64Table[triple & 0xfff], 2);
+    }
+    if (i < n) {
+      UInt32 triple = (bytes[i] << 16) | (i + 1 < n ? bytes[i + 1] << 8 : 0);
+      *p++ = __JSONGeneratorBase64Alphabet[(triple >> 18) & 0x3f];
+      *p++ = __JSONGeneratorBase64Alphabet[(triple >> 12) & 0x3f];
+      *p++ = i + 1 < n ? __JSONGeneratorBase64Alphabet[(triple >> 6) & 0x3f] : '=';
+      *p++ = '=';
+    }
+    __JSONGeneratorDidAppend(g, yajl_gen_string(*g, buffer, length));
+    CFAllocatorDeallocate(allocator, buffer);
+  } else {
+    __JSONGeneratorGetWithYAJLGen(g)->skipped = 1;
+  }
+}
+
+// Dates are generated as ISO 8601 UTC strings, ie. "2011-02-18T12:30:00Z" with milliseconds
+// appended only when the date has a fractional part.
+inline void __JSONGeneratorAppendDate(CFAllocatorRef allocator, yajl_gen *g, CFDateRef value) {
+  double seconds = CFDateGetAbsoluteTime(value) + kCFAbsoluteTimeIntervalSince1970;
+  double integral = floor(seconds);
+  int milliseconds = (int)round((seconds - integral) * 1000.0);
+  if (milliseconds == 1000) {
+    integral += 1.0;
+    milliseconds = 0;
+  }
+  
+  // Civil date from days since 1970-01-01, without gmtime_r and snprintf
+  long days = (long)floor(integral / 86400);
+  long secondsOfDay = (long)(integral - (double)days * 86400);
+  long z = days + 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  int day = (int)(doy - (153 * mp + 2) / 5 + 1);
+  int month = (int)(mp < 10 ? mp + 3 : mp - 9);
+  long year = yoe + era * 400 + (month <= 2);
+  
+  char buffer[40];
+  int length = 0;
+  if (year >= 0 && year <= 9999) {
+    int fields[] = { (int)(year / 100), (int)(year % 100), month, day, (int)(secondsOfDay / 3600), (int)(secondsOfDay / 60 % 60), (int)(secondsOfDay % 60) };
+    static const char separators[] = "\0\0--T::";
+    char *p = buffer;
+    for (int i = 0; i < 7; i++) {
+      if (separators[i])
+        *p++ = separators[i];
+      *p++ = '0' + fields[i] / 10;
+      *p++ = '0' + fields[i] % 10;
+    }
+    if (milliseconds) {
+      *p++ = '.';
+      *p++ = '0' + milliseconds / 100;
+      *p++ = '0' + milliseconds / 10 % 10;
+      *p++ = '0' + milliseconds % 10;
+    }
+    *p++ = 'Z';
+    length = (int)(p - buffer);
+  } else {
+    time_t time_ = (time_t)integral;
+    struct tm tm_;
+    gmtime_r(&time_, &tm_);
+    if (milliseconds)
+      length = snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm_.tm_year + 1900, tm_.tm_mon + 1, tm_.tm_mday, tm_.tm_hour, tm_.tm_min, tm_.tm_sec, milliseconds);
+    else
+      length = snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02dZ", tm_.tm_year + 1900, tm_.tm_mon + 1, tm_.tm_mday, tm_.tm_hour, tm_.tm_min, tm_.tm_sec);
+  }
+  __JSONGeneratorDidAppend(g, yajl_gen_string(*g, (const unsigned char *)buffer, length));
+}
+
+// Sets are generated as arrays, the order of elements is undefined.
+inline void __JSONGeneratorAppendSet(CFAllocatorRef allocator, yajl_gen *g, CFSetRef value) {
+  __JSONGeneratorDidAppend(g, yajl_gen_array_open(*g));
+  CFIndex n = CFSetGetCount(value);
+  CFTypeRef *values = CFAllocatorAllocate(allocator, sizeof(CFTypeRef) * n, 0);
+  CFSetGetValues(value, values);
+  for (CFIndex i = 0; i < n; i++)
+    __JSONGeneratorAppendValue(allocator, g, values[i]);
+  CFAllocatorDeallocate(allocator, values);
+  __JSONGeneratorDidAppend(g, yajl_gen_array_close(*g));
+}
+
+#pragma Generator callbacks
+
+static JSONGeneratorAppendCallBack __JSONGeneratorAppendCallBacks[CORE_JSON_GENERATOR_CALLBACKS_SIZE];
+static pthread_once_t              __JSONGeneratorAppendCallBacksOnce = PTHREAD_ONCE_INIT;
+static CFTypeID                    __JSONGeneratorArrayTypeID = 0;
+static CFTypeID                    __JSONGeneratorDictionaryTypeID = 0;
+
+static void __JSONGeneratorSetDefaultAppendCallBack(CFTypeID typeID, JSONGeneratorAppendCallBack callBack) {
+  if (typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE)
+    __JSONGeneratorAppendCallBacks[typeID] = callBack;
+}
+
+static void __JSONGeneratorSetDefaultAppendCallBacks(void) {
+  __JSONGeneratorArrayTypeID = CFArrayGetTypeID();
+  __JSONGeneratorDictionaryTypeID = CFDictionaryGetTypeID();
+  __JSONGeneratorSetDefaultAppendCallBack(CFStringGetTypeID(),           (JSONGeneratorAppendCallBack)__JSONGeneratorAppendString);
+  __JSONGeneratorSetDefaultAppendCallBack(CFNumberGetTypeID(),           (JSONGeneratorAppendCallBack)__JSONGeneratorAppendNumber);
+  __JSONGeneratorSetDefaultAppendCallBack(CFArrayGetTypeID(),            (JSONGeneratorAppendCallBack)__JSONGeneratorAppendArray);
+  __JSONGeneratorSetDefaultAppendCallBack(CFDictionaryGetTypeID(),       (JSONGeneratorAppendCallBack)__JSONGeneratorAppendDictionary);
+  __JSONGeneratorSetDefaultAppendCallBack(CFAttributedStringGetTypeID(), (JSONGeneratorAppendCallBack)__JSONGeneratorAppendAttributedString);
+  __JSONGeneratorSetDefaultAppendCallBack(CFBooleanGetTypeID(),          (JSONGeneratorAppendCallBack)__JSONGeneratorAppendBoolean);
+  __JSONGeneratorSetDefaultAppendCallBack(CFDataGetTypeID(),             (JSONGeneratorAppendCallBack)__JSONGeneratorAppendData);
+  __JSONGeneratorSetDefaultAppendCallBack(CFDateGetTypeID(),             (JSONGeneratorAppendCallBack)__JSONGeneratorAppendDate);
+  __JSONGeneratorSetDefaultAppendCallBack(CFNullGetTypeID(),             (JSONGeneratorAppendCallBack)__JSONGeneratorAppendNull);
+  __JSONGeneratorSetDefaultAppendCallBack(CFSetGetTypeID(),              (JSONGeneratorAppendCallBack)__JSONGeneratorAppendSet);
+  __JSONGeneratorSetDefaultAppendCallBack(CFURLGetTypeID(),              (JSONGeneratorAppendCallBack)__JSONGeneratorAppendURL);
+  __JSONGeneratorSetDefaultAppendCallBack(CFUUIDGetTypeID(),             (JSONGeneratorAppendCallBack)__JSONGeneratorAppendUUID);
+}
+
+// Populates the callbacks table once, safe to call from multiple threads.
+inline void __JSONGeneratorInitializeAppendCallBacks(void) {
+  pthread_once(&__JSONGeneratorAppendCallBacksOnce, __JSONGeneratorSetDefaultAppendCallBacks);
+}
+
+// Entries are swapped atomically, generators running on other threads see either the old or the new callback.
+inline bool JSONGeneratorSetAppendCallBack(CFTypeID typeID, JSONGeneratorAppendCallBack callBack) {
+  bool success = 0;
+  __JSONGeneratorInitializeAppendCallBacks();
+  if (typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE) {
+    __atomic_store_n(&__JSONGeneratorAppendCallBacks[typeID], callBack, __ATOMIC_RELEASE);
+    success = 1;
+  }
+  return success;
+}
+
+inline JSONGeneratorAppendCallBack JSONGeneratorGetAppendCallBack(CFTypeID typeID) {
+  __JSONGeneratorInitializeAppendCallBacks();
+  return typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE ? __atomic_load_n(&__JSONGeneratorAppendCallBacks[typeID], __ATOMIC_ACQUIRE) : NULL;
+}
+
+#if CORE_JSON_STATISTICS
+
+// Counts appended value, containers are tracked for depth until they're appended.
+static inline void __JSONGeneratorStatisticsBegin(JSONGeneratorStatistics *statistics, CFTypeID typeID) {
+  if (typeID == __JSONGeneratorArrayTypeID || typeID == __JSONGeneratorDictionaryTypeID) {
+    if (typeID == __JSONGeneratorArrayTypeID)
+      statistics->arraysCount++;
+    else
+      statistics->dictionariesCount++;
+    if (++statistics->depth > statistics->maximumDepth)
+      statistics->maximumDepth = statistics->depth;
+  } else if (typeID == CFStringGetTypeID()) {
+    statistics->stringsCount++;
+  } else if (typeID == CFNumberGetTypeID()) {
+    statistics->numbersCount++;
+  } else if (typeID == CFBooleanGetTypeID()) {
+    statistics->booleansCount++;
+  } else if (typeID == CFNullGetTypeID()) {
+    statistics->nullsCount++;
+  } else {
+    statistics->otherCount++;
+  }
+}
+
+#define __JSON_WRITER_STATISTICS(writer, statement) \
+  do { \
+    if ((writer)->generator->statistics) { \
+      JSONGeneratorStatistics *statistics = (writer)->generator->statistics; \
+      statement; \
+    } \
+  } while (0)
+
+#else
+
+#define __JSON_WRITER_STATISTICS(writer, statement) do { } while (0)
+
+#endif
+
+// Values with unknown types are skipped and marked in the generator. The table has to be initialized
+// with __JSONGeneratorInitializeAppendCallBacks before, which is done by all public entry points.
+inline void __JSONGeneratorAppendValue(CFAllocatorRef allocator, yajl_gen *g, CFTypeRef value) {
+  if (value) {
+    __JSONGeneratorRef generator = __JSONGeneratorGetWithYAJLGen(g);
+    CFTypeID typeID = CFGetTypeID(value);
+    JSONGeneratorAppendCallBack callBack = typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE ? __atomic_load_n(&__JSONGeneratorAppendCallBacks[typeID], __ATOMIC_ACQUIRE) : NULL;
+    if (callBack) {
+#if CORE_JSON_STATISTICS
+      if (generator->statistics)
+        __JSONGeneratorStatisticsBegin(generator->statistics, typeID);
+#endif
+      if (generator->cache == NULL || (typeID != __JSONGeneratorArrayTypeID && typeID != __JSONGeneratorDictionaryTypeID) || !__JSONGeneratorAppendCachedValue(generator, value, callBack))
+        callBack(allocator, g, value);
+#if CORE_JSON_STATISTICS
+      if (generator->statistics && (typeID == __JSONGeneratorArrayTypeID || typeID == __JSONGeneratorDictionaryTypeID))
+        generator->statistics->depth--;
+#endif
+    } else {
+      generator->skipped = 1;
+    }
+  }
+}
+
+#pragma Generator context
+
+inline __JSONGeneratorRef __JSONGeneratorCreate(CFAllocatorRef allocator, JSONWriteOptions options, JSONGeneratorCacheRef cache) {
+  __JSONGeneratorRef generator = CFAllocatorAllocate(allocator, sizeof(__JSONGenerator), 0);
+  if (generator) {
+    generator->allocator = allocator ? CFRetain(allocator) : NULL;
+    generator->retainCount = 1;
+    
+    // Cached fragments and parallel chunks are generated without indentation, spliced into
+    // indented output they'd break it
+    generator->options = options & kJSONWriteOptionIndent ? options & ~kJSONWriteOptionParallel : options;
+    generator->cache = cache && !(options & kJSONWriteOptionIndent) ? JSONGeneratorCacheRetain(cache) : NULL;
+    generator->statistics = NULL;
+    generator->status = yajl_gen_status_ok;
+    generator->skipped = 0;
+    
+    generator->yajlAllocFuncs.ctx     = (void *)generator->allocator;
+    generator->yajlAllocFuncs.malloc  = __JSONAllocatorAllocate;
+    generator->yajlAllocFuncs.realloc = __JSONAllocatorReallocate;
+    generator->yajlAllocFuncs.free    = __JSONAllocatorDeallocate;
+    
+    if (NULL == (generator->yajlGen = yajl_gen_alloc(&generator->yajlAllocFuncs))) {
+      generator = __JSONGeneratorRelease(generator);
+    } else if (options & kJSONWriteOptionIndent) {
+      yajl_gen_config(generator->yajlGen, yajl_gen_beautify, 1);
+      yajl_gen_config(generator->yajlGen, yajl_gen_indent_string, "  ");
+    }
+    
+    __JSONGeneratorInitializeAppendCallBacks();
+  }
+  return generator;
+}
+
+inline __JSONGeneratorRef __JSONGeneratorRelease(__JSONGeneratorRef generator) {
+  if (generator) {
+    if (--generator->retainCount == 0) {
+      CFAllocatorRef allocator = generator->allocator;
+      if (generator->yajlGen) {
+        yajl_gen_clear(generator->yajlGen);
+        yajl_gen_free(generator->yajlGen);
+      }
+      if (generator->cache)
+        JSONGeneratorCacheRelease(generator->cache);
+      CFAllocatorDeallocate(allocator, generator);
+      if (allocator)
+        CFRelease(allocator);
+      generator = NULL;
+    }
+  }
+  return generator;
+}
+
+// Append callbacks are always called with pointer to the yajlGen member of __JSONGenerator.
+_Static_assert(offsetof(__JSONGenerator, yajlGen) == 0, "yajlGen has to be the first member of __JSONGenerator");
+
+inline __JSONGeneratorRef __JSONGeneratorGetWithYAJLGen(yajl_gen *g) {
+  return (__JSONGeneratorRef)g;
+}
+
+inline CFStringRef __JSONGeneratorCreateString(__JSONGeneratorRef generator, CFErrorRef *error) {
+  const unsigned char *buffer = NULL;
+  size_t length = 0;
+  switch (yajl_gen_get_buf(generator->yajlGen, &buffer, &length)) {
+    case yajl_gen_status_ok: // no error
+      break;
+
+    case yajl_gen_keys_must_be_strings: // at a point where a map key is generated, a function other than yajl_gen_string was called 
+      break;
+      
+    case yajl_max_depth_exceeded: //  YAJL's maximum generation depth was exceeded. See YAJL_MAX_DEPTH
+      break;
+      
+    case yajl_gen_in_error_state: // A generator function (yajl_gen_XXX) was called while in an error state
+      break;
+      
+    case yajl_gen_generation_complete: // A complete JSON document has been generated
+      break;
+      
+    case yajl_gen_invalid_number: // yajl_gen_double was passed an invalid floating point value (infinity or NaN)
+      break;
+      
+    case yajl_gen_invalid_string: // returned from yajl_gen_string() when the yajl_gen_validate_utf8 option is enabled and an invalid was passed by client code.
+      break;
+      
+    case yajl_gen_no_buf: // A print callback was passed in, so there is no internal buffer to get from
+      break;
   }
   
   // TODO: If buffer is not null and length > 0, otherwise empty string.
-  CFStringRef string = CFStringCreateWithBytes(allocator, buffer, length, kCFStringEncodingUTF8, 0);
+  CFStringRef string = CFStringCreateWithBytes(generator->allocator, buffer, length, kCFStringEncodingUTF8, 0);
+  
+  return string;
+}
+
+#pragma Parallel generator
+
+static CFIndex __JSONGeneratorParallelThreadsCount = 0;
+
+// Can be changed while generators run, they pick up the new count with the next large container.
+inline void JSONGeneratorSetParallelThreadsCount(CFIndex threadsCount) {
+  __atomic_store_n(&__JSONGeneratorParallelThreadsCount, threadsCount > 0 ? threadsCount : 0, __ATOMIC_RELAXED);
+}
+
+inline CFIndex JSONGeneratorGetParallelThreadsCount(void) {
+  CFIndex threadsCount = __atomic_load_n(&__JSONGeneratorParallelThreadsCount, __ATOMIC_RELAXED);
+  if (threadsCount == 0)
+    threadsCount = (CFIndex)sysconf(_SC_NPROCESSORS_ONLN);
+  return threadsCount > 0 ? threadsCount : 1;
+}
+
+// Generates chunk as a complete array or map, brackets are stripped when chunks are joined.
+inline void *__JSONGeneratorAppendChunk(void *chunk_) {
+  __JSONGeneratorChunkRef chunk = (__JSONGeneratorChunkRef)chunk_;
+  CFAllocatorRef allocator = chunk->generator->allocator;
+  yajl_gen *g = &chunk->generator->yajlGen;
+  if (chunk->keys) {
+    __JSONGeneratorDidAppend(g, yajl_gen_map_open(*g));
+    for (CFIndex i = 0; i < chunk->count; i++) {
+      __JSONGeneratorAppendValue(allocator, g, chunk->keys[i]);
+      __JSONGeneratorAppendValue(allocator, g, chunk->values[i]);
+    }
+    __JSONGeneratorDidAppend(g, yajl_gen_map_close(*g));
+  } else {
+    __JSONGeneratorDidAppend(g, yajl_gen_array_open(*g));
+    for (CFIndex i = 0; i < chunk->count; i++)
+      __JSONGeneratorAppendValue(allocator, g, chunk->values[i]);
+    __JSONGeneratorDidAppend(g, yajl_gen_array_close(*g));
+  }
+  return NULL;
+}
+
+// Splits large array (NULL keys) or dictionary into chunks generated on separate threads and
+// splices joined result into the generator. Output is the same as serial one. Returns false if
+// kJSONWriteOptionParallel is not set or the container is too small, it should be appended as usual.
+inline bool __JSONGeneratorAppendValuesInParallel(__JSONGeneratorRef generator, const CFTypeRef *keys, const CFTypeRef *values, CFIndex n) {
+  bool success = 0;
+  if ((generator->options & kJSONWriteOptionParallel) && n >= CORE_JSON_GENERATOR_PARALLEL_MINIMUM_SIZE) {
+    CFIndex chunksCount = JSONGeneratorGetParallelThreadsCount();
+    if (chunksCount > n / CORE_JSON_GENERATOR_PARALLEL_MINIMUM_SIZE)
+      chunksCount = n / CORE_JSON_GENERATOR_PARALLEL_MINIMUM_SIZE;
+    if (chunksCount > CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE)
+      chunksCount = CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE;
+    if (chunksCount > 1) {
+      __JSONGeneratorChunk chunks[CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE];
+      CFIndex createdCount = 0;
+      
+      // Nested containers are generated serially on chunk threads
+      for (; createdCount < chunksCount; createdCount++) {
+        CFIndex location = n * createdCount / chunksCount;
+        __JSONGeneratorChunkRef chunk = &chunks[createdCount];
+        if (NULL == (chunk->generator = __JSONGeneratorCreate(generator->allocator, generator->options & ~kJSONWriteOptionParallel, generator->cache)))
+          break;
+        chunk->threadCreated = 0;
+        chunk->keys = keys ? keys + location : NULL;
+        chunk->values = values + location;
+        chunk->count = n * (createdCount + 1) / chunksCount - location;
+      }
+      
+      if (createdCount == chunksCount) {
+        
+        // The first chunk is generated on the current thread, chunks which couldn't get their
+        // own thread are generated here as well after the first one
+        for (CFIndex i = 1; i < chunksCount; i++)
+          chunks[i].threadCreated = pthread_create(&chunks[i].thread, NULL, __JSONGeneratorAppendChunk, &chunks[i]) == 0;
+        __JSONGeneratorAppendChunk(&chunks[0]);
+        for (CFIndex i = 1; i < chunksCount; i++)
+          if (chunks[i].threadCreated)
+            pthread_join(chunks[i].thread, NULL);
+          else
+            __JSONGeneratorAppendChunk(&chunks[i]);
+        
+        const unsigned char *buffers[CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE];
+        size_t lengths[CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE];
+        CFIndex length = 2 + chunksCount - 1;
+        for (CFIndex i = 0; i < chunksCount; i++) {
+          __JSONGeneratorDidAppend(&generator->yajlGen, chunks[i].generator->status);
+          generator->skipped |= chunks[i].generator->skipped;
+          if (yajl_gen_get_buf(chunks[i].generator->yajlGen, &buffers[i], &lengths[i]) != yajl_gen_status_ok || lengths[i] < 2)
+            lengths[i] = 2;
+          length += lengths[i] - 2;
+        }
+        
+        unsigned char *buffer = CFAllocatorAllocate(generator->allocator, length, 0);
+        if (buffer) {
+          unsigned char *p = buffer;
+          bool empty = 1;
+          *p++ = keys ? '{' : '[';
+          for (CFIndex i = 0; i < chunksCount; i++) {
+            
+            // Skip chunks without output (ie. all values skipped), like serial generator would
+            if (lengths[i] > 2) {
+              if (!empty)
+                *p++ = ',';
+              memcpy(p, buffers[i] + 1, lengths[i] - 2);
+              p += lengths[i] - 2;
+              empty = 0;
+            }
+          }
+          *p++ = keys ? '}' : ']';
+          __JSONGeneratorDidAppend(&generator->yajlGen, yajl_gen_number(generator->yajlGen, (const char *)buffer, p - buffer));
+          CFAllocatorDeallocate(generator->allocator, buffer);
+          success = 1;
+        }
+      }
+      
+      for (CFIndex i = 0; i < createdCount; i++)
+        __JSONGeneratorRelease(chunks[i].generator);
+    }
+  }
+  return success;
+}
+
+#pragma Generator cache
+
+static void __JSONGeneratorCacheEntryUnlink(JSONGeneratorCacheRef cache, __JSONGeneratorCacheEntryRef entry) {
+  if (entry->previous)
+    entry->previous->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next)
+    entry->next->previous = entry->previous;
+  else
+    cache->tail = entry->previous;
+  entry->previous = NULL;
+  entry->next = NULL;
+}
+
+static void __JSONGeneratorCacheEntryLinkAtHead(JSONGeneratorCacheRef cache, __JSONGeneratorCacheEntryRef entry) {
+  entry->previous = NULL;
+  entry->next = cache->head;
+  if (cache->head)
+    cache->head->previous = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+// Drops generated fragment, the value stays registered. Has to be called with locked mutex.
+static void __JSONGeneratorCacheEntryRemoveFragment(JSONGeneratorCacheRef cache, __JSONGeneratorCacheEntryRef entry) {
+  if (entry->bytes) {
+    __JSONGeneratorCacheEntryUnlink(cache, entry);
+    CFAllocatorDeallocate(cache->allocator, entry->bytes);
+    cache->size -= entry->length;
+    entry->bytes = NULL;
+    entry->length = 0;
+  }
+}
+
+// Stores a copy of the fragment and evicts least recently used fragments above maximum size.
+// Has to be called with locked mutex.
+static void __JSONGeneratorCacheEntrySetFragment(JSONGeneratorCacheRef cache, __JSONGeneratorCacheEntryRef entry, const unsigned char *bytes, CFIndex length) {
+  if (entry->bytes == NULL && length > 0 && length <= cache->maximumSize) {
+    if ((entry->bytes = CFAllocatorAllocate(cache->allocator, length, 0))) {
+      memcpy(entry->bytes, bytes, length);
+      entry->length = length;
+      cache->size += length;
+      __JSONGeneratorCacheEntryLinkAtHead(cache, entry);
+      while (cache->size > cache->maximumSize && cache->tail)
+        __JSONGeneratorCacheEntryRemoveFragment(cache, cache->tail);
+    }
+  }
+}
+
+// Appends registered value from the cache, generating and storing its fragment if needed.
+// Only one thread generates a missing fragment, others wait for it instead of generating
+// the same fragment again. Returns false if the value is not registered and has to be
+// appended as usual.
+inline bool __JSONGeneratorAppendCachedValue(__JSONGeneratorRef generator, CFTypeRef value, JSONGeneratorAppendCallBack callBack) {
+  bool appended = 0;
+  bool generating = 0;
+  JSONGeneratorCacheRef cache = generator->cache;
+  
+  pthread_mutex_lock(&cache->mutex);
+  __JSONGeneratorCacheEntryRef entry;
+  bool missed = 0;
+  while ((entry = (__JSONGeneratorCacheEntryRef)CFDictionaryGetValue(cache->entries, value)) && entry->bytes == NULL && entry->generating) {
+    if (!missed) {
+      cache->missesCount++;
+      missed = 1;
+    }
+    pthread_cond_wait(&cache->generated, &cache->mutex);
+  }
+  if (entry) {
+    if (entry->bytes) {
+      
+      // yajl_gen_number writes bytes verbatim, taking care of separators
+      __JSONGeneratorDidAppend(&generator->yajlGen, yajl_gen_number(generator->yajlGen, (const char *)entry->bytes, entry->length));
+      __JSONGeneratorCacheEntryUnlink(cache, entry);
+      __JSONGeneratorCacheEntryLinkAtHead(cache, entry);
+      if (!missed)
+        cache->hitsCount++;
+      appended = 1;
+    } else {
+      if (!missed)
+        cache->missesCount++;
+      entry->generating = 1;
+      generating = 1;
+    }
+  }
+  pthread_mutex_unlock(&cache->mutex);
+  
+  // Generate the fragment on its own without holding the lock, nested registered values
+  // are still spliced from the cache.
+  if (generating) {
+    const unsigned char *bytes = NULL;
+    size_t length = 0;
+    __JSONGeneratorRef fragmentGenerator = __JSONGeneratorCreate(generator->allocator, generator->options, cache);
+    if (fragmentGenerator) {
+      
+      // Failed fragments are not cached, the value is appended as usual and reports the failure
+      callBack(generator->allocator, &fragmentGenerator->yajlGen, value);
+      if (fragmentGenerator->status == yajl_gen_status_ok && !fragmentGenerator->skipped && yajl_gen_get_buf(fragmentGenerator->yajlGen, &bytes, &length) == yajl_gen_status_ok && length > 0) {
+        __JSONGeneratorDidAppend(&generator->yajlGen, yajl_gen_number(generator->yajlGen, (const char *)bytes, length));
+        appended = 1;
+      }
+    }
+    
+    // Value could have been removed in the meantime, look it up again. Waiting threads are
+    // woken up even if generation failed, one of them retries.
+    pthread_mutex_lock(&cache->mutex);
+    if ((entry = (__JSONGeneratorCacheEntryRef)CFDictionaryGetValue(cache->entries, value))) {
+      if (appended)
+        __JSONGeneratorCacheEntrySetFragment(cache, entry, bytes, length);
+      entry->generating = 0;
+    }
+    pthread_cond_broadcast(&cache->generated);
+    pthread_mutex_unlock(&cache->mutex);
+    __JSONGeneratorRelease(fragmentGenerator);
+  }
+  
+  return appended;
+}
+
+inline JSONGeneratorCacheRef JSONGeneratorCacheCreate(CFAllocatorRef allocator, CFIndex maximumSize) {
+  JSONGeneratorCacheRef cache = CFAllocatorAllocate(allocator, sizeof(__JSONGeneratorCache), 0);
+  if (cache) {
+    cache->allocator = allocator ? CFRetain(allocator) : NULL;
+    cache->retainCount = 1;
+    pthread_mutex_init(&cache->mutex, NULL);
+    pthread_cond_init(&cache->generated, NULL);
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->size = 0;
+    cache->maximumSize = maximumSize;
+    cache->hitsCount = 0;
+    cache->missesCount = 0;
+    
+    // Keys are retained, but compared by identity
+    CFDictionaryKeyCallBacks keyCallBacks = kCFTypeDictionaryKeyCallBacks;
+    keyCallBacks.equal = NULL;
+    keyCallBacks.hash = NULL;
+    if (NULL == (cache->entries = CFDictionaryCreateMutable(cache->allocator, 0, &keyCallBacks, NULL)))
+      cache = JSONGeneratorCacheRelease(cache);
+  }
+  return cache;
+}
+
+inline JSONGeneratorCacheRef JSONGeneratorCacheRetain(JSONGeneratorCacheRef cache) {
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->retainCount++;
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return cache;
+}
+
+inline JSONGeneratorCacheRef JSONGeneratorCacheRelease(JSONGeneratorCacheRef cache) {
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    CFIndex retainCount = --cache->retainCount;
+    pthread_mutex_unlock(&cache->mutex);
+    if (retainCount == 0) {
+      CFAllocatorRef allocator = cache->allocator;
+      if (cache->entries) {
+        JSONGeneratorCacheRemoveAllValues(cache);
+        CFRelease(cache->entries);
+      }
+      pthread_cond_destroy(&cache->generated);
+      pthread_mutex_destroy(&cache->mutex);
+      CFAllocatorDeallocate(allocator, cache);
+      if (allocator)
+        CFRelease(allocator);
+      cache = NULL;
+    }
+  }
+  return cache;
+}
+
+// Registers immutable array or dictionary, it's fragment will be generated on first use.
+inline bool JSONGeneratorCacheAddValue(JSONGeneratorCacheRef cache, CFTypeRef value) {
+  bool success = 0;
+  if (cache && value) {
+    pthread_mutex_lock(&cache->mutex);
+    if (CFDictionaryGetValue(cache->entries, value)) {
+      success = 1;
+    } else {
+      __JSONGeneratorCacheEntryRef entry = CFAllocatorAllocate(cache->allocator, sizeof(__JSONGeneratorCacheEntry), 0);
+      if (entry) {
+        entry->value = value;
+        entry->bytes = NULL;
+        entry->length = 0;
+        entry->generating = 0;
+        entry->previous = NULL;
+        entry->next = NULL;
+        CFDictionarySetValue(cache->entries, value, entry);
+        success = 1;
+      }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return success;
+}
+
+inline void JSONGeneratorCacheRemoveValue(JSONGeneratorCacheRef cache, CFTypeRef value) {
+  if (cache && value) {
+    pthread_mutex_lock(&cache->mutex);
+    __JSONGeneratorCacheEntryRef entry = (__JSONGeneratorCacheEntryRef)CFDictionaryGetValue(cache->entries, value);
+    if (entry) {
+      __JSONGeneratorCacheEntryRemoveFragment(cache, entry);
+      CFDictionaryRemoveValue(cache->entries, value);
+      CFAllocatorDeallocate(cache->allocator, entry);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+  }
+}
+
+inline void JSONGeneratorCacheRemoveAllValues(JSONGeneratorCacheRef cache) {
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    CFIndex n = CFDictionaryGetCount(cache->entries);
+    CFTypeRef *entries = CFAllocatorAllocate(cache->allocator, sizeof(CFTypeRef) * (n ? n : 1), 0);
+    if (entries) {
+      CFDictionaryGetKeysAndValues(cache->entries, NULL, entries);
+      for (CFIndex i = 0; i < n; i++) {
+        __JSONGeneratorCacheEntryRef entry = (__JSONGeneratorCacheEntryRef)entries[i];
+        __JSONGeneratorCacheEntryRemoveFragment(cache, entry);
+        CFAllocatorDeallocate(cache->allocator, entry);
+      }
+      CFDictionaryRemoveAllValues(cache->entries);
+      CFAllocatorDeallocate(cache->allocator, entries);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+  }
+}
+
+inline CFIndex JSONGeneratorCacheGetSize(JSONGeneratorCacheRef cache) {
+  CFIndex size = 0;
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    size = cache->size;
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return size;
+}
+
+inline CFIndex JSONGeneratorCacheGetHitsCount(JSONGeneratorCacheRef cache) {
+  CFIndex hitsCount = 0;
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    hitsCount = cache->hitsCount;
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return hitsCount;
+}
+
+inline CFIndex JSONGeneratorCacheGetMissesCount(JSONGeneratorCacheRef cache) {
+  CFIndex missesCount = 0;
+  if (cache) {
+    pthread_mutex_lock(&cache->mutex);
+    missesCount = cache->missesCount;
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return missesCount;
+}
+
+#pragma Generator public API
+
+inline CFStringRef JSONCreateString(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, CFErrorRef *error) {
+  return JSONCreateStringWithCache(allocator, value, options, NULL, error);
+}
+
+inline CFStringRef JSONCreateStringWithCache(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, JSONGeneratorCacheRef cache, CFErrorRef *error) {
+  CFStringRef string = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationGenerate, kCFNotFound);
+  __JSONGeneratorRef generator = __JSONGeneratorCreate(allocator, options, cache);
+  size_t length = 0;
+  if (generator) {
+    __JSONGeneratorAppendValue(allocator, &generator->yajlGen, value);
+    
+    // Skipped values would leave keys without values behind, the output isn't valid JSON then
+    if (generator->status != yajl_gen_status_ok || generator->skipped) {
+      if (error)
+        *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindGenerator, 0 }, NULL, 0);
+    } else {
+      const unsigned char *buffer = NULL;
+      if (yajl_gen_get_buf(generator->yajlGen, &buffer, &length) != yajl_gen_status_ok)
+        length = 0;
+      string = __JSONGeneratorCreateString(generator, error);
+    }
+    __JSONGeneratorRelease(generator);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationGenerate, string ? (CFIndex)length : 0, string != NULL);
+  return string;
+}
+
+#pragma Newline delimited generator
+
+// yajl 2.0 can't reset generator state after a complete document, so values are generated as
+// elements of an outer array opened here - the separator yajl inserts before each element after
+// the first one is replaced with a newline.
+inline __JSONGeneratorRef __JSONNewlineDelimitedGeneratorCreate(CFAllocatorRef allocator, JSONWriteOptions options) {
+  __JSONGeneratorRef generator = __JSONGeneratorCreate(allocator, options & ~kJSONWriteOptionIndent, NULL); // One value per line
+  if (generator) {
+    
+    // Outer array is never part of the output
+    yajl_gen_array_open(generator->yajlGen);
+    yajl_gen_clear(generator->yajlGen);
+  }
+  return generator;
+}
+
+// Generated bytes are moved to data and yajl's buffer is cleared, so it's reused for the next
+// value. Returns false if the value couldn't be generated completely, nothing is appended then
+// and the generator has to be recreated, it can be left inside unfinished containers.
+inline bool __JSONGeneratorAppendNewlineDelimitedValue(__JSONGeneratorRef generator, CFMutableDataRef data, CFTypeRef value) {
+  bool success = 0;
+  const unsigned char *buffer = NULL;
+  size_t length = 0;
+  generator->status = yajl_gen_status_ok;
+  generator->skipped = 0;
+  __JSONGeneratorAppendValue(generator->allocator, &generator->yajlGen, value);
+  if (generator->status == yajl_gen_status_ok && !generator->skipped && yajl_gen_get_buf(generator->yajlGen, &buffer, &length) == yajl_gen_status_ok) {
+    if (length && *buffer == ',') {
+      buffer++;
+      length--;
+    }
+    if (length) {
+      CFDataAppendBytes(data, buffer, length);
+      CFDataAppendBytes(data, (const UInt8 *)"\n", 1);
+      success = 1;
+    }
+  }
+  yajl_gen_clear(generator->yajlGen);
+  return success;
+}
+
+typedef struct {
+  CFArrayRef values;
+  CFIndex    index;
+  CFIndex    count;
+} __JSONNewlineDelimitedArrayContext;
+
+static CFTypeRef __JSONNewlineDelimitedNextArrayValue(void *info) {
+  __JSONNewlineDelimitedArrayContext *context = (__JSONNewlineDelimitedArrayContext *)info;
+  return context->index < context->count ? CFArrayGetValueAtIndex(context->values, context->index++) : NULL;
+}
+
+inline CFDataRef JSONCreateNewlineDelimitedData(CFAllocatorRef allocator, CFArrayRef values, JSONWriteOptions options, CFErrorRef *error) {
+  __JSONNewlineDelimitedArrayContext context = { values, 0, values ? CFArrayGetCount(values) : 0 };
+  return JSONCreateNewlineDelimitedDataWithCallBack(allocator, __JSONNewlineDelimitedNextArrayValue, &context, options, error);
+}
+
+inline CFDataRef JSONCreateNewlineDelimitedDataWithCallBack(CFAllocatorRef allocator, JSONNewlineDelimitedNextValueCallBack callBack, void *info, JSONWriteOptions options, CFErrorRef *error) {
+  CFMutableDataRef data = NULL;
+  JSONParseError generateError = { kJSONErrorKindOutOfMemory, 0 };
+  __JSONGeneratorRef generator = __JSONNewlineDelimitedGeneratorCreate(allocator, options);
+  if (generator) {
+    if ((data = CFDataCreateMutable(allocator, 0))) {
+      generateError.kind = kJSONErrorKindNone;
+      CFTypeRef value = NULL;
+      for (CFIndex index = 0; generator && (value = callBack(info)); index++) {
+        if (!__JSONGeneratorAppendNewlineDelimitedValue(generator, data, value)) {
+          if (generateError.kind == kJSONErrorKindNone)
+            generateError = (JSONParseError){ kJSONErrorKindGenerator, index };
+          __JSONGeneratorRelease(generator);
+          if (NULL == (generator = __JSONNewlineDelimitedGeneratorCreate(allocator, options))) {
+            CFRelease(data);
+            data = NULL;
+            generateError.kind = kJSONErrorKindOutOfMemory;
+          }
+        }
+      }
+    }
+    __JSONGeneratorRelease(generator);
+  }
+  if (generateError.kind != kJSONErrorKindNone && error)
+    *error = __JSONErrorCreate(allocator, generateError, NULL, 0);
+  return data;
+}
+
+#pragma Writer
+
+// Fails the writer, only the first cause is kept.
+inline void __JSONWriterFail(JSONWriterRef writer, JSONErrorKind kind) {
+  if (!writer->failed)
+    writer->failure = kind;
+  writer->failed = 1;
+}
+
+// yajl print callback, collects generated bytes in the writer's buffer and flushes them once
+// they reach flush size, so large values don't have to be buffered whole.
+inline void __JSONWriterPrint(void *context, const char *bytes, size_t length) {
+  JSONWriterRef writer = (JSONWriterRef)context;
+  __JSON_WRITER_STATISTICS(writer, statistics->bytesCount += length);
+  if (writer->bufferLength + (CFIndex)length > writer->bufferSize) {
+    
+    // Move not yet flushed bytes to the beginning first
+    if (writer->bufferIndex) {
+      memmove(writer->buffer, writer->buffer + writer->bufferIndex, writer->bufferLength - writer->bufferIndex);
+      writer->bufferLength -= writer->bufferIndex;
+      writer->bufferIndex = 0;
+    }
+    if (writer->bufferLength + (CFIndex)length > writer->bufferSize) {
+      CFIndex largerSize = writer->bufferSize ? writer->bufferSize << 1 : CORE_JSON_WRITER_FLUSH_SIZE;
+      while (largerSize < writer->bufferLength + (CFIndex)length)
+        largerSize <<= 1;
+      unsigned char *largerBuffer = CFAllocatorReallocate(writer->allocator, writer->buffer, largerSize, 0);
+      if (largerBuffer) {
+        writer->bufferSize = largerSize;
+        writer->buffer = largerBuffer;
+      }
+    }
+  }
+  if (writer->bufferLength + (CFIndex)length <= writer->bufferSize) {
+    memcpy(writer->buffer + writer->bufferLength, bytes, length);
+    writer->bufferLength += length;
+    if (!writer->failed && JSONWriterGetBufferedLength(writer) >= writer->flushSize)
+      JSONWriterFlush(writer);
+  } else {
+    __JSONWriterFail(writer, kJSONErrorKindOutOfMemory);
+  }
+}
+
+// Common tail of all events - flushes if needed and reports backpressure. Rejected events
+// (ie. value instead of a key, or anything after complete document) are not written, the
+// writer can continue.
+inline JSONWriterStatus __JSONWriterDidAppend(JSONWriterRef writer, yajl_gen_status status) {
+  if (status != yajl_gen_status_ok)
+    return kJSONWriterStatusError;
+  if (!writer->failed && JSONWriterGetBufferedLength(writer) >= writer->flushSize)
+    JSONWriterFlush(writer);
+  if (writer->failed)
+    return kJSONWriterStatusError;
+  else if (JSONWriterGetBufferedLength(writer) > writer->maximumSize)
+    return kJSONWriterStatusWouldBlock;
+  else
+    return kJSONWriterStatusOK;
+}
+
+inline JSONWriterRef JSONWriterCreate(CFAllocatorRef allocator, JSONWriteOptions options, JSONWriterWriteCallBack callBack, void *info) {
+  JSONWriterRef writer = NULL;
+  if (callBack && (writer = CFAllocatorAllocate(allocator, sizeof(__JSONWriter), 0))) {
+    writer->allocator = allocator ? CFRetain(allocator) : NULL;
+    writer->retainCount = 1;
+    writer->callBack = callBack;
+    writer->info = info;
+    writer->buffer = NULL;
+    writer->bufferIndex = 0;
+    writer->bufferLength = 0;
+    writer->bufferSize = 0;
+    writer->flushSize = CORE_JSON_WRITER_FLUSH_SIZE;
+    writer->maximumSize = CORE_JSON_WRITER_MAXIMUM_SIZE;
+    writer->failed = 0;
+    writer->failure = kJSONErrorKindNone;
+    memset(&writer->statistics, 0, sizeof(writer->statistics));
+    if ((writer->generator = __JSONGeneratorCreate(writer->allocator, options, NULL)))
+      yajl_gen_config(writer->generator->yajlGen, yajl_gen_print_callback, __JSONWriterPrint, writer);
+    else
+      writer = JSONWriterRelease(writer);
+  }
+  return writer;
+}
+
+inline bool JSONWriterSetStatisticsEnabled(JSONWriterRef writer, bool enabled) {
+  writer->generator->statistics = CORE_JSON_STATISTICS && enabled ? &writer->statistics : NULL;
+  return CORE_JSON_STATISTICS;
+}
+
+inline JSONGeneratorStatistics JSONWriterGetStatistics(JSONWriterRef writer) {
+  return writer->statistics;
+}
+
+inline void JSONWriterResetStatistics(JSONWriterRef writer) {
+  memset(&writer->statistics, 0, sizeof(writer->statistics));
+}
+
+inline JSONWriterRef JSONWriterRetain(JSONWriterRef writer) {
+  if (writer)
+    writer->retainCount++;
+  return writer;
+}
+
+// Releasing the writer doesn't flush buffered output, call JSONWriterFlush before.
+inline JSONWriterRef JSONWriterRelease(JSONWriterRef writer) {
+  if (writer) {
+    if (--writer->retainCount == 0) {
+      CFAllocatorRef allocator = writer->allocator;
+      if (writer->generator)
+        writer->generator = __JSONGeneratorRelease(writer->generator);
+      if (writer->buffer)
+        CFAllocatorDeallocate(allocator, writer->buffer);
+      CFAllocatorDeallocate(allocator, writer);
+      if (allocator)
+        CFRelease(allocator);
+      writer = NULL;
+    }
+  }
+  return writer;
+}
+
+inline void JSONWriterSetBufferSizes(JSONWriterRef writer, CFIndex flushSize, CFIndex maximumSize) {
+  writer->flushSize = flushSize;
+  writer->maximumSize = maximumSize > flushSize ? maximumSize : flushSize;
+}
+
+inline CFIndex JSONWriterGetBufferedLength(JSONWriterRef writer) {
+  return writer->bufferLength - writer->bufferIndex;
+}
+
+// Writes buffered bytes to the sink until it's empty or the sink stops accepting them.
+// Returns kJSONWriterStatusOK only when everything has been written.
+inline JSONWriterStatus JSONWriterFlush(JSONWriterRef writer) {
+  while (!writer->failed && writer->bufferIndex < writer->bufferLength) {
+    CFIndex length = writer->callBack(writer->info, writer->buffer + writer->bufferIndex, writer->bufferLength - writer->bufferIndex);
+    if (length < 0)
+      __JSONWriterFail(writer, kJSONErrorKindFile);
+    else if (length == 0)
+      break;
+    else
+      writer->bufferIndex += length;
+  }
+  if (writer->bufferIndex == writer->bufferLength)
+    writer->bufferIndex = writer->bufferLength = 0;
+  if (writer->failed)
+    return kJSONWriterStatusError;
+  else if (writer->bufferIndex < writer->bufferLength)
+    return kJSONWriterStatusWouldBlock;
+  else
+    return kJSONWriterStatusOK;
+}
+
+inline JSONWriterStatus JSONWriterBeginObject(JSONWriterRef writer) {
+  __JSON_WRITER_STATISTICS(writer, statistics->dictionariesCount++; if (++statistics->depth > statistics->maximumDepth) statistics->maximumDepth = statistics->depth);
+  return __JSONWriterDidAppend(writer, yajl_gen_map_open(writer->generator->yajlGen));
+}
+
+inline JSONWriterStatus JSONWriterEndObject(JSONWriterRef writer) {
+  __JSON_WRITER_STATISTICS(writer, statistics->depth--);
+  return __JSONWriterDidAppend(writer, yajl_gen_map_close(writer->generator->yajlGen));
+}
+
+inline JSONWriterStatus JSONWriterBeginArray(JSONWriterRef writer) {
+  __JSON_WRITER_STATISTICS(writer, statistics->arraysCount++; if (++statistics->depth > statistics->maximumDepth) statistics->maximumDepth = statistics->depth);
+  return __JSONWriterDidAppend(writer, yajl_gen_array_open(writer->generator->yajlGen));
+}
+
+inline JSONWriterStatus JSONWriterEndArray(JSONWriterRef writer) {
+  __JSON_WRITER_STATISTICS(writer, statistics->depth--);
+  return __JSONWriterDidAppend(writer, yajl_gen_array_close(writer->generator->yajlGen));
+}
+
+// Keys and strings are generated the same way, yajl keeps track of what is expected.
+inline JSONWriterStatus JSONWriterAppendKey(JSONWriterRef writer, CFStringRef key) {
+  return JSONWriterAppendString(writer, key);
+}
+
+inline JSONWriterStatus JSONWriterAppendKeyWithBytes(JSONWriterRef writer, const UInt8 *bytes, CFIndex length) {
+  return JSONWriterAppendStringWithBytes(writer, bytes, length);
+}
+
+inline JSONWriterStatus JSONWriterAppendString(JSONWriterRef writer, CFStringRef value) {
+  JSONWriterStatus status = kJSONWriterStatusError;
+  CFDataRef data = CFStringCreateExternalRepresentation(writer->allocator, value, kCFStringEncodingUTF8, 0);
+  if (data) {
+    status = JSONWriterAppendStringWithBytes(writer, CFDataGetBytePtr(data), CFDataGetLength(data));
+    CFRelease(data);
+  } else {
+    __JSONWriterFail(writer, kJSONErrorKindOutOfMemory);
+  }
+  return status;
+}
+
+inline JSONWriterStatus JSONWriterAppendStringWithBytes(JSONWriterRef writer, const UInt8 *bytes, CFIndex length) {
+  __JSON_WRITER_STATISTICS(writer, statistics->stringsCount++);
+  return __JSONWriterDidAppend(writer, yajl_gen_string(writer->generator->yajlGen, bytes, length));
+}
+
+inline JSONWriterStatus JSONWriterAppendLongLong(JSONWriterRef writer, long long value) {
+  __JSON_WRITER_STATISTICS(writer, statistics->numbersCount++);
+  return __JSONWriterDidAppend(writer, yajl_gen_integer(writer->generator->yajlGen, value));
+}
+
+inline JSONWriterStatus JSONWriterAppendDouble(JSONWriterRef writer, double value) {
+  __JSON_WRITER_STATISTICS(writer, statistics->numbersCount++);
+  return __JSONWriterDidAppend(writer, yajl_gen_double(writer->generator->yajlGen, value));
+}
+
+inline JSONWriterStatus JSONWriterAppendBoolean(JSONWriterRef writer, bool value) {
+  __JSON_WRITER_STATISTICS(writer, statistics->booleansCount++);
+  return __JSONWriterDidAppend(writer, yajl_gen_bool(writer->generator->yajlGen, value));
+}
+
+inline JSONWriterStatus JSONWriterAppendNull(JSONWriterRef writer) {
+  __JSON_WRITER_STATISTICS(writer, statistics->nullsCount++);
+  return __JSONWriterDidAppend(writer, yajl_gen_null(writer->generator->yajlGen));
+}
+
+// Appends CF value with all its children using generator append callbacks. Values can't be
+// rejected half way, yajl errors and skipped values (unsupported types) fail the writer.
+inline JSONWriterStatus JSONWriterAppendValue(JSONWriterRef writer, CFTypeRef value) {
+  __JSONGeneratorRef generator = writer->generator;
+  generator->status = yajl_gen_status_ok;
+  generator->skipped = 0;
+  __JSONGeneratorAppendValue(writer->allocator, &generator->yajlGen, value);
+  if (generator->status != yajl_gen_status_ok || generator->skipped)
+    __JSONWriterFail(writer, kJSONErrorKindGenerator);
+  return __JSONWriterDidAppend(writer, generator->status);
+}
+
+#pragma Deferred release
+
+static pthread_mutex_t __JSONDeferredReleaseMutex              = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  __JSONDeferredReleaseCondition          = PTHREAD_COND_INITIALIZER;
+static bool            __JSONDeferredReleaseThreadCreated      = 0;
+static CFTypeRef       __JSONDeferredReleaseQueue[CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE];
+static CFIndex         __JSONDeferredReleaseQueueIndex         = 0; // Next value to release
+static CFIndex         __JSONDeferredReleaseQueueCount         = 0; // Values in the queue
+static CFIndex         __JSONDeferredReleaseQueueLength        = 0; // Values in the queue and being released
+static CFIndex         __JSONDeferredReleaseQueueHighWaterMark = 0;
+static CFIndex         __JSONDeferredReleaseInlineCount        = 0;
+static CFIndex         __JSONDeferredReleaseThreshold          = CORE_JSON_DEFERRED_RELEASE_THRESHOLD;
+static CFIndex         __JSONDeferredReleaseMaximumQueueLength = CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE;
+
+typedef struct {
+  CFIndex size;
+  CFIndex limit;
+} __JSONDeferredReleaseSizeContext;
+
+static void __JSONDeferredReleaseAddSize(__JSONDeferredReleaseSizeContext *context, CFTypeRef value);
+
+static void __JSONDeferredReleaseAddArrayValueSize(const void *value, void *context) {
+  __JSONDeferredReleaseAddSize((__JSONDeferredReleaseSizeContext *)context, value);
+}
+
+static void __JSONDeferredReleaseAddDictionaryValueSize(const void *key, const void *value, void *context) {
+  __JSONDeferredReleaseAddSize((__JSONDeferredReleaseSizeContext *)context, value);
+}
+
+// Adds elements of the container and its nested containers which are freed together with it,
+// children shared with other owners are not counted. Containers are entered only while their
+// elements don't reach the limit, so at most limit elements are visited.
+static void __JSONDeferredReleaseAddSize(__JSONDeferredReleaseSizeContext *context, CFTypeRef value) {
+  if (context->size < context->limit && CFGetRetainCount(value) == 1) {
+    CFTypeID typeID = CFGetTypeID(value);
+    if (typeID == CFArrayGetTypeID()) {
+      CFIndex n = CFArrayGetCount(value);
+      if ((context->size += n) < context->limit)
+        CFArrayApplyFunction(value, CFRangeMake(0, n), __JSONDeferredReleaseAddArrayValueSize, context);
+    } else if (typeID == CFDictionaryGetTypeID()) {
+      if ((context->size += CFDictionaryGetCount(value)) < context->limit)
+        CFDictionaryApplyFunction(value, __JSONDeferredReleaseAddDictionaryValueSize, context);
+    }
+  }
+}
+
+// Only the last reference to a large tree is worth moving to the background thread. Size counts
+// nested elements as well, so { "data": [<1M elements>] } is deferred.
+inline bool __JSONDeferredReleaseShouldDefer(CFTypeRef value) {
+  CFIndex threshold = __atomic_load_n(&__JSONDeferredReleaseThreshold, __ATOMIC_RELAXED);
+  __JSONDeferredReleaseSizeContext context = { 0, threshold > 0 ? threshold : 1 };
+  __JSONDeferredReleaseAddSize(&context, value);
+  return context.size >= context.limit;
+}
+
+inline void *__JSONDeferredReleaseThread(void *context) {
+  pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+  while (1) {
+    while (__JSONDeferredReleaseQueueCount == 0)
+      pthread_cond_wait(&__JSONDeferredReleaseCondition, &__JSONDeferredReleaseMutex);
+    CFTypeRef value = __JSONDeferredReleaseQueue[__JSONDeferredReleaseQueueIndex];
+    __JSONDeferredReleaseQueueIndex = (__JSONDeferredReleaseQueueIndex + 1) % CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE;
+    __JSONDeferredReleaseQueueCount--;
+    pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+    
+    CFRelease(value);
+    
+    pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+    __JSONDeferredReleaseQueueLength--;
+  }
+  return NULL;
+}
+
+inline void JSONReleaseDeferred(CFTypeRef value) {
+  if (value) {
+    bool deferred = 0;
+    if (__JSONDeferredReleaseShouldDefer(value)) {
+      pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+      if (!__JSONDeferredReleaseThreadCreated) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, __JSONDeferredReleaseThread, NULL) == 0) {
+          pthread_detach(thread);
+          __JSONDeferredReleaseThreadCreated = 1;
+        }
+      }
+      if (__JSONDeferredReleaseThreadCreated && __JSONDeferredReleaseQueueCount < CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE && __JSONDeferredReleaseQueueLength < __JSONDeferredReleaseMaximumQueueLength) {
+        __JSONDeferredReleaseQueue[(__JSONDeferredReleaseQueueIndex + __JSONDeferredReleaseQueueCount) % CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE] = value;
+        __JSONDeferredReleaseQueueCount++;
+        if (++__JSONDeferredReleaseQueueLength > __JSONDeferredReleaseQueueHighWaterMark)
+          __JSONDeferredReleaseQueueHighWaterMark = __JSONDeferredReleaseQueueLength;
+        pthread_cond_signal(&__JSONDeferredReleaseCondition);
+        deferred = 1;
+      } else {
+        __JSONDeferredReleaseInlineCount++;
+      }
+      pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+    }
+    if (!deferred)
+      CFRelease(value);
+  }
+}
+
+inline void JSONSetDeferredReleaseThreshold(CFIndex threshold) {
+  __atomic_store_n(&__JSONDeferredReleaseThreshold, threshold, __ATOMIC_RELAXED);
+}
+
+inline void JSONSetDeferredReleaseMaximumQueueLength(CFIndex maximumQueueLength) {
+  pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+  __JSONDeferredReleaseMaximumQueueLength = maximumQueueLength < CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE ? maximumQueueLength : CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE;
+  pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+}
+
+inline CFIndex JSONGetDeferredReleaseQueueLength(void) {
+  pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+  CFIndex queueLength = __JSONDeferredReleaseQueueLength;
+  pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+  return queueLength;
+}
+
+inline CFIndex JSONGetDeferredReleaseQueueHighWaterMark(void) {
+  pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+  CFIndex highWaterMark = __JSONDeferredReleaseQueueHighWaterMark;
+  pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+  return highWaterMark;
+}
+
+inline CFIndex JSONGetDeferredReleaseInlineCount(void) {
+  pthread_mutex_lock(&__JSONDeferredReleaseMutex);
+  CFIndex inlineCount = __JSONDeferredReleaseInlineCount;
+  pthread_mutex_unlock(&__JSONDeferredReleaseMutex);
+  return inlineCount;
+}
+
+#pragma Converters
+
+static inline bool __JSONConvertDigits(const UInt8 *bytes, CFIndex n, int *value) {
+  *value = 0;
+  for (CFIndex i = 0; i < n; i++) {
+    if (bytes[i] < '0' || bytes[i] > '9')
+      return 0;
+    *value = *value * 10 + (bytes[i] - '0');
+  }
+  return 1;
+}
+
+// Days since 1970-01-01 in proleptic Gregorian calendar
+static inline long __JSONDaysFromCivil(long year, int month, int day) {
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long yoe = year - era * 400;
+  long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// YYYY-MM-DD(T| )HH:MM:SS[.fraction][Z|(+|-)HH[:]MM]
+inline CFTypeRef JSONConvertISO8601Date(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info) {
+  int year, month, day, hour, minute, second;
+  if (length < 19 || bytes[4] != '-' || bytes[7] != '-' || (bytes[10] != 'T' && bytes[10] != ' ') || bytes[13] != ':' || bytes[16] != ':')
+    return NULL;
+  if (!__JSONConvertDigits(bytes, 4, &year) || !__JSONConvertDigits(bytes + 5, 2, &month) || !__JSONConvertDigits(bytes + 8, 2, &day) ||
+      !__JSONConvertDigits(bytes + 11, 2, &hour) || !__JSONConvertDigits(bytes + 14, 2, &minute) || !__JSONConvertDigits(bytes + 17, 2, &second))
+    return NULL;
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+    return NULL;
+  
+  CFIndex i = 19;
+  double fraction = 0;
+  if (i < length && bytes[i] == '.') {
+    double scale = 0.1;
+    for (i++; i < length && bytes[i] >= '0' && bytes[i] <= '9'; i++, scale /= 10)
+      fraction += (bytes[i] - '0') * scale;
+  }
+  
+  int offset = 0;
+  if (i < length) {
+    if (bytes[i] == 'Z' && i + 1 == length) {
+      i++;
+    } else if ((bytes[i] == '+' || bytes[i] == '-') && (i + 6 == length || i + 5 == length)) {
+      int offsetHours, offsetMinutes;
+      const UInt8 *p = bytes + i + 1;
+      if (!__JSONConvertDigits(p, 2, &offsetHours) || !__JSONConvertDigits(p + (i + 6 == length ? 3 : 2), 2, &offsetMinutes) || (i + 6 == length && p[2] != ':'))
+        return NULL;
+      offset = (offsetHours * 60 + offsetMinutes) * 60 * (bytes[i] == '-' ? -1 : 1);
+    } else {
+      return NULL;
+    }
+  }
+  
+  double seconds = (double)__JSONDaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset + fraction;
+  return CFDateCreate(allocator, seconds - kCFAbsoluteTimeIntervalSince1970);
+}
+
+static inline int __JSONConvertHexDigit(UInt8 c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+inline CFTypeRef JSONConvertUUID(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info) {
+  CFUUIDBytes uuid;
+  UInt8 *p = (UInt8 *)&uuid;
+  if (length != 36)
+    return NULL;
+  for (CFIndex i = 0; i < 36; ) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      if (bytes[i++] != '-')
+        return NULL;
+      continue;
+    }
+    int high = __JSONConvertHexDigit(bytes[i]), low = __JSONConvertHexDigit(bytes[i + 1]);
+    if (high < 0 || low < 0)
+      return NULL;
+    *p++ = (UInt8)(high << 4 | low);
+    i += 2;
+  }
+  return CFUUIDCreateFromUUIDBytes(allocator, uuid);
+}
+
+inline CFTypeRef JSONConvertURL(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info) {
+  return CFURLCreateWithBytes(allocator, bytes, length, kCFStringEncodingUTF8, NULL);
+}
+
+static SInt8          __JSONConvertBase64Table[256];
+static pthread_once_t __JSONConvertBase64TableOnce = PTHREAD_ONCE_INIT;
+
+static void __JSONConvertBase64TableInitialize(void) {
+  memset(__JSONConvertBase64Table, -1, sizeof(__JSONConvertBase64Table));
+  for (int i = 0; i < 64; i++)
+    __JSONConvertBase64Table[(UInt8)__JSONGeneratorBase64Alphabet[i]] = i;
+}
+
+// Standard alphabet, padding is optional
+inline CFTypeRef JSONConvertBase64Data(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info) {
+  pthread_once(&__JSONConvertBase64TableOnce, __JSONConvertBase64TableInitialize);
+  
+  while (length > 0 && bytes[length - 1] == '=')
+    length--;
+  if (length % 4 == 1)
+    return NULL;
+  
+  CFIndex n = length / 4 * 3 + (length % 4 ? length % 4 - 1 : 0);
+  UInt8 *buffer = CFAllocatorAllocate(allocator, n ? n : 1, 0);
+  if (buffer == NULL)
+    return NULL;
+  UInt8 *p = buffer;
+  UInt32 quad = 0;
+  for (CFIndex i = 0; i < length; i++) {
+    SInt8 sextet = __JSONConvertBase64Table[bytes[i]];
+    if (sextet < 0) {
+      CFAllocatorDeallocate(allocator, buffer);
+      return NULL;
+    }
+    quad = quad << 6 | sextet;
+    if ((i & 3) == 3) {
+      *p++ = quad >> 16;
+      *p++ = quad >> 8;
+      *p++ = quad;
+    }
+  }
+  switch (length & 3) {
+    case 2: *p++ = quad >> 4; break;
+    case 3: *p++ = quad >> 10; *p++ = quad >> 2; break;
+  }
+  CFDataRef data = CFDataCreateWithBytesNoCopy(allocator, buffer, n, allocator);
+  if (data == NULL)
+    CFAllocatorDeallocate(allocator, buffer);
+  return data;
+}
+
+#pragma Parser
+
+inline JSONParserRef JSONParserCreate(CFAllocatorRef allocator, JSONReadOptions options) {
+  JSONParserRef parser = CFAllocatorAllocate(allocator, sizeof(__JSONParser), 0);
+  if (parser) {
+    parser->allocator = allocator ? CFRetain(allocator) : NULL;
+    parser->retainCount = 1;
+    parser->options = options;
+    parser->savedStringsCount = 0;
+    parser->savedStringsSize = 0;
+    parser->savedContainersCount = 0;
+    parser->savedContainerValuesCount = 0;
+    parser->converters = NULL;
+    parser->statisticsEnabled = 0;
+    parser->limitsEnabled = 0;
+    memset(&parser->statistics, 0, sizeof(parser->statistics));
+    __JSONShapeInitialize(&parser->shape);
+    if (NULL == (parser->scratchAllocator = __JSONArenaAllocatorCreate(parser->allocator)))
+      parser = JSONParserRelease(parser);
+  }
+  return parser;
+}
+
+inline JSONParserRef JSONParserRetain(JSONParserRef parser) {
+  if (parser)
+    parser->retainCount++;
+  return parser;
+}
+
+inline JSONParserRef JSONParserRelease(JSONParserRef parser) {
+  if (parser) {
+    if (--parser->retainCount == 0) {
+      CFAllocatorRef allocator = parser->allocator;
+      if (parser->scratchAllocator)
+        CFRelease(parser->scratchAllocator);
+      if (parser->converters) {
+        CFIndex n = CFDictionaryGetCount(parser->converters);
+        const void **converters = CFAllocatorAllocate(allocator, sizeof(const void *) * (n ? n : 1), 0);
+        CFDictionaryGetKeysAndValues(parser->converters, NULL, converters);
+        for (CFIndex i = 0; i < n; i++)
+          CFAllocatorDeallocate(allocator, (void *)converters[i]);
+        CFAllocatorDeallocate(allocator, converters);
+        CFRelease(parser->converters);
+      }
+      CFAllocatorDeallocate(allocator, parser);
+      if (allocator)
+        CFRelease(allocator);
+      parser = NULL;
+    }
+  }
+  return parser;
+}
+
+// Parse state for a single parse with parser's allocators, shape, limits and converters.
+static inline __JSONRef __JSONParserCreateJSON(JSONParserRef parser) {
+  __JSONRef json = __JSONCreateWithLimits(parser->allocator, parser->scratchAllocator, &parser->shape, parser->options, parser->limitsEnabled ? &parser->limits : NULL);
+  if (json) {
+    json->converters = parser->converters;
+    json->statistics = parser->statisticsEnabled ? &parser->statistics : NULL;
+  }
+  return json;
+}
+
+// Creates the object if parsing succeeded, learns its shape and releases json.
+static inline CFTypeRef __JSONParserCreateObjectAndRelease(JSONParserRef parser, __JSONRef json, bool parsed) {
+  CFTypeRef result = NULL;
+  if (parsed && (result = __JSONCreateObject(json)))
+    __JSONShapeLearn(&parser->shape, json->elementsIndex);
+  if (json->strings) {
+    parser->savedStringsCount += json->strings->savedCount;
+    parser->savedStringsSize += json->strings->savedSize;
+  }
+  if (json->containers) {
+    parser->savedContainersCount += json->containers->savedCount;
+    parser->savedContainerValuesCount += json->containers->savedValuesCount;
+  }
+  __JSONRelease(json);
+  return result;
+}
+
+inline CFTypeRef JSONParserCreateObjectWithString(JSONParserRef parser, CFStringRef string, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  CFIndex size = __JSONTraceGetStringSize(string);
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, size);
+  if ((json = __JSONParserCreateJSON(parser)))
+    result = __JSONParserCreateObjectAndRelease(parser, json, __JSONParseWithString(json, string, error));
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, size, result != NULL);
+  return result;
+}
+
+inline void JSONParserSetLimits(JSONParserRef parser, const JSONParseLimits *limits) {
+  if ((parser->limitsEnabled = limits != NULL))
+    parser->limits = *limits;
+}
+
+inline bool JSONParserSetStatisticsEnabled(JSONParserRef parser, bool enabled) {
+  parser->statisticsEnabled = CORE_JSON_STATISTICS && enabled;
+  return CORE_JSON_STATISTICS;
+}
+
+inline JSONParserStatistics JSONParserGetStatistics(JSONParserRef parser) {
+  return parser->statistics;
+}
+
+inline void JSONParserResetStatistics(JSONParserRef parser) {
+  memset(&parser->statistics, 0, sizeof(parser->statistics));
+}
+
+inline bool JSONParserSetConvertCallBack(JSONParserRef parser, CFStringRef key, JSONParserConvertCallBack callBack, void *info) {
+  if (parser->converters == NULL)
+    if (NULL == (parser->converters = CFDictionaryCreateMutable(parser->allocator, 0, &kCFTypeDictionaryKeyCallBacks, NULL)))
+      return 0;
+  
+  __JSONConverter *converter = (__JSONConverter *)CFDictionaryGetValue(parser->converters, key);
+  if (converter) {
+    CFDictionaryRemoveValue(parser->converters, key);
+    CFAllocatorDeallocate(parser->allocator, converter);
+  }
+  if (callBack) {
+    if (NULL == (converter = CFAllocatorAllocate(parser->allocator, sizeof(__JSONConverter), 0)))
+      return 0;
+    converter->callBack = callBack;
+    converter->info = info;
+    CFDictionarySetValue(parser->converters, key, converter);
+  }
+  return 1;
+}
+
+inline CFIndex JSONParserGetSavedStringsCount(JSONParserRef parser) {
+  return parser->savedStringsCount;
+}
+
+inline CFIndex JSONParserGetSavedStringsSize(JSONParserRef parser) {
+  return parser->savedStringsSize;
+}
+
+inline CFIndex JSONParserGetSavedContainersCount(JSONParserRef parser) {
+  return parser->savedContainersCount;
+}
+
+inline CFIndex JSONParserGetSavedContainerValuesCount(JSONParserRef parser) {
+  return parser->savedContainerValuesCount;
+}
+
+#pragma Document
+
+inline JSONDocumentRef JSONDocumentCreateWithString(CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, CFErrorRef *error) {
+  JSONDocumentRef document = CFAllocatorAllocate(allocator, sizeof(__JSONDocument), 0);
+  if (document) {
+    document->allocator = allocator ? CFRetain(allocator) : NULL;
+    document->retainCount = 1;
+    document->object = NULL;
+    if ((document->region = __JSONRegionCreate(document->allocator))) {
+      CFAllocatorRef regionAllocator = __JSONRegionAllocatorCreate(document->region);
+      CFAllocatorRef scratchAllocator = __JSONArenaAllocatorCreate(document->allocator);
+      if (regionAllocator && scratchAllocator) {
+        __JSONRef json = __JSONCreateWithContext(regionAllocator, scratchAllocator, NULL, options);
+        if (json) {
+          if (__JSONParseWithString(json, string, error))
+            document->object = __JSONCreateObject(json);
+          __JSONRelease(json);
+        }
+      }
+      if (scratchAllocator)
+        CFRelease(scratchAllocator);
+      
+      // Region allocator is kept alive by created objects and freed with the region
+      if (regionAllocator)
+        CFRelease(regionAllocator);
+    }
+    if (document->object == NULL)
+      document = JSONDocumentRelease(document);
+  }
+  return document;
+}
+
+inline JSONDocumentRef JSONDocumentRetain(JSONDocumentRef document) {
+  if (document)
+    document->retainCount++;
+  return document;
+}
+
+// Frees all objects of the document at once, the object graph is not released one by one.
+inline JSONDocumentRef JSONDocumentRelease(JSONDocumentRef document) {
+  if (document) {
+    if (--document->retainCount == 0) {
+      CFAllocatorRef allocator = document->allocator;
+      __JSONRegionDestroy(document->region);
+      CFAllocatorDeallocate(allocator, document);
+      if (allocator)
+        CFRelease(allocator);
+      document = NULL;
+    }
+  }
+  return document;
+}
+
+// The object is valid as long as the document is alive.
+inline CFTypeRef JSONDocumentGetObject(JSONDocumentRef document) {
+  return document->object;
+}
+
+inline CFIndex JSONDocumentGetSize(JSONDocumentRef document) {
+  return document->region->size;
+}
+
+#pragma MessagePack
+
+static __JSONPackerAppendCallBack __JSONPackerAppendCallBacks[CORE_JSON_GENERATOR_CALLBACKS_SIZE];
+static pthread_once_t             __JSONPackerAppendCallBacksOnce = PTHREAD_ONCE_INIT;
+
+static inline bool __JSONPackerReserve(__JSONPackerRef packer, CFIndex length) {
+  if (packer->length + length > packer->size) {
+    CFIndex size = packer->size ? packer->size : CORE_JSON_PACKER_INITIAL_SIZE;
+    while (size < packer->length + length)
+      size <<= 1;
+    UInt8 *bytes = CFAllocatorReallocate(packer->allocator, packer->bytes, size, 0);
+    if (bytes == NULL) {
+      packer->failed = 1;
+      return 0;
+    }
+    packer->bytes = bytes;
+    packer->size = size;
+  }
+  return 1;
+}
+
+// Appends type byte followed by size bytes of big endian value.
+static inline void __JSONPackerAppendType(__JSONPackerRef packer, UInt8 type, UInt64 value, CFIndex size) {
+  if (__JSONPackerReserve(packer, 1 + size)) {
+    UInt8 *p = packer->bytes + packer->length;
+    *p++ = type;
+    for (CFIndex i = size - 1; i >= 0; i--)
+      *p++ = (UInt8)(value >> (i * 8));
+    packer->length += 1 + size;
+  }
+}
+
+// Header of a string, binary, array or map. fixLimit is 0 for types without fix variant, type8
+// is 0 for types without 8 bit length.
+static inline void __JSONPackerAppendLength(__JSONPackerRef packer, CFIndex length, UInt8 fixType, CFIndex fixLimit, UInt8 type8, UInt8 type16, UInt8 type32) {
+  if (length < fixLimit)
+    __JSONPackerAppendType(packer, fixType | (UInt8)length, 0, 0);
+  else if (type8 && length <= 0xff)
+    __JSONPackerAppendType(packer, type8, length, 1);
+  else if (length <= 0xffff)
+    __JSONPackerAppendType(packer, type16, length, 2);
+  else
+    __JSONPackerAppendType(packer, type32, length, 4);
+}
+
+static inline CFIndex __JSONPackerGetStringHeaderSize(CFIndex length) {
+  return length < 32 ? 1 : length <= 0xff ? 2 : length <= 0xffff ? 3 : 5;
+}
+
+static inline void __JSONPackerAppendLongLong(__JSONPackerRef packer, long long value) {
+  if (value >= 0) {
+    if (value < 128)
+      __JSONPackerAppendType(packer, (UInt8)value, 0, 0);
+    else if (value <= 0xff)
+      __JSONPackerAppendType(packer, 0xcc, value, 1);
+    else if (value <= 0xffff)
+      __JSONPackerAppendType(packer, 0xcd, value, 2);
+    else if (value <= 0xffffffffLL)
+      __JSONPackerAppendType(packer, 0xce, value, 4);
+    else
+      __JSONPackerAppendType(packer, 0xcf, value, 8);
+  } else {
+    if (value >= -32)
+      __JSONPackerAppendType(packer, (UInt8)value, 0, 0);
+    else if (value >= -128)
+      __JSONPackerAppendType(packer, 0xd0, (UInt64)value, 1);
+    else if (value >= -32768)
+      __JSONPackerAppendType(packer, 0xd1, (UInt64)value, 2);
+    else if (value >= -2147483648LL)
+      __JSONPackerAppendType(packer, 0xd2, (UInt64)value, 4);
+    else
+      __JSONPackerAppendType(packer, 0xd3, (UInt64)value, 8);
+  }
+}
+
+static inline void __JSONPackerAppendDouble(__JSONPackerRef packer, double value) {
+  UInt64 bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  __JSONPackerAppendType(packer, 0xcb, bits, 8);
+}
+
+static inline void __JSONPackerAppendNil(__JSONPackerRef packer) {
+  __JSONPackerAppendType(packer, 0xc0, 0, 0);
+}
+
+// UTF-8 is converted straight into the output after the largest header it may need, and moved
+// back if the actual length needs a shorter one.
+static void __JSONPackerAppendString(__JSONPackerRef packer, CFStringRef value) {
+  CFIndex length = CFStringGetLength(value);
+  CFIndex maximumSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+  CFIndex headerSize = __JSONPackerGetStringHeaderSize(maximumSize);
+  if (__JSONPackerReserve(packer, headerSize + maximumSize)) {
+    CFIndex usedLength = 0;
+    CFStringGetBytes(value, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, 0, packer->bytes + packer->length + headerSize, maximumSize, &usedLength);
+    CFIndex usedHeaderSize = __JSONPackerGetStringHeaderSize(usedLength);
+    if (usedHeaderSize != headerSize)
+      memmove(packer->bytes + packer->length + usedHeaderSize, packer->bytes + packer->length + headerSize, usedLength);
+    __JSONPackerAppendLength(packer, usedLength, 0xa0, 32, 0xd9, 0xda, 0xdb);
+    packer->length += usedLength;
+  }
+}
+
+static void __JSONPackerAppendAttributedString(__JSONPackerRef packer, CFAttributedStringRef value) {
+  __JSONPackerAppendString(packer, CFAttributedStringGetString(value));
+}
+
+static void __JSONPackerAppendURL(__JSONPackerRef packer, CFURLRef value) {
+  __JSONPackerAppendString(packer, CFURLGetString(value));
+}
+
+static void __JSONPackerAppendUUID(__JSONPackerRef packer, CFUUIDRef value) {
+  CFStringRef string = CFUUIDCreateString(packer->allocator, value);
+  if (string) {
+    __JSONPackerAppendString(packer, string);
+    CFRelease(string);
+  } else {
+    packer->failed = 1;
+  }
+}
+
+static void __JSONPackerAppendNumber(__JSONPackerRef packer, CFNumberRef value) {
+  if (CFNumberIsFloatType(value)) {
+    double value_ = 0.0;
+    CFNumberGetValue(value, kCFNumberDoubleType, &value_);
+    __JSONPackerAppendDouble(packer, value_);
+  } else {
+    long long value_ = 0;
+    CFNumberGetValue(value, kCFNumberLongLongType, &value_);
+    __JSONPackerAppendLongLong(packer, value_);
+  }
+}
+
+static void __JSONPackerAppendBoolean(__JSONPackerRef packer, CFBooleanRef value) {
+  __JSONPackerAppendType(packer, CFBooleanGetValue(value) ? 0xc3 : 0xc2, 0, 0);
+}
+
+static void __JSONPackerAppendNull(__JSONPackerRef packer, CFNullRef value) {
+  __JSONPackerAppendNil(packer);
+}
+
+static void __JSONPackerAppendValues(__JSONPackerRef packer, const CFTypeRef *keys, const CFTypeRef *values, CFIndex n) {
+  if (keys)
+    __JSONPackerAppendLength(packer, n, 0x80, 16, 0, 0xde, 0xdf);
+  else
+    __JSONPackerAppendLength(packer, n, 0x90, 16, 0, 0xdc, 0xdd);
+  for (CFIndex i = 0; i < n; i++) {
+    if (keys)
+      __JSONPackerAppendValue(packer, keys[i]);
+    __JSONPackerAppendValue(packer, values[i]);
+  }
+}
+
+static void __JSONPackerAppendArray(__JSONPackerRef packer, CFArrayRef value) {
+  CFIndex n = CFArrayGetCount(value);
+  CFTypeRef *values = CFAllocatorAllocate(packer->allocator, sizeof(CFTypeRef) * (n ? n : 1), 0);
+  if (values) {
+    CFArrayGetValues(value, CFRangeMake(0, n), values);
+    __JSONPackerAppendValues(packer, NULL, values, n);
+    CFAllocatorDeallocate(packer->allocator, values);
+  } else {
+    packer->failed = 1;
+  }
+}
+
+static void __JSONPackerAppendSet(__JSONPackerRef packer, CFSetRef value) {
+  CFIndex n = CFSetGetCount(value);
+  CFTypeRef *values = CFAllocatorAllocate(packer->allocator, sizeof(CFTypeRef) * (n ? n : 1), 0);
+  if (values) {
+    CFSetGetValues(value, values);
+    __JSONPackerAppendValues(packer, NULL, values, n);
+    CFAllocatorDeallocate(packer->allocator, values);
+  } else {
+    packer->failed = 1;
+  }
+}
+
+// Works with compact objects as well.
+static void __JSONPackerAppendDictionary(__JSONPackerRef packer, CFTypeRef value) {
+  CFIndex n = JSONObjectGetCount(value);
+  CFTypeRef *keys = CFAllocatorAllocate(packer->allocator, sizeof(CFTypeRef) * (n ? n : 1) * 2, 0);
+  if (keys) {
+    JSONObjectGetKeysAndValues(value, keys, keys + n);
+    __JSONPackerAppendValues(packer, keys, keys + n, n);
+    CFAllocatorDeallocate(packer->allocator, keys);
+  } else {
+    packer->failed = 1;
+  }
+}
+
+// Compact objects are encoded as maps, lazy numbers as numbers and other data as binary.
+static void __JSONPackerAppendData(__JSONPackerRef packer, CFDataRef value) {
+  if (JSONObjectIsCompact(value)) {
+    __JSONPackerAppendDictionary(packer, value);
+  } else if (JSONNumberIsLazy(value)) {
+    long long value_ = 0;
+    if (JSONNumberIsFloatType(value) || !JSONNumberGetLongLong(value, &value_))
+      __JSONPackerAppendDouble(packer, JSONNumberGetDouble(value));
+    else
+      __JSONPackerAppendLongLong(packer, value_);
+  } else {
+    CFIndex length = CFDataGetLength(value);
+    __JSONPackerAppendLength(packer, length, 0, 0, 0xc4, 0xc5, 0xc6);
+    if (__JSONPackerReserve(packer, length)) {
+      memcpy(packer->bytes + packer->length, CFDataGetBytePtr(value), length);
+      packer->length += length;
+    }
+  }
+}
+
+// Timestamp extension (-1), 64 bit variant with 30 bit nanoseconds and 34 bit seconds if it fits,
+// 96 bit variant otherwise.
+static void __JSONPackerAppendDate(__JSONPackerRef packer, CFDateRef value) {
+  double time = CFDateGetAbsoluteTime(value) + kCFAbsoluteTimeIntervalSince1970;
+  double seconds = floor(time);
+  UInt64 nanoseconds = (UInt64)round((time - seconds) * 1e9);
+  if (nanoseconds > 999999999)
+    nanoseconds = 999999999;
+  if (seconds >= 0 && seconds < 17179869184.0) {
+    __JSONPackerAppendType(packer, 0xd7, 0xff, 1);
+    __JSONPackerAppendType(packer, (UInt8)(nanoseconds >> 22), (nanoseconds << 34 | (UInt64)seconds) & 0x00ffffffffffffffULL, 7);
+  } else {
+    __JSONPackerAppendType(packer, 0xc7, 12, 1);
+    __JSONPackerAppendType(packer, 0xff, nanoseconds, 4);
+    if (__JSONPackerReserve(packer, 8)) {
+      UInt64 seconds_ = (UInt64)(long long)seconds;
+      for (CFIndex i = 7; i >= 0; i--)
+        packer->bytes[packer->length++] = (UInt8)(seconds_ >> (i * 8));
+    }
+  }
+}
+
+static void __JSONPackerSetDefaultAppendCallBack(CFTypeID typeID, __JSONPackerAppendCallBack callBack) {
+  if (typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE)
+    __JSONPackerAppendCallBacks[typeID] = callBack;
+}
+
+static void __JSONPackerSetDefaultAppendCallBacks(void) {
+  __JSONPackerSetDefaultAppendCallBack(CFStringGetTypeID(),           (__JSONPackerAppendCallBack)__JSONPackerAppendString);
+  __JSONPackerSetDefaultAppendCallBack(CFNumberGetTypeID(),           (__JSONPackerAppendCallBack)__JSONPackerAppendNumber);
+  __JSONPackerSetDefaultAppendCallBack(CFArrayGetTypeID(),            (__JSONPackerAppendCallBack)__JSONPackerAppendArray);
+  __JSONPackerSetDefaultAppendCallBack(CFDictionaryGetTypeID(),       (__JSONPackerAppendCallBack)__JSONPackerAppendDictionary);
+  __JSONPackerSetDefaultAppendCallBack(CFAttributedStringGetTypeID(), (__JSONPackerAppendCallBack)__JSONPackerAppendAttributedString);
+  __JSONPackerSetDefaultAppendCallBack(CFBooleanGetTypeID(),          (__JSONPackerAppendCallBack)__JSONPackerAppendBoolean);
+  __JSONPackerSetDefaultAppendCallBack(CFDataGetTypeID(),             (__JSONPackerAppendCallBack)__JSONPackerAppendData);
+  __JSONPackerSetDefaultAppendCallBack(CFDateGetTypeID(),             (__JSONPackerAppendCallBack)__JSONPackerAppendDate);
+  __JSONPackerSetDefaultAppendCallBack(CFNullGetTypeID(),             (__JSONPackerAppendCallBack)__JSONPackerAppendNull);
+  __JSONPackerSetDefaultAppendCallBack(CFSetGetTypeID(),              (__JSONPackerAppendCallBack)__JSONPackerAppendSet);
+  __JSONPackerSetDefaultAppendCallBack(CFURLGetTypeID(),              (__JSONPackerAppendCallBack)__JSONPackerAppendURL);
+  __JSONPackerSetDefaultAppendCallBack(CFUUIDGetTypeID(),             (__JSONPackerAppendCallBack)__JSONPackerAppendUUID);
+}
+
+inline void __JSONPackerInitializeAppendCallBacks(void) {
+  pthread_once(&__JSONPackerAppendCallBacksOnce, __JSONPackerSetDefaultAppendCallBacks);
+}
+
+// Counts of containers are written upfront, values of unknown types become nil.
+inline void __JSONPackerAppendValue(__JSONPackerRef packer, CFTypeRef value) {
+  __JSONPackerAppendCallBack callBack = NULL;
+  if (value) {
+    CFTypeID typeID = CFGetTypeID(value);
+    if (typeID < CORE_JSON_GENERATOR_CALLBACKS_SIZE)
+      callBack = __JSONPackerAppendCallBacks[typeID];
+  }
+  if (callBack)
+    callBack(packer, value);
+  else
+    __JSONPackerAppendNil(packer);
+}
+
+inline CFDataRef JSONCreateMessagePackData(CFAllocatorRef allocator, CFTypeRef value, CFErrorRef *error) {
+  CFDataRef data = NULL;
+  __JSONPacker packer = { allocator, NULL, 0, 0, 0 };
+  __JSONPackerInitializeAppendCallBacks();
+  __JSONPackerAppendValue(&packer, value);
+  if (!packer.failed) {
+    UInt8 *bytes = CFAllocatorReallocate(allocator, packer.bytes, packer.length, 0);
+    if (bytes)
+      packer.bytes = bytes;
+    if ((data = CFDataCreateWithBytesNoCopy(allocator, packer.bytes, packer.length, allocator)))
+      packer.bytes = NULL;
+  }
+  if (packer.bytes)
+    CFAllocatorDeallocate(allocator, packer.bytes);
+  if (data == NULL && error)
+    *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindOutOfMemory, 0 }, NULL, 0);
+  return data;
+}
+
+static inline UInt64 __JSONUnpackerRead(const UInt8 *bytes, CFIndex size) {
+  UInt64 value = 0;
+  for (CFIndex i = 0; i < size; i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+// Strings are not validated by the encoder, invalid UTF-8 can't be turned into CFStringRef.
+static inline bool __JSONUnpackerIsValidUTF8(const UInt8 *bytes, CFIndex length) {
+  CFIndex i = 0;
+  while (i < length) {
+    if (bytes[i] < 0x80) {
+      i++;
+      continue;
+    }
+    CFIndex n = (bytes[i] & 0xe0) == 0xc0 ? 1 : (bytes[i] & 0xf0) == 0xe0 ? 2 : (bytes[i] & 0xf8) == 0xf0 ? 3 : -1;
+    if (n < 0 || i + n >= length)
+      return 0;
+    UInt32 c = bytes[i] & (0x3f >> n);
+    for (CFIndex j = 1; j <= n; j++) {
+      if ((bytes[i + j] & 0xc0) != 0x80)
+        return 0;
+      c = (c << 6) | (bytes[i + j] & 0x3f);
+    }
+    if ((n == 1 && c < 0x80) || (n == 2 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) || (n == 3 && (c < 0x10000 || c > 0x10ffff)))
+      return 0;
+    i += n + 1;
+  }
+  return 1;
+}
+
+// Values without JSON counterpart are appended directly, after the same checks limit callbacks do.
+static inline int __JSONUnpackerAppendValue(__JSONRef json, CFTypeRef value, CFIndex length) {
+  int success = 0;
+  if (value) {
+    if (json->limits == NULL || __JSONLimitsCheckElement(json, length, 0))
+      success = __JSONStackAppendValueAtTop(json->stack, __JSONElementsAppend(json, value));
+    CFRelease(value);
+  }
+  return success;
+}
+
+// Numbers are created directly, only lazy numbers need digits.
+static inline int __JSONUnpackerAppendLongLong(__JSONRef json, long long value) {
+  if (json->lazyNumbers) {
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%lld", value);
+    return json->yajlParserCallbacks.yajl_number(json, buffer, (size_t)length);
+  }
+  return __JSONUnpackerAppendValue(json, CFNumberCreate(json->allocator, kCFNumberLongLongType, &value), 0);
+}
+
+// Doubles keep a fraction or exponent as digits, so they're not read back as integers.
+static inline int __JSONUnpackerAppendDouble(__JSONRef json, double value, int precision) {
+  if (json->lazyNumbers) {
+    char buffer[40];
+    int length = snprintf(buffer, sizeof(buffer) - 2, "%.*g", precision, value);
+    if (strpbrk(buffer, ".e") == NULL) {
+      buffer[length++] = '.';
+      buffer[length++] = '0';
+      buffer[length] = 0;
+    }
+    return json->yajlParserCallbacks.yajl_number(json, buffer, (size_t)length);
+  }
+  return __JSONUnpackerAppendValue(json, CFNumberCreate(json->allocator, kCFNumberDoubleType, &value), 0);
+}
+
+// Unsigned integers out of long long range become doubles, the same as parsed from JSON.
+static inline int __JSONUnpackerAppendUnsignedLongLong(__JSONRef json, unsigned long long value) {
+  if (value <= LLONG_MAX)
+    return __JSONUnpackerAppendLongLong(json, (long long)value);
+  if (json->lazyNumbers) {
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%llu", value);
+    return json->yajlParserCallbacks.yajl_number(json, buffer, (size_t)length);
+  }
+  double value_ = (double)value;
+  return __JSONUnpackerAppendValue(json, CFNumberCreate(json->allocator, kCFNumberDoubleType, &value_), 0);
+}
+
+static inline bool __JSONUnpackerPushContainer(__JSONRef json, __JSONUnpackerContainer **containers, CFIndex *index, CFIndex *size, CFIndex remaining, bool isMap) {
+  if (*index == *size) {
+    CFIndex largerSize = *size ? *size << 1 : CORE_JSON_STACK_INITIAL_SIZE;
+    __JSONUnpackerContainer *largerContainers = CFAllocatorReallocate(json->scratchAllocator, *containers, sizeof(__JSONUnpackerContainer) * largerSize, 0);
+    if (largerContainers == NULL)
+      return 0;
+    *containers = largerContainers;
+    *size = largerSize;
+  }
+  (*containers)[(*index)++] = (__JSONUnpackerContainer){ remaining, isMap };
+  return 1;
+}
+
+// Decodes MessagePack into parser callbacks, so objects are built the same way as from JSON. Counts
+// of containers are checked against remaining bytes before anything is allocated for them.
+inline bool __JSONParseWithMessagePackBytes(__JSONRef json, const UInt8 *bytes, CFIndex length, CFErrorRef *error) {
+  JSONParseError parseError = { kJSONErrorKindNone, 0 };
+  __JSONUnpackerContainer *containers = NULL;
+  CFIndex containersIndex = 0, containersSize = 0, offset = 0;
+  yajl_callbacks *callbacks = &json->yajlParserCallbacks;
+  
+  if (json->limits)
+    __JSONLimitsInstallCallbacks(json);
+  if (json->limits && json->limits->maximumBytes && length > json->limits->maximumBytes) {
+    parseError.kind = kJSONErrorKindBytesLimit;
+    parseError.offset = json->limits->maximumBytes;
+  } else do {
+    __JSONUnpackerContainer *top = containersIndex ? containers + containersIndex - 1 : NULL;
+    bool isKey = top && top->isMap && (top->remaining & 1) == 0;
+    CFIndex start = offset, size = 0, count = -1, stringLength = -1, binaryLength = -1, extensionLength = -1;
+    int success = 1;
+    if (top)
+      top->remaining--;
+    if (offset >= length) {
+      parseError.kind = kJSONErrorKindTruncated;
+      break;
+    }
+    
+    // Sizes of the value or length that follows the type byte
+    UInt8 type = bytes[offset++];
+    if      (type <= 0x7f || type >= 0xe0) size = 0;
+    else if (type <= 0x8f) count = (type & 0x0f) * 2;
+    else if (type <= 0x9f) count = type & 0x0f;
+    else if (type <= 0xbf) stringLength = type & 0x1f;
+    else switch (type) {
+      case 0xc4: case 0xc5: case 0xc6: size = 1 << (type - 0xc4); break;
+      case 0xc7: case 0xc8: case 0xc9: size = 1 << (type - 0xc7); break;
+      case 0xca: size = 4; break;
+      case 0xcb: size = 8; break;
+      case 0xcc: case 0xcd: case 0xce: case 0xcf: size = 1 << (type - 0xcc); break;
+      case 0xd0: case 0xd1: case 0xd2: case 0xd3: size = 1 << (type - 0xd0); break;
+      case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: extensionLength = 1 << (type - 0xd4); break;
+      case 0xd9: case 0xda: case 0xdb: size = 1 << (type - 0xd9); break;
+      case 0xdc: case 0xdd: size = 2 << (type - 0xdc); break;
+      case 0xde: case 0xdf: size = 2 << (type - 0xde); break;
+    }
+    if (offset + size > length) {
+      parseError.kind = kJSONErrorKindTruncated;
+      parseError.offset = start;
+      break;
+    }
+    UInt64 value = __JSONUnpackerRead(bytes + offset, size);
+    offset += size;
+    switch (type) {
+      case 0xc4: case 0xc5: case 0xc6: binaryLength = (CFIndex)value; break;
+      case 0xc7: case 0xc8: case 0xc9: extensionLength = (CFIndex)value; break;
+      case 0xd9: case 0xda: case 0xdb: stringLength = (CFIndex)value; break;
+      case 0xdc: case 0xdd: count = (CFIndex)value; break;
+      case 0xde: case 0xdf: count = (CFIndex)value * 2; break;
+    }
+    
+    if (isKey && stringLength < 0) {
+      parseError.kind = kJSONErrorKindSyntax;
+    } else if (stringLength >= 0 || binaryLength >= 0 || extensionLength >= 0) {
+      CFIndex dataLength = stringLength >= 0 ? stringLength : binaryLength >= 0 ? binaryLength : extensionLength + 1;
+      const UInt8 *data = bytes + offset;
+      if (dataLength > length - offset) {
+        parseError.kind = kJSONErrorKindTruncated;
+      } else if (stringLength >= 0) {
+        if (!__JSONUnpackerIsValidUTF8(data, stringLength))
+          parseError.kind = kJSONErrorKindInvalidUTF8;
+        else if (isKey)
+          success = callbacks->yajl_map_key(json, data, stringLength);
+        else
+          success = callbacks->yajl_string(json, data, stringLength);
+      } else if (binaryLength >= 0) {
+        success = __JSONUnpackerAppendValue(json, CFDataCreate(json->allocator, data, binaryLength), binaryLength);
+      } else if ((SInt8)data[0] == -1 && (extensionLength == 4 || extensionLength == 8 || extensionLength == 12)) {
+        UInt64 nanoseconds = 0;
+        SInt64 seconds = 0;
+        if (extensionLength == 4) {
+          seconds = (SInt64)__JSONUnpackerRead(data + 1, 4);
+        } else if (extensionLength == 8) {
+          UInt64 value_ = __JSONUnpackerRead(data + 1, 8);
+          nanoseconds = value_ >> 34;
+          seconds = (SInt64)(value_ & 0x3ffffffffULL);
+        } else {
+          nanoseconds = __JSONUnpackerRead(data + 1, 4);
+          seconds = (SInt64)__JSONUnpackerRead(data + 5, 8);
+        }
+        if (nanoseconds > 999999999)
+          parseError.kind = kJSONErrorKindLexical;
+        else
+          success = __JSONUnpackerAppendValue(json, CFDateCreate(json->allocator, (CFAbsoluteTime)seconds - kCFAbsoluteTimeIntervalSince1970 + nanoseconds / 1e9), 0);
+      } else {
+        parseError.kind = kJSONErrorKindLexical;
+      }
+      if (parseError.kind == kJSONErrorKindNone)
+        offset += dataLength;
+    } else if (count >= 0) {
+      if (count > length - offset) // Each element takes at least a byte
+        parseError.kind = kJSONErrorKindTruncated;
+      else if (!(type <= 0x8f || type >= 0xde ? callbacks->yajl_start_map(json) : callbacks->yajl_start_array(json)))
+        success = 0;
+      else if (!__JSONUnpackerPushContainer(json, &containers, &containersIndex, &containersSize, count, type <= 0x8f || type >= 0xde))
+        parseError.kind = kJSONErrorKindOutOfMemory;
+    } else if (type <= 0x7f) {
+      success = __JSONUnpackerAppendLongLong(json, type);
+    } else if (type >= 0xe0) {
+      success = __JSONUnpackerAppendLongLong(json, (SInt8)type);
+    } else switch (type) {
+      case 0xc0: success = callbacks->yajl_null(json); break;
+      case 0xc2: success = callbacks->yajl_boolean(json, 0); break;
+      case 0xc3: success = callbacks->yajl_boolean(json, 1); break;
+      case 0xca: case 0xcb: {
+        double value_ = 0.0;
+        if (type == 0xca) {
+          UInt32 bits = (UInt32)value;
+          float float_ = 0.0f;
+          memcpy(&float_, &bits, sizeof(float_));
+          value_ = float_;
+        } else {
+          memcpy(&value_, &value, sizeof(value_));
+        }
+        if (isfinite(value_))
+          success = __JSONUnpackerAppendDouble(json, value_, type == 0xca ? 9 : 17);
+        else
+          parseError.kind = kJSONErrorKindLexical;
+        break;
+      }
+      case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        success = __JSONUnpackerAppendUnsignedLongLong(json, value);
+        break;
+      case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+        SInt64 value_ = (SInt64)(value << (64 - size * 8)) >> (64 - size * 8); // Sign extend
+        success = __JSONUnpackerAppendLongLong(json, value_);
+        break;
+      }
+      default: // 0xc1 is never used
+        parseError.kind = kJSONErrorKindLexical;
+        break;
+    }
+    if (!success)
+      parseError.kind = kJSONErrorKindCanceled;
+    if (parseError.kind != kJSONErrorKindNone) {
+      parseError.offset = start;
+      break;
+    }
+    
+    // Close containers with all elements decoded
+    while (containersIndex && containers[containersIndex - 1].remaining == 0) {
+      if (!(containers[--containersIndex].isMap ? callbacks->yajl_end_map(json) : callbacks->yajl_end_array(json))) {
+        parseError.kind = kJSONErrorKindCanceled;
+        parseError.offset = offset;
+        break;
+      }
+    }
+  } while (containersIndex);
+  
+  if (parseError.kind == kJSONErrorKindNone && offset < length) {
+    parseError.kind = kJSONErrorKindTrailingGarbage;
+    parseError.offset = offset;
+  }
+  if (parseError.kind == kJSONErrorKindCanceled && json->limitError != kJSONErrorKindNone)
+    parseError.kind = json->limitError;
+  if (containers)
+    CFAllocatorDeallocate(json->scratchAllocator, containers);
   
-  yajl_gen_clear(yajlGen);
-  yajl_gen_free(yajlGen);
+  if (parseError.kind != kJSONErrorKindNone && error)
+    *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
   
-  return string;
+  return parseError.kind == kJSONErrorKindNone;
+}
+
+inline CFTypeRef JSONCreateWithMessagePackData(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, CFErrorRef *error) {
+  return JSONCreateWithMessagePackDataAndLimits(allocator, data, options, NULL, error);
+}
+
+static inline void __JSONSetNoCopyBytes(__JSONRef json, CFDataRef data, JSONReadOptions options) {
+  if (options & kJSONReadOptionNoCopyStrings) {
+    json->bytes = CFDataGetBytePtr(data);
+    json->bytesLength = CFDataGetLength(data);
+    json->bytesDeallocator = __JSONBytesDeallocatorCreate(json->allocator, data);
+  }
+}
+
+inline CFTypeRef JSONCreateWithMessagePackDataAndLimits(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, CFDataGetLength(data));
+  if ((json = __JSONCreateWithLimits(allocator, NULL, NULL, options, limits))) {
+    __JSONSetNoCopyBytes(json, data, options);
+    if (__JSONParseWithMessagePackBytes(json, CFDataGetBytePtr(data), CFDataGetLength(data), error))
+      result = __JSONCreateObject(json);
+    __JSONRelease(json);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, CFDataGetLength(data), result != NULL);
+  return result;
+}
+
+inline CFTypeRef JSONParserCreateObjectWithMessagePackData(JSONParserRef parser, CFDataRef data, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, CFDataGetLength(data));
+  if ((json = __JSONParserCreateJSON(parser))) {
+    __JSONSetNoCopyBytes(json, data, parser->options);
+    result = __JSONParserCreateObjectAndRelease(parser, json, __JSONParseWithMessagePackBytes(json, CFDataGetBytePtr(data), CFDataGetLength(data), error));
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, CFDataGetLength(data), result != NULL);
+  return result;
+}
+
+#pragma Snapshot
+
+// FNV-1a over 64 bit words, the tail is mixed in byte by byte.
+inline UInt64 __JSONSnapshotChecksum(const UInt8 *bytes, CFIndex length) {
+  UInt64 checksum = 0xcbf29ce484222325ULL, word = 0;
+  CFIndex i = 0;
+  for (; i + 8 <= length; i += 8) {
+    memcpy(&word, bytes + i, sizeof(word));
+    checksum = (checksum ^ word) * 0x100000001b3ULL;
+  }
+  for (; i < length; i++)
+    checksum = (checksum ^ bytes[i]) * 0x100000001b3ULL;
+  return checksum;
+}
+
+static inline CFIndex __JSONSnapshotWriterAppendEntry(__JSONSnapshotWriter *writer, JSONSnapshotType type, CFIndex length, UInt64 value) {
+  CFIndex index = writer->entries.length / (CFIndex)sizeof(__JSONSnapshotEntry);
+  if (__JSONPackerReserve(&writer->entries, sizeof(__JSONSnapshotEntry))) {
+    __JSONSnapshotEntry entry = { type, (UInt32)length, value };
+    memcpy(writer->entries.bytes + writer->entries.length, &entry, sizeof(entry));
+    writer->entries.length += sizeof(entry);
+  }
+  return index;
+}
+
+// Short strings, most of them keys, are looked up in offsets of strings already written.
+static void __JSONSnapshotWriterAppendString(__JSONSnapshotWriter *writer, CFStringRef value) {
+  CFIndex length = CFStringGetLength(value), usedLength = 0;
+  const void *offset = NULL;
+  if (length <= CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH && CFDictionaryGetValueIfPresent(writer->offsets, value, &offset)) {
+    CFIndex offset_ = (CFIndex)offset;
+    const __JSONSnapshotEntry *entry = (const __JSONSnapshotEntry *)(writer->entries.bytes + offset_ * sizeof(__JSONSnapshotEntry));
+    __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeString, entry->length, entry->value);
+    return;
+  }
+  CFIndex maximumSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+  if (__JSONPackerReserve(&writer->strings, maximumSize)) {
+    CFStringGetBytes(value, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, 0, writer->strings.bytes + writer->strings.length, maximumSize, &usedLength);
+    CFIndex index = __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeString, usedLength, writer->strings.length);
+    writer->strings.length += usedLength;
+    
+    // Offsets refer to entries, they don't move when strings grow
+    if (length <= CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH)
+      CFDictionarySetValue(writer->offsets, value, (const void *)index);
+  }
+}
+
+static void __JSONSnapshotWriterAppendValue(__JSONSnapshotWriter *writer, CFTypeRef value);
+
+static void __JSONSnapshotWriterAppendContainer(__JSONSnapshotWriter *writer, JSONSnapshotType type, const CFTypeRef *keys, const CFTypeRef *values, CFIndex n) {
+  CFIndex index = __JSONSnapshotWriterAppendEntry(writer, type, n, 0);
+  for (CFIndex i = 0; i < n && !writer->failed; i++) {
+    if (keys) {
+      if (keys[i] && CFGetTypeID(keys[i]) == CFStringGetTypeID())
+        __JSONSnapshotWriterAppendString(writer, keys[i]);
+      else
+        writer->failed = 1;
+    }
+    __JSONSnapshotWriterAppendValue(writer, values[i]);
+  }
+  
+  // Container points past its last descendant
+  if (!writer->entries.failed)
+    ((__JSONSnapshotEntry *)writer->entries.bytes)[index].value = writer->entries.length / sizeof(__JSONSnapshotEntry);
+}
+
+static void __JSONSnapshotWriterAppendValue(__JSONSnapshotWriter *writer, CFTypeRef value) {
+  CFTypeID typeID = value ? CFGetTypeID(value) : 0;
+  CFTypeRef *values = NULL;
+  CFIndex n = 0;
+  if (value == NULL || value == kCFNull) {
+    __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeNull, 0, 0);
+  } else if (typeID == CFStringGetTypeID()) {
+    __JSONSnapshotWriterAppendString(writer, value);
+  } else if (typeID == CFBooleanGetTypeID()) {
+    __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeBoolean, 0, CFBooleanGetValue(value));
+  } else if (typeID == CFNumberGetTypeID() || JSONNumberIsLazy(value)) {
+    long long integerValue = 0;
+    if (JSONNumberIsFloatType(value) || !JSONNumberGetLongLong(value, &integerValue)) {
+      double value_ = JSONNumberGetDouble(value);
+      UInt64 bits = 0;
+      memcpy(&bits, &value_, sizeof(bits));
+      __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeDouble, 0, bits);
+    } else {
+      __JSONSnapshotWriterAppendEntry(writer, kJSONSnapshotTypeInteger, 0, (UInt64)integerValue);
+    }
+  } else if (typeID == CFArrayGetTypeID()) {
+    n = CFArrayGetCount(value);
+    if ((values = CFAllocatorAllocate(writer->entries.allocator, sizeof(CFTypeRef) * (n ? n : 1), 0))) {
+      CFArrayGetValues(value, CFRangeMake(0, n), values);
+      __JSONSnapshotWriterAppendContainer(writer, kJSONSnapshotTypeArray, NULL, values, n);
+    }
+  } else if (typeID == CFDictionaryGetTypeID() || JSONObjectIsCompact(value)) {
+    n = JSONObjectGetCount(value);
+    if ((values = CFAllocatorAllocate(writer->entries.allocator, sizeof(CFTypeRef) * (n ? n : 1) * 2, 0))) {
+      JSONObjectGetKeysAndValues(value, values, values + n);
+      __JSONSnapshotWriterAppendContainer(writer, kJSONSnapshotTypeObject, values, values + n, n);
+    }
+  } else {
+    writer->failed = 1;
+  }
+  if (values)
+    CFAllocatorDeallocate(writer->entries.allocator, values);
+  else if (n)
+    writer->entries.failed = 1;
+}
+
+inline CFDataRef JSONSnapshotCreateData(CFAllocatorRef allocator, CFTypeRef object, CFErrorRef *error) {
+  CFDataRef data = NULL;
+  __JSONSnapshotWriter writer = { { allocator, NULL, 0, 0, 0 }, { allocator, NULL, 0, 0, 0 }, NULL, 0 };
+  JSONParseError parseError = { kJSONErrorKindOutOfMemory, 0 };
+  if ((writer.offsets = CFDictionaryCreateMutable(allocator, 0, &kCFTypeDictionaryKeyCallBacks, NULL))) {
+    __JSONSnapshotWriterAppendValue(&writer, object);
+    CFRelease(writer.offsets);
+  }
+  if (writer.failed) {
+    parseError.kind = kJSONErrorKindGenerator;
+  } else if (writer.offsets && !writer.entries.failed && !writer.strings.failed) {
+    CFIndex length = sizeof(__JSONSnapshotHeader) + writer.entries.length + writer.strings.length;
+    UInt8 *bytes = CFAllocatorAllocate(allocator, length, 0);
+    if (bytes) {
+      __JSONSnapshotHeader header = {
+        CORE_JSON_SNAPSHOT_MAGIC, CORE_JSON_SNAPSHOT_VERSION, 0x0102, 0,
+        writer.entries.length / sizeof(__JSONSnapshotEntry), writer.strings.length
+      };
+      if (writer.entries.length)
+        memcpy(bytes + sizeof(header), writer.entries.bytes, writer.entries.length);
+      if (writer.strings.length)
+        memcpy(bytes + sizeof(header) + writer.entries.length, writer.strings.bytes, writer.strings.length);
+      header.checksum = __JSONSnapshotChecksum(bytes + sizeof(header), length - sizeof(header));
+      memcpy(bytes, &header, sizeof(header));
+      if ((data = CFDataCreateWithBytesNoCopy(allocator, bytes, length, allocator)) == NULL)
+        CFAllocatorDeallocate(allocator, bytes);
+    }
+  }
+  if (writer.entries.bytes)
+    CFAllocatorDeallocate(allocator, writer.entries.bytes);
+  if (writer.strings.bytes)
+    CFAllocatorDeallocate(allocator, writer.strings.bytes);
+  if (data == NULL && error)
+    *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
+  return data;
+}
+
+inline bool JSONSnapshotWriteToFile(CFTypeRef object, const char *path, CFErrorRef *error) {
+  bool success = 0;
+  CFDataRef data = JSONSnapshotCreateData(NULL, object, error);
+  if (data) {
+    FILE *file = fopen(path, "wb");
+    if (file) {
+      success = fwrite(CFDataGetBytePtr(data), 1, CFDataGetLength(data), file) == (size_t)CFDataGetLength(data);
+      success = (fclose(file) == 0) && success;
+    }
+    if (!success && error)
+      *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindFile, 0 }, NULL, 0);
+    CFRelease(data);
+  }
+  return success;
+}
+
+// Header, sizes and checksum are checked once, values are bounds checked when accessed.
+inline JSONSnapshotRef JSONSnapshotCreateWithData(CFAllocatorRef allocator, CFDataRef data, CFErrorRef *error) {
+  JSONSnapshotRef snapshot = NULL;
+  JSONParseError parseError = { kJSONErrorKindSnapshot, 0 };
+  const UInt8 *bytes = CFDataGetBytePtr(data);
+  CFIndex length = CFDataGetLength(data);
+  __JSONSnapshotHeader header;
+  
+  // Entries are read in place, unaligned bytes are copied
+  if (((uintptr_t)bytes & (sizeof(UInt64) - 1)) && (data = CFDataCreate(allocator, bytes, length)))
+    bytes = CFDataGetBytePtr(data);
+  else if (data)
+    CFRetain(data);
+  if (data == NULL) {
+    parseError.kind = kJSONErrorKindOutOfMemory;
+  } else if (length >= (CFIndex)sizeof(header)) {
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic == CORE_JSON_SNAPSHOT_MAGIC && header.version == CORE_JSON_SNAPSHOT_VERSION && header.byteOrder == 0x0102 &&
+        header.entriesCount > 0 && header.entriesCount <= (UInt64)length / sizeof(__JSONSnapshotEntry) && header.stringsLength <= (UInt64)length &&
+        sizeof(header) + header.entriesCount * sizeof(__JSONSnapshotEntry) + header.stringsLength == (UInt64)length &&
+        header.checksum == __JSONSnapshotChecksum(bytes + sizeof(header), length - sizeof(header))) {
+      if ((snapshot = CFAllocatorAllocate(allocator, sizeof(__JSONSnapshot), 0))) {
+        snapshot->allocator = allocator ? CFRetain(allocator) : NULL;
+        snapshot->retainCount = 1;
+        snapshot->data = CFRetain(data);
+        snapshot->entries = (const __JSONSnapshotEntry *)(bytes + sizeof(header));
+        snapshot->entriesCount = (CFIndex)header.entriesCount;
+        snapshot->strings = bytes + sizeof(header) + header.entriesCount * sizeof(__JSONSnapshotEntry);
+        snapshot->stringsLength = (CFIndex)header.stringsLength;
+      } else {
+        parseError.kind = kJSONErrorKindOutOfMemory;
+      }
+    }
+  }
+  if (data)
+    CFRelease(data);
+  if (snapshot == NULL && error)
+    *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
+  return snapshot;
+}
+
+static void *__JSONSnapshotMappingAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  return NULL;
+}
+
+// Info is the length of the mapping.
+static void __JSONSnapshotMappingDeallocate(void *ptr, void *info) {
+  munmap(ptr, (size_t)(uintptr_t)info);
+}
+
+// Mapped pages are read only when accessed, besides the checksum pass when loading.
+inline JSONSnapshotRef JSONSnapshotCreateWithContentsOfFile(CFAllocatorRef allocator, const char *path, CFErrorRef *error) {
+  JSONSnapshotRef snapshot = NULL;
+  CFDataRef data = NULL;
+  struct stat status;
+  int file = open(path, O_RDONLY);
+  if (file >= 0 && fstat(file, &status) == 0 && status.st_size > 0) {
+    void *bytes = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (bytes != MAP_FAILED) {
+      CFAllocatorContext context = {
+        0, (void *)(uintptr_t)status.st_size, NULL, NULL, NULL,
+        __JSONSnapshotMappingAllocate, NULL, __JSONSnapshotMappingDeallocate, NULL
+      };
+      CFAllocatorRef deallocator = CFAllocatorCreate(allocator, &context);
+      if (deallocator) {
+        data = CFDataCreateWithBytesNoCopy(allocator, bytes, (CFIndex)status.st_size, deallocator);
+        CFRelease(deallocator);
+      }
+      if (data == NULL)
+        munmap(bytes, (size_t)status.st_size);
+    }
+  }
+  if (file >= 0)
+    close(file);
+  if (data) {
+    snapshot = JSONSnapshotCreateWithData(allocator, data, error);
+    CFRelease(data);
+  } else if (error) {
+    *error = __JSONErrorCreate(NULL, (JSONParseError){ kJSONErrorKindFile, 0 }, NULL, 0);
+  }
+  return snapshot;
+}
+
+inline JSONSnapshotRef JSONSnapshotRetain(JSONSnapshotRef snapshot) {
+  if (snapshot)
+    snapshot->retainCount++;
+  return snapshot;
+}
+
+inline JSONSnapshotRef JSONSnapshotRelease(JSONSnapshotRef snapshot) {
+  if (snapshot) {
+    if (--snapshot->retainCount == 0) {
+      CFAllocatorRef allocator = snapshot->allocator;
+      CFRelease(snapshot->data);
+      CFAllocatorDeallocate(allocator, snapshot);
+      if (allocator)
+        CFRelease(allocator);
+      snapshot = NULL;
+    }
+  }
+  return snapshot;
+}
+
+// Returns NULL for values out of bounds and entries pointing outside of the snapshot.
+static inline const __JSONSnapshotEntry *__JSONSnapshotGetEntry(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = NULL;
+  if (value >= 0 && value < snapshot->entriesCount) {
+    entry = snapshot->entries + value;
+    switch (entry->type) {
+      case kJSONSnapshotTypeString:
+        if (entry->value > (UInt64)snapshot->stringsLength || entry->length > snapshot->stringsLength - entry->value)
+          entry = NULL;
+        break;
+      case kJSONSnapshotTypeArray:
+      case kJSONSnapshotTypeObject:
+        if (entry->value <= (UInt64)value || entry->value > (UInt64)snapshot->entriesCount)
+          entry = NULL;
+        break;
+      case kJSONSnapshotTypeNull:
+      case kJSONSnapshotTypeBoolean:
+      case kJSONSnapshotTypeInteger:
+      case kJSONSnapshotTypeDouble:
+        break;
+      default:
+        entry = NULL;
+        break;
+    }
+  }
+  return entry;
+}
+
+inline JSONSnapshotType JSONSnapshotGetType(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  return entry ? (JSONSnapshotType)entry->type : kJSONSnapshotTypeNull;
+}
+
+inline CFIndex JSONSnapshotGetCount(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  return entry ? entry->length : 0;
+}
+
+inline CFIndex JSONSnapshotGetNext(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  if (entry == NULL)
+    return kCFNotFound;
+  return (entry->type == kJSONSnapshotTypeArray || entry->type == kJSONSnapshotTypeObject) ? (CFIndex)entry->value : value + 1;
+}
+
+inline CFIndex JSONSnapshotGetValueAtIndex(JSONSnapshotRef snapshot, CFIndex array, CFIndex index) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, array);
+  CFIndex value = kCFNotFound;
+  if (entry && entry->type == kJSONSnapshotTypeArray && index >= 0 && index < entry->length)
+    for (value = array + 1; index > 0 && value != kCFNotFound; index--)
+      value = JSONSnapshotGetNext(snapshot, value);
+  return value;
+}
+
+inline CFIndex JSONSnapshotGetValueForKey(JSONSnapshotRef snapshot, CFIndex object, CFStringRef key) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, object);
+  CFIndex result = kCFNotFound;
+  if (entry && entry->type == kJSONSnapshotTypeObject) {
+    UInt8 buffer[256];
+    CFIndex length = CFStringGetLength(key), keyLength = 0;
+    CFIndex maximumSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+    UInt8 *keyBytes = maximumSize <= (CFIndex)sizeof(buffer) ? buffer : CFAllocatorAllocate(snapshot->allocator, maximumSize, 0);
+    if (keyBytes) {
+      CFStringGetBytes(key, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, 0, keyBytes, maximumSize, &keyLength);
+      CFIndex value = object + 1;
+      for (CFIndex i = 0; i < entry->length && value != kCFNotFound; i++) {
+        CFIndex length_ = 0;
+        const UInt8 *bytes = JSONSnapshotGetStringBytes(snapshot, value, &length_);
+        value = JSONSnapshotGetNext(snapshot, value);
+        if (bytes && length_ == keyLength && memcmp(bytes, keyBytes, keyLength) == 0) {
+          result = value;
+          break;
+        }
+        value = JSONSnapshotGetNext(snapshot, value);
+      }
+      if (keyBytes != buffer)
+        CFAllocatorDeallocate(snapshot->allocator, keyBytes);
+    }
+  }
+  return result;
+}
+
+inline bool JSONSnapshotGetBoolean(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  return entry && entry->type == kJSONSnapshotTypeBoolean && entry->value;
+}
+
+inline long long JSONSnapshotGetLongLong(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  if (entry && entry->type == kJSONSnapshotTypeDouble)
+    return (long long)JSONSnapshotGetDouble(snapshot, value);
+  return (entry && entry->type == kJSONSnapshotTypeInteger) ? (long long)entry->value : 0;
+}
+
+inline double JSONSnapshotGetDouble(JSONSnapshotRef snapshot, CFIndex value) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  double value_ = 0.0;
+  if (entry && entry->type == kJSONSnapshotTypeDouble)
+    memcpy(&value_, &entry->value, sizeof(value_));
+  else if (entry && entry->type == kJSONSnapshotTypeInteger)
+    value_ = (double)(long long)entry->value;
+  return value_;
+}
+
+inline const UInt8 *JSONSnapshotGetStringBytes(JSONSnapshotRef snapshot, CFIndex value, CFIndex *length) {
+  const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, value);
+  if (entry == NULL || entry->type != kJSONSnapshotTypeString)
+    return NULL;
+  if (length)
+    *length = entry->length;
+  return snapshot->strings + entry->value;
+}
+
+// Replays entries of the value into parser callbacks, the same way MessagePack is decoded.
+inline CFTypeRef JSONSnapshotCreateObject(CFAllocatorRef allocator, JSONSnapshotRef snapshot, CFIndex value, JSONReadOptions options) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  CFIndex end = JSONSnapshotGetNext(snapshot, value);
+  if (end != kCFNotFound && (json = __JSONCreateWithLimits(allocator, NULL, NULL, options, NULL))) {
+    __JSONUnpackerContainer *containers = NULL;
+    CFIndex containersIndex = 0, containersSize = 0;
+    yajl_callbacks *callbacks = &json->yajlParserCallbacks;
+    int success = 1;
+    if (options & kJSONReadOptionNoCopyStrings) {
+      json->bytes = snapshot->strings;
+      json->bytesLength = snapshot->stringsLength;
+      json->bytesDeallocator = __JSONBytesDeallocatorCreate(json->allocator, snapshot->data);
+    }
+    for (CFIndex i = value; i < end && success; i++) {
+      const __JSONSnapshotEntry *entry = __JSONSnapshotGetEntry(snapshot, i);
+      __JSONUnpackerContainer *top = containersIndex ? containers + containersIndex - 1 : NULL;
+      bool isKey = top && top->isMap && (top->remaining & 1) == 0;
+      double value_ = 0.0;
+      if (top)
+        top->remaining--;
+      if (entry == NULL || (isKey && entry->type != kJSONSnapshotTypeString))
+        success = 0;
+      else switch (entry->type) {
+        case kJSONSnapshotTypeNull:
+          success = callbacks->yajl_null(json);
+          break;
+        case kJSONSnapshotTypeBoolean:
+          success = callbacks->yajl_boolean(json, entry->value != 0);
+          break;
+        case kJSONSnapshotTypeInteger:
+          success = __JSONUnpackerAppendLongLong(json, (long long)entry->value);
+          break;
+        case kJSONSnapshotTypeDouble:
+          memcpy(&value_, &entry->value, sizeof(value_));
+          if (isfinite(value_))
+            success = __JSONUnpackerAppendDouble(json, value_, 17);
+          else
+            success = __JSONUnpackerAppendValue(json, CFNumberCreate(json->allocator, kCFNumberDoubleType, &value_), 0);
+          break;
+        case kJSONSnapshotTypeString:
+          if (isKey)
+            success = callbacks->yajl_map_key(json, snapshot->strings + entry->value, entry->length);
+          else
+            success = callbacks->yajl_string(json, snapshot->strings + entry->value, entry->length);
+          break;
+        case kJSONSnapshotTypeArray:
+        case kJSONSnapshotTypeObject:
+          success = (entry->type == kJSONSnapshotTypeObject ? callbacks->yajl_start_map(json) : callbacks->yajl_start_array(json)) &&
+            __JSONUnpackerPushContainer(json, &containers, &containersIndex, &containersSize, entry->type == kJSONSnapshotTypeObject ? 2 * (CFIndex)entry->length : (CFIndex)entry->length, entry->type == kJSONSnapshotTypeObject);
+          break;
+      }
+      while (success && containersIndex && containers[containersIndex - 1].remaining == 0)
+        success = containers[--containersIndex].isMap ? callbacks->yajl_end_map(json) : callbacks->yajl_end_array(json);
+    }
+    if (success && containersIndex == 0)
+      result = __JSONCreateObject(json);
+    if (containers)
+      CFAllocatorDeallocate(json->scratchAllocator, containers);
+    __JSONRelease(json);
+  }
+  return result;
+}
+
+#pragma Compression
+
+// zlib memory comes from the allocator passed as opaque, the same way yajl's does.
+inline voidpf __JSONZlibAllocate(voidpf opaque, uInt items, uInt size) {
+  return CFAllocatorAllocate((CFAllocatorRef)opaque, (CFIndex)items * size, 0);
+}
+
+inline void __JSONZlibDeallocate(voidpf opaque, voidpf address) {
+  CFAllocatorDeallocate((CFAllocatorRef)opaque, address);
+}
+
+// Input comes either from bytes or from the callback, it's inflated into a fixed size chunk which
+// is parsed before the next one is inflated.
+inline bool __JSONParseWithInflate(__JSONRef json, const UInt8 *bytes, CFIndex length, JSONReadCallBack callBack, void *info, CFErrorRef *error) {
+  JSONParseError parseError = { kJSONErrorKindNone, 0 };
+  UInt8 *input = NULL, *output = NULL;
+  CFIndex offset = 0, bytesOffset = 0;
+  bool inflating = 0, inputEnded = 0, outputFull = 0, streamEnded = 0;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.zalloc = __JSONZlibAllocate;
+  stream.zfree = __JSONZlibDeallocate;
+  stream.opaque = (voidpf)json->scratchAllocator;
+  
+  if (json->limits)
+    __JSONLimitsInstallCallbacks(json);
+  if ((callBack && (input = CFAllocatorAllocate(json->scratchAllocator, CORE_JSON_INFLATE_CHUNK_SIZE, 0)) == NULL) ||
+      (output = CFAllocatorAllocate(json->scratchAllocator, CORE_JSON_INFLATE_CHUNK_SIZE, 0)) == NULL ||
+      !(inflating = inflateInit2(&stream, 15 + 32) == Z_OK) || // Detects gzip and zlib headers
+      (json->yajlParser = yajl_alloc(&json->yajlParserCallbacks, &json->yajlAllocFuncs, (void *)json)) == NULL) {
+    parseError.kind = kJSONErrorKindOutOfMemory;
+  } else {
+    while (parseError.kind == kJSONErrorKindNone) {
+      
+      // Inflate may hold more output even if all input has been consumed
+      if (stream.avail_in == 0 && !outputFull) {
+        if (callBack) {
+          CFIndex read = inputEnded ? 0 : callBack(info, input, CORE_JSON_INFLATE_CHUNK_SIZE);
+          if (read < 0) {
+            parseError.kind = kJSONErrorKindFile;
+            break;
+          }
+          stream.next_in = input;
+          stream.avail_in = (uInt)read;
+          inputEnded = read == 0;
+        } else {
+          CFIndex chunkLength = length - bytesOffset < (1 << 30) ? length - bytesOffset : (1 << 30);
+          stream.next_in = (Bytef *)bytes + bytesOffset;
+          stream.avail_in = (uInt)chunkLength;
+          bytesOffset += chunkLength;
+        }
+        if (stream.avail_in == 0)
+          break;
+      }
+      
+      // Next gzip member
+      if (streamEnded && stream.avail_in) {
+        inflateReset(&stream);
+        streamEnded = 0;
+      }
+      stream.next_out = output;
+      stream.avail_out = CORE_JSON_INFLATE_CHUNK_SIZE;
+      int status = inflate(&stream, Z_NO_FLUSH);
+      CFIndex outputLength = CORE_JSON_INFLATE_CHUNK_SIZE - stream.avail_out;
+      outputFull = stream.avail_out == 0;
+      if (status == Z_STREAM_END)
+        streamEnded = 1;
+      else if (status == Z_MEM_ERROR)
+        parseError.kind = kJSONErrorKindOutOfMemory;
+      else if (status != Z_OK && status != Z_BUF_ERROR)
+        parseError.kind = kJSONErrorKindCompression;
+      else if (status == Z_BUF_ERROR && stream.avail_in && !outputFull)
+        parseError.kind = kJSONErrorKindCompression;
+      if (outputLength && parseError.kind == kJSONErrorKindNone) {
+        if (json->limits && json->limits->maximumBytes && offset + outputLength > json->limits->maximumBytes) {
+          parseError.kind = kJSONErrorKindBytesLimit;
+          parseError.offset = json->limits->maximumBytes;
+        } else {
+          __JSONParserParse(json->yajlParser, output, outputLength, offset, &parseError);
+          offset += outputLength;
+        }
+      }
+    }
+    if (parseError.kind == kJSONErrorKindNone) {
+      if (streamEnded) {
+        __JSONParserComplete(json->yajlParser, offset, &parseError);
+      } else {
+        parseError.kind = kJSONErrorKindTruncated;
+        parseError.offset = offset;
+      }
+    }
+  }
+  if (json->yajlParser) {
+    yajl_free(json->yajlParser);
+    json->yajlParser = NULL;
+  }
+  if (inflating)
+    inflateEnd(&stream);
+  if (output)
+    CFAllocatorDeallocate(json->scratchAllocator, output);
+  if (input)
+    CFAllocatorDeallocate(json->scratchAllocator, input);
+  
+  if (parseError.kind == kJSONErrorKindCanceled && json->limitError != kJSONErrorKindNone)
+    parseError.kind = json->limitError;
+  if (parseError.kind != kJSONErrorKindNone && error)
+    *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
+  return parseError.kind == kJSONErrorKindNone;
+}
+
+inline CFTypeRef JSONCreateWithCompressedData(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, CFDataGetLength(data));
+  if ((json = __JSONCreateWithLimits(allocator, NULL, NULL, options & ~kJSONReadOptionNoCopyStrings, limits))) {
+    if (__JSONParseWithInflate(json, CFDataGetBytePtr(data), CFDataGetLength(data), NULL, NULL, error))
+      result = __JSONCreateObject(json);
+    __JSONRelease(json);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, CFDataGetLength(data), result != NULL);
+  return result;
+}
+
+inline CFTypeRef JSONCreateWithCompressedStream(CFAllocatorRef allocator, JSONReadCallBack callBack, void *info, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error) {
+  CFTypeRef result = NULL;
+  __JSONRef json = NULL;
+  __JSONTrace trace;
+  __JSONTraceBegin(&trace, kJSONTraceOperationParse, kCFNotFound);
+  if ((json = __JSONCreateWithLimits(allocator, NULL, NULL, options & ~kJSONReadOptionNoCopyStrings, limits))) {
+    if (__JSONParseWithInflate(json, NULL, 0, callBack, info, error))
+      result = __JSONCreateObject(json);
+    __JSONRelease(json);
+  }
+  __JSONTraceEnd(&trace, kJSONTraceOperationParse, kCFNotFound, result != NULL);
+  return result;
+}
+
+inline JSONDeflaterRef JSONDeflaterCreate(CFAllocatorRef allocator, int level, JSONWriterWriteCallBack callBack, void *info) {
+  JSONDeflaterRef deflater = NULL;
+  if (callBack && (deflater = CFAllocatorAllocate(allocator, sizeof(__JSONDeflater), 0))) {
+    memset(deflater, 0, sizeof(__JSONDeflater));
+    deflater->allocator = allocator ? CFRetain(allocator) : NULL;
+    deflater->retainCount = 1;
+    deflater->callBack = callBack;
+    deflater->info = info;
+    deflater->stream.zalloc = __JSONZlibAllocate;
+    deflater->stream.zfree = __JSONZlibDeallocate;
+    deflater->stream.opaque = (voidpf)deflater->allocator;
+    if (!(deflater->initialized = deflateInit2(&deflater->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)) // Gzip header
+      deflater = JSONDeflaterRelease(deflater);
+  }
+  return deflater;
+}
+
+inline JSONDeflaterRef JSONDeflaterRetain(JSONDeflaterRef deflater) {
+  if (deflater)
+    deflater->retainCount++;
+  return deflater;
+}
+
+inline JSONDeflaterRef JSONDeflaterRelease(JSONDeflaterRef deflater) {
+  if (deflater) {
+    if (--deflater->retainCount == 0) {
+      CFAllocatorRef allocator = deflater->allocator;
+      if (deflater->initialized)
+        deflateEnd(&deflater->stream);
+      if (deflater->buffer)
+        CFAllocatorDeallocate(allocator, deflater->buffer);
+      CFAllocatorDeallocate(allocator, deflater);
+      if (allocator)
+        CFRelease(allocator);
+      deflater = NULL;
+    }
+  }
+  return deflater;
+}
+
+// Writes compressed bytes downstream until they're all written or the sink stops taking them.
+static inline void __JSONDeflaterDrain(JSONDeflaterRef deflater) {
+  while (!deflater->failed && deflater->bufferIndex < deflater->bufferLength) {
+    CFIndex length = deflater->callBack(deflater->info, deflater->buffer + deflater->bufferIndex, deflater->bufferLength - deflater->bufferIndex);
+    if (length < 0)
+      deflater->failed = 1;
+    else if (length == 0)
+      break;
+    else
+      deflater->bufferIndex += length;
+  }
+  if (deflater->bufferIndex == deflater->bufferLength)
+    deflater->bufferIndex = deflater->bufferLength = 0;
+}
+
+// Deflates until input is consumed (or the stream is finished with Z_FINISH), the buffer grows to
+// keep at least a chunk of room for output.
+static inline void __JSONDeflaterDeflate(JSONDeflaterRef deflater, const UInt8 *bytes, CFIndex length, int flush) {
+  deflater->stream.next_in = (Bytef *)bytes;
+  deflater->stream.avail_in = (uInt)length;
+  int status = Z_OK;
+  do {
+    if (deflater->bufferSize - deflater->bufferLength < CORE_JSON_WRITER_FLUSH_SIZE) {
+      if (deflater->bufferIndex) {
+        memmove(deflater->buffer, deflater->buffer + deflater->bufferIndex, deflater->bufferLength - deflater->bufferIndex);
+        deflater->bufferLength -= deflater->bufferIndex;
+        deflater->bufferIndex = 0;
+      }
+      if (deflater->bufferSize - deflater->bufferLength < CORE_JSON_WRITER_FLUSH_SIZE) {
+        CFIndex largerSize = deflater->bufferSize ? deflater->bufferSize << 1 : CORE_JSON_WRITER_FLUSH_SIZE << 1;
+        UInt8 *largerBuffer = CFAllocatorReallocate(deflater->allocator, deflater->buffer, largerSize, 0);
+        if (largerBuffer == NULL) {
+          deflater->failed = 1;
+          return;
+        }
+        deflater->buffer = largerBuffer;
+        deflater->bufferSize = largerSize;
+      }
+    }
+    deflater->stream.next_out = deflater->buffer + deflater->bufferLength;
+    deflater->stream.avail_out = (uInt)(deflater->bufferSize - deflater->bufferLength);
+    status = deflate(&deflater->stream, flush);
+    deflater->bufferLength = deflater->bufferSize - deflater->stream.avail_out;
+    if (status == Z_STREAM_ERROR)
+      deflater->failed = 1;
+  } while (!deflater->failed && (deflater->stream.avail_in || (flush == Z_FINISH && status != Z_STREAM_END)));
+}
+
+inline CFIndex JSONDeflaterWrite(void *deflater_, const UInt8 *bytes, CFIndex length) {
+  JSONDeflaterRef deflater = (JSONDeflaterRef)deflater_;
+  if (deflater->finished || deflater->failed)
+    return -1;
+  __JSONDeflaterDrain(deflater);
+  if (deflater->bufferLength - deflater->bufferIndex > CORE_JSON_WRITER_MAXIMUM_SIZE)
+    return deflater->failed ? -1 : 0;
+  __JSONDeflaterDeflate(deflater, bytes, length, Z_NO_FLUSH);
+  __JSONDeflaterDrain(deflater);
+  return deflater->failed ? -1 : length;
+}
+
+inline JSONWriterStatus JSONDeflaterFinish(JSONDeflaterRef deflater) {
+  if (!deflater->finished && !deflater->failed) {
+    __JSONDeflaterDeflate(deflater, NULL, 0, Z_FINISH);
+    deflater->finished = 1;
+  }
+  __JSONDeflaterDrain(deflater);
+  if (deflater->failed)
+    return kJSONWriterStatusError;
+  else if (deflater->bufferIndex < deflater->bufferLength)
+    return kJSONWriterStatusWouldBlock;
+  else
+    return kJSONWriterStatusOK;
+}
+
+// Sink collecting output in packer's bytes.
+static CFIndex __JSONPackerWrite(void *info, const UInt8 *bytes, CFIndex length) {
+  __JSONPackerRef packer = (__JSONPackerRef)info;
+  if (!__JSONPackerReserve(packer, length))
+    return -1;
+  memcpy(packer->bytes + packer->length, bytes, length);
+  packer->length += length;
+  return length;
+}
+
+// Writer buffers up to a flush size of uncompressed output, only the compressed output is kept.
+// Values which can't be generated fail with kJSONErrorKindGenerator, compression failures with
+// kJSONErrorKindFile and allocation failures with kJSONErrorKindOutOfMemory.
+inline CFDataRef JSONCreateCompressedData(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, CFErrorRef *error) {
+  CFDataRef data = NULL;
+  JSONErrorKind kind = kJSONErrorKindOutOfMemory;
+  __JSONPacker packer = { allocator, NULL, 0, 0, 0 };
+  JSONDeflaterRef deflater = JSONDeflaterCreate(allocator, Z_DEFAULT_COMPRESSION, __JSONPackerWrite, &packer);
+  JSONWriterRef writer = deflater ? JSONWriterCreate(allocator, options & ~kJSONWriteOptionParallel, JSONDeflaterWrite, deflater) : NULL;
+  if (writer) {
+    if (JSONWriterAppendValue(writer, value) != kJSONWriterStatusError && JSONWriterFlush(writer) == kJSONWriterStatusOK && JSONDeflaterFinish(deflater) == kJSONWriterStatusOK) {
+      if ((data = CFDataCreateWithBytesNoCopy(allocator, packer.bytes, packer.length, allocator)))
+        packer.bytes = NULL;
+    } else if (packer.failed) {
+      kind = kJSONErrorKindOutOfMemory;
+    } else if (writer->failed) {
+      kind = writer->failure;
+    } else {
+      kind = kJSONErrorKindFile;
+    }
+  }
+  if (writer)
+    JSONWriterRelease(writer);
+  if (deflater)
+    JSONDeflaterRelease(deflater);
+  if (packer.bytes)
+    CFAllocatorDeallocate(allocator, packer.bytes);
+  if (data == NULL && error)
+    *error = __JSONErrorCreate(NULL, (JSONParseError){ kind, 0 }, NULL, 0);
+  return data;
+}
+
+#pragma Transcoder
+
+// Each event goes through the writer, so output is flushed to the sink as it grows. yajl can't
+// resume after a callback stops it, so backpressure (kJSONWriterStatusWouldBlock) doesn't stop
+// the chunk, it's reported by JSONTranscoderParse after the chunk instead.
+static inline int __JSONTranscoderDidAppend(void *context, yajl_gen_status status) {
+  return __JSONWriterDidAppend(((JSONTranscoderRef)context)->writer, status) != kJSONWriterStatusError;
+}
+
+static int __JSONTranscoderNull(void *context) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_null(((JSONTranscoderRef)context)->writer->generator->yajlGen));
+}
+
+static int __JSONTranscoderBoolean(void *context, int value) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_bool(((JSONTranscoderRef)context)->writer->generator->yajlGen, value));
+}
+
+static int __JSONTranscoderNumber(void *context, const char *value, size_t length) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_number(((JSONTranscoderRef)context)->writer->generator->yajlGen, value, length));
+}
+
+static int __JSONTranscoderString(void *context, const unsigned char *value, size_t length) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_string(((JSONTranscoderRef)context)->writer->generator->yajlGen, value, length));
+}
+
+static int __JSONTranscoderMapStart(void *context) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_map_open(((JSONTranscoderRef)context)->writer->generator->yajlGen));
+}
+
+static int __JSONTranscoderMapEnd(void *context) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_map_close(((JSONTranscoderRef)context)->writer->generator->yajlGen));
+}
+
+static int __JSONTranscoderArrayStart(void *context) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_array_open(((JSONTranscoderRef)context)->writer->generator->yajlGen));
+}
+
+static int __JSONTranscoderArrayEnd(void *context) {
+  return __JSONTranscoderDidAppend(context, yajl_gen_array_close(((JSONTranscoderRef)context)->writer->generator->yajlGen));
+}
+
+// Keys are generated as strings, yajl_gen keeps track of what is expected.
+static const yajl_callbacks __JSONTranscoderCallbacks = {
+  __JSONTranscoderNull,
+  __JSONTranscoderBoolean,
+  NULL,
+  NULL,
+  __JSONTranscoderNumber,
+  __JSONTranscoderString,
+  __JSONTranscoderMapStart,
+  __JSONTranscoderString,
+  __JSONTranscoderMapEnd,
+  __JSONTranscoderArrayStart,
+  __JSONTranscoderArrayEnd
+};
+
+inline JSONTranscoderRef JSONTranscoderCreate(CFAllocatorRef allocator, JSONWriteOptions options, JSONWriterWriteCallBack callBack, void *info) {
+  JSONTranscoderRef transcoder = NULL;
+  if (callBack && (transcoder = CFAllocatorAllocate(allocator, sizeof(__JSONTranscoder), 0))) {
+    transcoder->allocator = allocator ? CFRetain(allocator) : NULL;
+    transcoder->retainCount = 1;
+    transcoder->offset = 0;
+    transcoder->yajlParser = NULL;
+    transcoder->yajlAllocFuncs.ctx     = (void *)transcoder->allocator;
+    transcoder->yajlAllocFuncs.malloc  = __JSONAllocatorAllocate;
+    transcoder->yajlAllocFuncs.realloc = __JSONAllocatorReallocate;
+    transcoder->yajlAllocFuncs.free    = __JSONAllocatorDeallocate;
+    if (NULL == (transcoder->writer = JSONWriterCreate(transcoder->allocator, options & ~kJSONWriteOptionParallel, callBack, info)) ||
+        NULL == (transcoder->yajlParser = yajl_alloc(&__JSONTranscoderCallbacks, &transcoder->yajlAllocFuncs, (void *)transcoder)))
+      transcoder = JSONTranscoderRelease(transcoder);
+  }
+  return transcoder;
+}
+
+inline JSONTranscoderRef JSONTranscoderRetain(JSONTranscoderRef transcoder) {
+  if (transcoder)
+    transcoder->retainCount++;
+  return transcoder;
+}
+
+// Releasing the transcoder doesn't flush buffered output, complete it first.
+inline JSONTranscoderRef JSONTranscoderRelease(JSONTranscoderRef transcoder) {
+  if (transcoder) {
+    if (--transcoder->retainCount == 0) {
+      CFAllocatorRef allocator = transcoder->allocator;
+      if (transcoder->yajlParser)
+        yajl_free(transcoder->yajlParser);
+      if (transcoder->writer)
+        JSONWriterRelease(transcoder->writer);
+      CFAllocatorDeallocate(allocator, transcoder);
+      if (allocator)
+        CFRelease(allocator);
+      transcoder = NULL;
+    }
+  }
+  return transcoder;
+}
+
+// Failed callbacks mean the writer failed (with its own cause) or yajl_gen rejected the event.
+static inline bool __JSONTranscoderDidParse(JSONTranscoderRef transcoder, JSONParseError *error) {
+  if (error->kind == kJSONErrorKindCanceled)
+    error->kind = transcoder->writer->failed ? transcoder->writer->failure : kJSONErrorKindGenerator;
+  if (error->kind == kJSONErrorKindNone && JSONWriterFlush(transcoder->writer) == kJSONWriterStatusError)
+    error->kind = transcoder->writer->failure;
+  return error->kind == kJSONErrorKindNone;
+}
+
+inline bool __JSONTranscoderParse(JSONTranscoderRef transcoder, const UInt8 *bytes, CFIndex length, JSONParseError *error) {
+  *error = (JSONParseError){ kJSONErrorKindNone, 0 };
+  __JSONParserParse(transcoder->yajlParser, bytes, length, transcoder->offset, error);
+  transcoder->offset += length;
+  return __JSONTranscoderDidParse(transcoder, error);
+}
+
+inline bool __JSONTranscoderComplete(JSONTranscoderRef transcoder, JSONParseError *error) {
+  *error = (JSONParseError){ kJSONErrorKindNone, 0 };
+  __JSONParserComplete(transcoder->yajlParser, transcoder->offset, error);
+  return __JSONTranscoderDidParse(transcoder, error);
+}
+
+// Chunk is always consumed unless it fails, kJSONWriterStatusWouldBlock asks to flush before the
+// next one, the same way as the writer does.
+inline JSONWriterStatus JSONTranscoderParse(JSONTranscoderRef transcoder, const UInt8 *bytes, CFIndex length, CFErrorRef *error) {
+  JSONParseError parseError;
+  if (!__JSONTranscoderParse(transcoder, bytes, length, &parseError)) {
+    if (error)
+      *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
+    return kJSONWriterStatusError;
+  }
+  return JSONWriterGetBufferedLength(transcoder->writer) > transcoder->writer->maximumSize ? kJSONWriterStatusWouldBlock : kJSONWriterStatusOK;
+}
+
+// Returns kJSONWriterStatusOK only when all output has been written.
+inline JSONWriterStatus JSONTranscoderComplete(JSONTranscoderRef transcoder, CFErrorRef *error) {
+  JSONParseError parseError;
+  if (!__JSONTranscoderComplete(transcoder, &parseError)) {
+    if (error)
+      *error = __JSONErrorCreate(NULL, parseError, NULL, 0);
+    return kJSONWriterStatusError;
+  }
+  return JSONWriterGetBufferedLength(transcoder->writer) ? kJSONWriterStatusWouldBlock : kJSONWriterStatusOK;
+}
+
+inline JSONWriterStatus JSONTranscoderFlush(JSONTranscoderRef transcoder) {
+  return JSONWriterFlush(transcoder->writer);
+}
+
+inline void JSONTranscoderSetBufferSizes(JSONTranscoderRef transcoder, CFIndex flushSize, CFIndex maximumSize) {
+  JSONWriterSetBufferSizes(transcoder->writer, flushSize, maximumSize);
+}
+
+// Whole input is at hand, so errors have line and column.
+inline CFDataRef JSONCreateTranscodedData(CFAllocatorRef allocator, CFDataRef data, JSONWriteOptions options, CFErrorRef *error) {
+  CFDataRef result = NULL;
+  __JSONPacker packer = { allocator, NULL, 0, 0, 0 };
+  JSONParseError parseError = { kJSONErrorKindOutOfMemory, 0 };
+  JSONTranscoderRef transcoder = JSONTranscoderCreate(allocator, options, __JSONPackerWrite, &packer);
+  if (transcoder) {
+    if (__JSONTranscoderParse(transcoder, CFDataGetBytePtr(data), CFDataGetLength(data), &parseError) && __JSONTranscoderComplete(transcoder, &parseError)) {
+      if ((result = CFDataCreateWithBytesNoCopy(allocator, packer.bytes, packer.length, allocator)))
+        packer.bytes = NULL;
+      else
+        parseError.kind = kJSONErrorKindOutOfMemory;
+    }
+    JSONTranscoderRelease(transcoder);
+  }
+  if (packer.bytes)
+    CFAllocatorDeallocate(allocator, packer.bytes);
+  if (result == NULL && error)
+    *error = __JSONErrorCreate(NULL, parseError, parseError.kind == kJSONErrorKindOutOfMemory ? NULL : CFDataGetBytePtr(data), CFDataGetLength(data));
+  return result;
 }
@@ -21,11 +21,48 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+
+// Parser and generator statistics are compiled in only with CORE_JSON_STATISTICS=1
+#ifndef CORE_JSON_STATISTICS
+#define CORE_JSON_STATISTICS 0
+#endif
+
+// Static USDT probes (corejson:parse_begin, parse_end, generate_begin, generate_end) are
+// compiled in only with CORE_JSON_USDT=1 on Linux, requires <sys/sdt.h> (systemtap-sdt-dev).
+#ifndef CORE_JSON_USDT
+#define CORE_JSON_USDT 0
+#endif
 
 #define CORE_JSON_STACK_INITIAL_SIZE              YAJL_MAX_DEPTH
 #define CORE_JSON_STACK_ENTRY_KEYS_INITIAL_SIZE   1024
 #define CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE 1024
 #define CORE_JSON_ELEMENTS_INITIAL_SIZE           4096
+#define CORE_JSON_MINIMUM_SIZE                    8
+#define CORE_JSON_ARENA_CHUNK_SIZE                65536
+#define CORE_JSON_ARENA_RETAINED_SIZE             1048576
+#define CORE_JSON_ARENA_SIZE_CLASSES              64
+#define CORE_JSON_REGION_CHUNK_INITIAL_SIZE       16384
+#define CORE_JSON_REGION_CHUNK_MAXIMUM_SIZE       16777216
+#define CORE_JSON_DEFERRED_RELEASE_QUEUE_SIZE     1024
+#define CORE_JSON_DEFERRED_RELEASE_THRESHOLD      4096
+#define CORE_JSON_STRING_TABLE_SIZE               1024
+#define CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH     40
+#define CORE_JSON_CONTAINER_TABLE_SIZE            4096
+#define CORE_JSON_COMPACT_OBJECT_MAXIMUM_SIZE     8
+#define CORE_JSON_GENERATOR_CALLBACKS_SIZE        1024
+#define CORE_JSON_GENERATOR_PARALLEL_MINIMUM_SIZE 4096
+#define CORE_JSON_GENERATOR_PARALLEL_MAXIMUM_SIZE 64
+#define CORE_JSON_TRACE_SIZE_CLASSES              5
+#define CORE_JSON_VALIDATOR_MEMORY_SIZE           4096
+#define CORE_JSON_VALIDATOR_CHUNK_SIZE            4096
+#define CORE_JSON_PACKER_INITIAL_SIZE             4096
+#define CORE_JSON_SNAPSHOT_MAGIC                  0x534e534a // "JSNS"
+#define CORE_JSON_SNAPSHOT_VERSION                1
+#define CORE_JSON_INFLATE_CHUNK_SIZE              65536
+#define CORE_JSON_TRACE_HISTOGRAM_BUCKETS         320
 
 #pragma Helper stack for parsing
 
@@ -77,6 +114,20 @@ __JSONStackEntryRef __JSONStackPop              (__JSONStackRef stack);
 bool                __JSONStackAppendValueAtTop (__JSONStackRef stack, CFIndex value);
 bool                __JSONStackAppendKeyAtTop   (__JSONStackRef stack, CFIndex key);
 
+#pragma Internal number decoding
+
+// Number decoded from JSON digits. Integers which don't fit long long are decoded as doubles,
+// like numbers with fraction or exponent, and marked with overflow.
+typedef struct {
+  bool      isFloat;
+  bool      overflow;
+  long long integerValue; // Truncated (and saturated) double value for floats
+  double    doubleValue;
+} __JSONNumberValue;
+
+bool              __JSONNumberHasFloatDigits (const char *digits, size_t length);
+__JSONNumberValue __JSONNumberDecode         (const char *digits, size_t length);
+
 #pragma Internal callbacks for libyajl parser
 
 int __JSONParserAppendStringWithBytes    (void *context, const unsigned char *value, size_t length);
@@ -97,8 +148,280 @@ void *__JSONAllocatorAllocate   (void *ctx, size_t sz);
 void  __JSONAllocatorDeallocate (void *ctx, void *ptr);
 void *__JSONAllocatorReallocate (void *ctx, void *ptr, size_t sz);
 
+#pragma Scratch arena allocator
+
+// Parse scoped scratch memory (yajl buffers, stack, stack entries, temporary key and value
+// arrays) is allocated from an arena CFAllocator. Blocks are bump allocated from chunks
+// with power of two sizes, deallocated blocks go to a free list of their size class and are
+// reused. Reset drops all blocks at once without touching them.
+typedef struct __JSONArenaChunk {
+  struct __JSONArenaChunk *next;
+  CFIndex                  size;
+} __JSONArenaChunk;
+
+typedef __JSONArenaChunk *__JSONArenaChunkRef;
+
+typedef struct {
+  CFAllocatorRef      allocator; // Backing allocator for chunks
+  __JSONArenaChunkRef first;
+  __JSONArenaChunkRef current;
+  CFIndex             offset;    // Offset of the next free byte in the current chunk
+  void               *freeLists[CORE_JSON_ARENA_SIZE_CLASSES];
+  CFIndex             allocationsCount; // Updated only with CORE_JSON_STATISTICS
+  CFIndex             allocatedSize;
+} __JSONArena;
+
+typedef __JSONArena *__JSONArenaRef;
+
+CFAllocatorRef __JSONArenaAllocatorCreate (CFAllocatorRef allocator);
+void           __JSONArenaAllocatorReset  (CFAllocatorRef arenaAllocator);
+
+#pragma Region allocator
+
+// Document lifetime memory for parsed CF objects. Blocks are bump allocated one after another
+// in parse order, deallocation does nothing - the whole region is freed at once. The region
+// CFAllocator object lives in the region as well, so nothing is left behind when it's freed.
+typedef struct {
+  CFAllocatorRef      allocator; // Backing allocator for chunks
+  __JSONArenaChunkRef first;
+  __JSONArenaChunkRef current;
+  CFIndex             offset;
+  void               *last;      // Last allocated block, can be reallocated in place
+  CFIndex             size;      // Total size of chunks
+} __JSONRegion;
+
+typedef __JSONRegion *__JSONRegionRef;
+
+__JSONRegionRef __JSONRegionCreate          (CFAllocatorRef allocator);
+void            __JSONRegionDestroy         (__JSONRegionRef region);
+CFAllocatorRef  __JSONRegionAllocatorCreate (__JSONRegionRef region);
+
+#pragma Shape statistics
+
+// Shape of parsed documents used to presize containers on the next parse with the same parser.
+// Sizes are tracked for arrays and maps separately by depth, learned sizes grow straight to
+// the largest container seen in the last parse and shrink by half of the difference, so
+// a stream of same-shaped documents settles on no reallocations.
+typedef struct {
+  CFIndex elementsSize;
+  CFIndex arraySizes[CORE_JSON_STACK_INITIAL_SIZE];
+  CFIndex mapSizes[CORE_JSON_STACK_INITIAL_SIZE];
+  CFIndex observedArraySizes[CORE_JSON_STACK_INITIAL_SIZE];
+  CFIndex observedMapSizes[CORE_JSON_STACK_INITIAL_SIZE];
+} __JSONShape;
+
+typedef __JSONShape *__JSONShapeRef;
+
+void    __JSONShapeInitialize (__JSONShapeRef shape);
+CFIndex __JSONShapeGetSize    (CFIndex *sizes, CFIndex depth, CFIndex defaultSize);
+void    __JSONShapeObserve    (CFIndex *observedSizes, CFIndex depth, CFIndex size);
+void    __JSONShapeLearn      (__JSONShapeRef shape, CFIndex elementsCount);
+
+#pragma Statistics
+
+// Cumulative parse statistics, see JSONParserSetStatisticsEnabled. Lexing time is the time spent
+// in yajl outside of parser callbacks, construction time is spent creating scalar values and
+// appending them, containers time creating arrays and dictionaries. Scratch allocations are
+// counted for parse scoped memory only, created objects use the parser allocator.
+typedef struct {
+  CFIndex        nullsCount;
+  CFIndex        booleansCount;
+  CFIndex        numbersCount;
+  CFIndex        stringsCount;
+  CFIndex        keysCount;
+  CFIndex        arraysCount;
+  CFIndex        dictionariesCount;
+  CFIndex        bytesCount;
+  CFIndex        maximumDepth;
+  CFIndex        elementsRegrowsCount;
+  CFIndex        stackRegrowsCount;
+  CFIndex        scratchAllocationsCount;
+  CFIndex        scratchAllocatedSize;
+  CFTimeInterval lexingTime;
+  CFTimeInterval constructionTime;
+  CFTimeInterval containersTime;
+} JSONParserStatistics;
+
+// Cumulative generate statistics, see JSONWriterSetStatisticsEnabled. Keys are counted as strings.
+typedef struct {
+  CFIndex nullsCount;
+  CFIndex booleansCount;
+  CFIndex numbersCount;
+  CFIndex stringsCount;
+  CFIndex arraysCount;
+  CFIndex dictionariesCount;
+  CFIndex otherCount;
+  CFIndex bytesCount;
+  CFIndex depth;
+  CFIndex maximumDepth;
+} JSONGeneratorStatistics;
+
+#pragma String table
+
+// Per parse table of short strings for kJSONReadOptionUniqueStrings. Byte identical keys and
+// string values share the same immutable CFStringRef. The table is open addressed with linear
+// probing, strings are not retained (elements keep them alive for the whole parse) and once
+// it's 3/4 full new strings are not added anymore, but lookups still work.
+typedef struct {
+  CFHashCode  hash;
+  CFIndex     length;
+  CFStringRef string;
+  UInt8       bytes[CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH];
+} __JSONStringTableSlot;
+
+typedef struct {
+  CFIndex               count;
+  CFIndex               savedCount; // Number of strings returned from the table instead of created
+  CFIndex               savedSize;  // UTF-8 length of these strings
+  __JSONStringTableSlot slots[CORE_JSON_STRING_TABLE_SIZE];
+} __JSONStringTable;
+
+typedef __JSONStringTable *__JSONStringTableRef;
+
+CFStringRef __JSONStringTableCreateString (CFAllocatorRef allocator, __JSONStringTableRef table, const unsigned char *value, size_t length);
+
+#pragma Container table
+
+// Per parse table of arrays and dictionaries for kJSONReadOptionUniqueContainers. Containers
+// are created bottom up, so identical subtrees already share children and equal containers
+// can be compared shallowly - child containers by pointer, other values with CFEqual. Like
+// the string table it does not retain containers and stops growing when 3/4 full.
+typedef struct {
+  CFHashCode hash;
+  CFTypeRef  value;
+} __JSONContainerTableSlot;
+
+typedef struct {
+  CFIndex                  count;
+  CFIndex                  savedCount;       // Number of containers reused instead of created
+  CFIndex                  savedValuesCount; // Number of values in these containers
+  CFTypeID                 arrayTypeID;
+  CFTypeID                 dictionaryTypeID;
+  __JSONContainerTableSlot slots[CORE_JSON_CONTAINER_TABLE_SIZE];
+} __JSONContainerTable;
+
+typedef __JSONContainerTable *__JSONContainerTableRef;
+
+CFArrayRef      __JSONContainerTableCreateArray      (CFAllocatorRef allocator, __JSONContainerTableRef table, CFTypeRef *values, CFIndex count);
+CFDictionaryRef __JSONContainerTableCreateDictionary (CFAllocatorRef allocator, __JSONContainerTableRef table, CFTypeRef *keys, CFTypeRef *values, CFIndex count);
+
+#pragma Compact objects
+
+// Small objects parsed with kJSONReadOptionCompactObjects are stored as immutable CFDataRef with
+// no copy bytes - a header followed by keys and values in parse order. The header points back to
+// the bytes, so ordinary data can't be mistaken for compact object. Bytes deallocator releases
+// keys and values when data is released. Use JSONObject* functions to access them.
+typedef struct {
+  UInt32         magic;
+  const void    *bytes;     // Points to itself
+  CFAllocatorRef allocator; // Allocator of bytes
+  CFIndex        count;
+  CFTypeRef      entries[]; // count keys followed by count values
+} __JSONCompactObject;
+
+typedef const __JSONCompactObject *__JSONCompactObjectRef;
+
+CFDataRef              __JSONCompactObjectCreate (CFAllocatorRef allocator, CFTypeRef *keys, CFTypeRef *values, CFIndex count);
+__JSONCompactObjectRef __JSONCompactObjectGet    (CFTypeRef value);
+
+#pragma Converters
+
+// Converts raw UTF-8 bytes of a string value to another CF type, ie. CFDate. Returns NULL if bytes
+// can't be converted, CFStringRef is created then.
+typedef CFTypeRef (*JSONParserConvertCallBack)(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info);
+
+typedef struct {
+  JSONParserConvertCallBack callBack;
+  void                     *info;
+} __JSONConverter;
+
+typedef const __JSONConverter *__JSONConverterRef;
+
+#pragma Lazy numbers
+
+// Numbers parsed with kJSONReadOptionLazyNumbers are kept as digits in immutable CFDataRef with
+// inline bytes, so each number is a single allocation. They're identified by the tag, address
+// of a private static, and decoded on access with JSONNumber* functions and generated back with
+// the original digits. Bytes have no padding, numbers with the same digits are CFEqual.
+typedef struct {
+  const void *tag;
+  CFIndex     length;
+  UInt8       isFloat;  // Digits contain fraction or exponent, or integer doesn't fit long long
+  char        digits[]; // NULL terminated
+} __JSONLazyNumber;
+
+typedef const __JSONLazyNumber *__JSONLazyNumberRef;
+
+CFDataRef           __JSONLazyNumberCreate (CFAllocatorRef allocator, const char *digits, size_t length);
+__JSONLazyNumberRef __JSONLazyNumberGet    (CFTypeRef value);
+
+#pragma Errors
+
+#define kJSONErrorDomain    CFSTR("com.github.mirek.CoreJSON")
+#define kJSONErrorOffsetKey CFSTR("JSONErrorOffset") // CFNumberRef, byte offset in UTF-8 input
+#define kJSONErrorLineKey   CFSTR("JSONErrorLine")   // CFNumberRef, 1 based
+#define kJSONErrorColumnKey CFSTR("JSONErrorColumn") // CFNumberRef, 1 based, in characters
+
+// Error kinds, used as CFError codes in kJSONErrorDomain as well.
+typedef enum {
+  kJSONErrorKindNone            = 0,
+  kJSONErrorKindSyntax          = 1, // Unexpected token
+  kJSONErrorKindLexical         = 2, // Invalid character, escape or number
+  kJSONErrorKindInvalidUTF8     = 3,
+  kJSONErrorKindTruncated       = 4, // Premature end of input
+  kJSONErrorKindTrailingGarbage = 5, // Input continues after a complete value
+  kJSONErrorKindCanceled        = 6, // Parser callback failed
+  kJSONErrorKindOutOfMemory     = 7,
+  kJSONErrorKindBytesLimit         = 8, // Budgets of JSONParseLimits exceeded
+  kJSONErrorKindElementsLimit      = 9,
+  kJSONErrorKindDepthLimit         = 10,
+  kJSONErrorKindStringLengthLimit  = 11,
+  kJSONErrorKindContainerSizeLimit = 12,
+  kJSONErrorKindAllocatedSizeLimit = 13,
+  kJSONErrorKindFile               = 14, // File or stream can't be opened, mapped, read or written
+  kJSONErrorKindSnapshot           = 15, // Snapshot is corrupted or of other version
+  kJSONErrorKindCompression        = 16, // Compressed input is corrupted
+  kJSONErrorKindGenerator          = 17  // Value can't be generated (unsupported type, NaN or infinity)
+} JSONErrorKind;
+
+typedef struct {
+  JSONErrorKind kind;
+  CFIndex       offset; // Byte offset in UTF-8 input where the error was detected
+} JSONParseError;
+
+JSONErrorKind __JSONParserGetErrorKind (yajl_handle parser, yajl_status status);
+yajl_status   __JSONParserParse        (yajl_handle parser, const UInt8 *bytes, CFIndex length, CFIndex offset, JSONParseError *error);
+yajl_status   __JSONParserComplete     (yajl_handle parser, CFIndex offset, JSONParseError *error);
+CFErrorRef    __JSONErrorCreate        (CFAllocatorRef allocator, JSONParseError error, const UInt8 *bytes, CFIndex length);
+
+#pragma Limits
+
+// Per parse budgets for untrusted input, 0 means unlimited. Parsing is aborted from the first
+// callback exceeding a budget with kJSONErrorKind*Limit error.
 typedef struct {
-  CFAllocatorRef     allocator;
+  CFIndex maximumBytes;         // Length of UTF-8 input
+  CFIndex maximumElements;      // Values and keys
+  CFIndex maximumDepth;
+  CFIndex maximumStringLength;  // Bytes of a single string or key
+  CFIndex maximumContainerSize; // Elements of a single array or object
+  CFIndex maximumAllocatedSize; // Bytes requested from the allocator while parsing
+} JSONParseLimits;
+
+// Allocator counting requested bytes for maximumAllocatedSize. It never fails allocations on its
+// own, CF doesn't handle failed allocations everywhere, the budget is checked by callbacks.
+// Returned objects keep it as their allocator, so allocatedSize is updated atomically.
+typedef struct {
+  CFAllocatorRef allocator;
+  CFIndex        allocatedSize;
+} __JSONBudget;
+
+typedef __JSONBudget *__JSONBudgetRef;
+
+CFAllocatorRef __JSONBudgetAllocatorCreate (CFAllocatorRef allocator, __JSONBudgetRef *budget);
+
+typedef struct {
+  CFAllocatorRef     allocator;        // Used for created CF objects
+  CFAllocatorRef     scratchAllocator; // Arena allocator for parse scoped memory
   CFIndex            retainCount;
 
   yajl_handle        yajlParser;
@@ -112,6 +435,22 @@ typedef struct {
   CFTypeRef         *elements;
 
   __JSONStackRef     stack;
+  __JSONShapeRef     shape;            // Optional, presizes containers and records their sizes
+  __JSONStringTableRef strings;        // Only with kJSONReadOptionUniqueStrings
+  __JSONContainerTableRef containers;  // Only with kJSONReadOptionUniqueContainers
+  
+  const UInt8       *bytes;            // Pinned input for kJSONReadOptionNoCopyStrings
+  CFIndex            bytesLength;
+  CFAllocatorRef     bytesDeallocator; // Keeps pinned input alive while strings reference it
+  bool               compactObjects;   // kJSONReadOptionCompactObjects
+  bool               lazyNumbers;      // kJSONReadOptionLazyNumbers
+  CFDictionaryRef    converters;       // Key to __JSONConverterRef, optional
+  __JSONConverterRef converter;        // Converter for the value of the last key
+  JSONParserStatistics *statistics;    // Optional, used only with CORE_JSON_STATISTICS
+  const JSONParseLimits *limits;       // Optional, checked by callbacks wrapping the default ones
+  yajl_callbacks     limitedCallbacks; // Callbacks wrapped by limit checks
+  __JSONBudgetRef    budget;           // Only with maximumAllocatedSize
+  JSONErrorKind      limitError;       // Budget which aborted parsing
   
 } __JSON;
 
@@ -120,15 +459,21 @@ typedef __JSON *__JSONRef;
 typedef enum JSONReadOptions {
   kJSONReadOptionCheckUTF8                  = 1,
   kJSONReadOptionAllowComments              = 2,
+  kJSONReadOptionUniqueStrings              = 4, // Share CFStringRef for repeated short strings
+  kJSONReadOptionUniqueContainers           = 8, // Share CFArrayRef and CFDictionaryRef for identical subtrees
+  kJSONReadOptionNoCopyStrings              = 16, // Strings without escapes reference input data, JSONCreateWithData only
+  kJSONReadOptionCompactObjects             = 32, // Objects with up to 8 keys are compact, see JSONObjectGetValue
+  kJSONReadOptionLazyNumbers                = 64, // Numbers are decoded on access, see JSONNumberGetDouble
   
   kJSONReadOptionsDefault                   = 0,
   kJSONReadOptionsCheckUTF8AndAllowComments = 3
 } JSONReadOptions;
 
 typedef enum JSONWriteOptions {
-  kJSONWriteOptionIndent = 1,
+  kJSONWriteOptionIndent   = 1,
+  kJSONWriteOptionParallel = 2,
   
-  kJSONWriteOptionsDefault = 0
+  kJSONWriteOptionsDefault   = 0
 } JSONWriteOptions;
 
 #pragma Internal elements array support
@@ -137,6 +482,13 @@ CFIndex __JSONElementsAppend                 (__JSONRef json, CFTypeRef value);
 
 #pragma Generator
 
+// Callback appending CF value of a single CFTypeID to the generator. Callbacks are kept in a
+// table indexed by CFTypeID, so dispatching a value is a single lookup. Custom callbacks for
+// other CF types can be set with JSONGeneratorSetAppendCallBack.
+typedef void (*JSONGeneratorAppendCallBack)(CFAllocatorRef allocator, yajl_gen *g, CFTypeRef value);
+
+void __JSONGeneratorInitializeAppendCallBacks (void);
+
 void __JSONGeneratorAppendString             (CFAllocatorRef allocator, yajl_gen *g, CFStringRef value);
 void __JSONGeneratorAppendDoubleTypeNumber   (CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value);
 void __JSONGeneratorAppendLongLongTypeNumber (CFAllocatorRef allocator, yajl_gen *g, CFNumberRef value);
@@ -149,16 +501,656 @@ void __JSONGeneratorAppendBoolean            (CFAllocatorRef allocator, yajl_gen
 void __JSONGeneratorAppendNull               (CFAllocatorRef allocator, yajl_gen *g, CFNullRef value);
 void __JSONGeneratorAppendURL                (CFAllocatorRef allocator, yajl_gen *g, CFURLRef value);
 void __JSONGeneratorAppendUUID               (CFAllocatorRef allocator, yajl_gen *g, CFUUIDRef value);
+void __JSONGeneratorAppendData               (CFAllocatorRef allocator, yajl_gen *g, CFDataRef value);
+void __JSONGeneratorAppendDate               (CFAllocatorRef allocator, yajl_gen *g, CFDateRef value);
+void __JSONGeneratorAppendSet                (CFAllocatorRef allocator, yajl_gen *g, CFSetRef value);
+void __JSONGeneratorAppendCompactObject      (CFAllocatorRef allocator, yajl_gen *g, CFDataRef value);
+void __JSONGeneratorAppendLazyNumber         (CFAllocatorRef allocator, yajl_gen *g, CFDataRef value);
 
-__JSONRef   __JSONCreate           (CFAllocatorRef allocator, JSONReadOptions options);
-bool        __JSONParseWithString  (__JSONRef    json, CFStringRef string, CFErrorRef *error);
-CFTypeRef   __JSONCreateObject     (__JSONRef    json);
-__JSONRef   __JSONRelease          (__JSONRef    json);
+#pragma Generator cache
+
+// Cache of already generated JSON fragments for immutable containers. Values are registered
+// explicitly with JSONGeneratorCacheAddValue - CF doesn't tell if a container is mutable, it's
+// up to the caller to register only values which won't change. The cache retains registered
+// values, so the identity can't be reused by another object. Fragments are generated lazily on
+// first use and evicted in least recently used order when their total size exceeds maximumSize.
+typedef struct __JSONGeneratorCacheEntry {
+  CFTypeRef                         value;
+  unsigned char                    *bytes;
+  CFIndex                           length;
+  bool                              generating; // Fragment is being generated, other threads wait for it
+  struct __JSONGeneratorCacheEntry *previous;
+  struct __JSONGeneratorCacheEntry *next;
+} __JSONGeneratorCacheEntry;
+
+typedef __JSONGeneratorCacheEntry *__JSONGeneratorCacheEntryRef;
+
+typedef struct {
+  CFAllocatorRef               allocator;
+  CFIndex                      retainCount;
+  pthread_mutex_t              mutex;
+  pthread_cond_t               generated; // Signaled when a fragment generation finishes
+  
+  CFMutableDictionaryRef       entries; // Registered value (by identity) -> __JSONGeneratorCacheEntryRef
+  __JSONGeneratorCacheEntryRef head;    // Most recently used entry with generated fragment
+  __JSONGeneratorCacheEntryRef tail;    // Least recently used entry with generated fragment
+  
+  CFIndex                      size;
+  CFIndex                      maximumSize;
+  CFIndex                      hitsCount;
+  CFIndex                      missesCount;
+} __JSONGeneratorCache;
+
+typedef __JSONGeneratorCache *JSONGeneratorCacheRef;
+
+// Generator context. Append callbacks receive pointer to yajlGen member, which has to be the
+// first one, so they can get back to the generator with __JSONGeneratorGetWithYAJLGen.
+typedef struct {
+  yajl_gen              yajlGen;
+  CFAllocatorRef        allocator;
+  CFIndex               retainCount;
+  JSONWriteOptions      options;
+  yajl_alloc_funcs      yajlAllocFuncs;
+  JSONGeneratorCacheRef cache;
+  JSONGeneratorStatistics *statistics; // Optional, used only with CORE_JSON_STATISTICS
+  yajl_gen_status       status;  // First failed yajl_gen call
+  bool                  skipped; // Value with unsupported type or failed conversion was skipped
+} __JSONGenerator;
+
+typedef __JSONGenerator *__JSONGeneratorRef;
+
+__JSONGeneratorRef __JSONGeneratorCreate             (CFAllocatorRef allocator, JSONWriteOptions options, JSONGeneratorCacheRef cache);
+__JSONGeneratorRef __JSONGeneratorRelease            (__JSONGeneratorRef generator);
+__JSONGeneratorRef __JSONGeneratorGetWithYAJLGen     (yajl_gen *g);
+void               __JSONGeneratorDidAppend          (yajl_gen *g, yajl_gen_status status);
+CFStringRef        __JSONGeneratorCreateString       (__JSONGeneratorRef generator, CFErrorRef *error);
+bool               __JSONGeneratorAppendCachedValue  (__JSONGeneratorRef generator, CFTypeRef value, JSONGeneratorAppendCallBack callBack);
+
+#pragma Parallel generator
+
+// Chunk of a large array or dictionary generated on a separate thread with its own generator.
+// Arrays have NULL keys.
+typedef struct {
+  __JSONGeneratorRef generator;
+  pthread_t          thread;
+  bool               threadCreated;
+  const CFTypeRef   *keys;
+  const CFTypeRef   *values;
+  CFIndex            count;
+} __JSONGeneratorChunk;
+
+typedef __JSONGeneratorChunk *__JSONGeneratorChunkRef;
+
+void *__JSONGeneratorAppendChunk            (void *chunk);
+bool  __JSONGeneratorAppendValuesInParallel (__JSONGeneratorRef generator, const CFTypeRef *keys, const CFTypeRef *values, CFIndex n);
+
+#pragma Newline delimited generator
+
+// Returns next value to generate (not retained) or NULL when there are no more values.
+typedef CFTypeRef (*JSONNewlineDelimitedNextValueCallBack)(void *info);
+
+__JSONGeneratorRef __JSONNewlineDelimitedGeneratorCreate        (CFAllocatorRef allocator, JSONWriteOptions options);
+bool               __JSONGeneratorAppendNewlineDelimitedValue (__JSONGeneratorRef generator, CFMutableDataRef data, CFTypeRef value);
+
+#pragma Writer
+
+#define CORE_JSON_WRITER_FLUSH_SIZE   16384
+#define CORE_JSON_WRITER_MAXIMUM_SIZE 1048576
+
+// Sink callback, should consume bytes and return number of bytes consumed. Returning less than
+// length (including 0) means the sink can't take more at the moment, the rest stays buffered.
+// Negative value means error.
+typedef CFIndex (*JSONWriterWriteCallBack)(void *info, const UInt8 *bytes, CFIndex length);
+
+typedef enum JSONWriterStatus {
+  kJSONWriterStatusOK         = 0, // Event written, buffered output is below maximum size
+  kJSONWriterStatusWouldBlock = 1, // Event written, but buffered output exceeds maximum size, flush before writing more
+  kJSONWriterStatusError      = 2  // Event rejected (ie. value instead of a key), unsupported value type or allocation/sink failure
+} JSONWriterStatus;
+
+// Event level writer generating JSON straight to the sink. Output is buffered, the buffer is
+// flushed as soon as it grows above flushSize (also in the middle of a value appended with
+// JSONWriterAppendValue) or explicitly with JSONWriterFlush.
+typedef struct {
+  CFAllocatorRef          allocator;
+  CFIndex                 retainCount;
+  __JSONGeneratorRef      generator;
+  
+  JSONWriterWriteCallBack callBack;
+  void                   *info;
+  
+  unsigned char          *buffer;
+  CFIndex                 bufferIndex;  // Start of not yet flushed bytes
+  CFIndex                 bufferLength; // End of not yet flushed bytes
+  CFIndex                 bufferSize;
+  CFIndex                 flushSize;
+  CFIndex                 maximumSize;
+  
+  bool                    failed;
+  JSONErrorKind           failure; // Cause of the first failure: OutOfMemory, File (sink) or Generator
+  
+  JSONGeneratorStatistics statistics;
+} __JSONWriter;
+
+typedef __JSONWriter *JSONWriterRef;
+
+void             __JSONWriterFail        (JSONWriterRef writer, JSONErrorKind kind);
+void             __JSONWriterPrint       (void *context, const char *bytes, size_t length);
+JSONWriterStatus __JSONWriterDidAppend   (JSONWriterRef writer, yajl_gen_status status);
+
+__JSONRef   __JSONCreate                     (CFAllocatorRef allocator, JSONReadOptions options);
+__JSONRef   __JSONCreateWithContext          (CFAllocatorRef allocator, CFAllocatorRef scratchAllocator, __JSONShapeRef shape, JSONReadOptions options);
+__JSONRef   __JSONCreateWithLimits           (CFAllocatorRef allocator, CFAllocatorRef scratchAllocator, __JSONShapeRef shape, JSONReadOptions options, const JSONParseLimits *limits);
+bool        __JSONParseWithString            (__JSONRef      json, CFStringRef string, CFErrorRef *error);
+bool        __JSONParseWithBytes             (__JSONRef      json, const UInt8 *bytes, CFIndex length, CFErrorRef *error);
+bool        __JSONParseWithMessagePackBytes  (__JSONRef      json, const UInt8 *bytes, CFIndex length, CFErrorRef *error);
+CFStringRef __JSONCreateStringWithBytes      (__JSONRef      json, const unsigned char *value, size_t length);
+CFAllocatorRef __JSONBytesDeallocatorCreate  (CFAllocatorRef allocator, CFDataRef data);
+CFTypeRef   __JSONCreateObject               (__JSONRef      json);
+__JSONRef   __JSONRelease                    (__JSONRef      json);
+
+#pragma Parser
+
+// Reusable parser context. Scratch memory arena is kept between parses and containers are
+// presized with the shape of previously parsed documents. Not thread safe, use one per thread.
+typedef struct {
+  CFAllocatorRef  allocator;
+  CFIndex         retainCount;
+  JSONReadOptions options;
+  CFAllocatorRef  scratchAllocator;
+  __JSONShape     shape;
+  CFIndex         savedStringsCount;
+  CFIndex         savedStringsSize;
+  CFIndex         savedContainersCount;
+  CFIndex         savedContainerValuesCount;
+  CFMutableDictionaryRef converters;
+  JSONParserStatistics statistics;
+  bool            statisticsEnabled;
+  JSONParseLimits limits;
+  bool            limitsEnabled;
+} __JSONParser;
+
+typedef __JSONParser *JSONParserRef;
+
+#pragma Document
+
+// Parsed object graph with all CF objects allocated from a single region. Objects are valid as
+// long as the document is alive, releasing the document frees all of them at once without
+// releasing objects one by one. Don't keep references to the objects after that.
+typedef struct {
+  CFAllocatorRef  allocator;
+  CFIndex         retainCount;
+  __JSONRegionRef region;
+  CFTypeRef       object;
+} __JSONDocument;
+
+typedef __JSONDocument *JSONDocumentRef;
+
+#pragma Deferred release
+
+bool  __JSONDeferredReleaseShouldDefer (CFTypeRef value);
+void *__JSONDeferredReleaseThread      (void *context);
+
+#pragma Validation
+
+// Memory for yajl when validating, blocks are bump allocated from words on the stack (each
+// block prefixed with its size) and only the last one can grow or be freed. Allocations which
+// don't fit (very deep nesting, very long tokens split between chunks) go to the default allocator.
+typedef struct {
+  CFIndex index; // Next free word
+  CFIndex last;  // Size word of the last block, -1 if there's none
+  CFIndex words[CORE_JSON_VALIDATOR_MEMORY_SIZE / sizeof(CFIndex)];
+} __JSONValidatorMemory;
+
+void *__JSONValidatorAllocate   (void *ctx, size_t sz);
+void  __JSONValidatorDeallocate (void *ctx, void *ptr);
+void *__JSONValidatorReallocate (void *ctx, void *ptr, size_t sz);
+bool  __JSONValidateWithBytes   (const UInt8 *bytes, CFIndex length, const yajl_callbacks *callbacks, void *context, JSONParseError *error);
+bool  __JSONValidateWithString  (CFStringRef string, const yajl_callbacks *callbacks, void *context, JSONParseError *error);
+
+#pragma Events
+
+// Event callbacks, returning false stops parsing with kJSONErrorKindCanceled. Bytes are UTF-8
+// (strings and keys unescaped) and valid only during the call, they're not NUL terminated.
+// Depth is 0 for the root value, 1 for its elements and so on. Numbers with fraction or exponent
+// and integers out of long long range are floats, integerValue is truncated and saturated then.
+typedef bool (*JSONEventCallBack)        (void *info, CFIndex depth);
+typedef bool (*JSONEventBooleanCallBack) (void *info, bool value, CFIndex depth);
+typedef bool (*JSONEventBytesCallBack)   (void *info, const UInt8 *bytes, CFIndex length, CFIndex depth);
+typedef bool (*JSONEventNumberCallBack)  (void *info, const UInt8 *bytes, CFIndex length, bool isFloat, long long integerValue, double doubleValue, CFIndex depth);
+
+// NULL callbacks skip their events.
+typedef struct {
+  JSONEventCallBack        startObject;
+  JSONEventCallBack        endObject;
+  JSONEventCallBack        startArray;
+  JSONEventCallBack        endArray;
+  JSONEventBytesCallBack   key;
+  JSONEventBytesCallBack   string;
+  JSONEventNumberCallBack  number;
+  JSONEventBooleanCallBack boolean;
+  JSONEventCallBack        null;
+} JSONEventCallBacks;
+
+typedef struct {
+  const JSONEventCallBacks *callBacks;
+  void                     *info;
+  CFIndex                   depth;
+} __JSONEvents;
+
+typedef __JSONEvents *__JSONEventsRef;
+
+#pragma MessagePack
+
+// MessagePack encoder, bytes grow in powers of two and are handed over to the created CFDataRef.
+typedef struct {
+  CFAllocatorRef allocator;
+  UInt8         *bytes;
+  CFIndex        length;
+  CFIndex        size;
+  bool           failed;    // Allocation failed, output is incomplete
+} __JSONPacker;
+
+typedef __JSONPacker *__JSONPackerRef;
+
+// Callbacks are kept in a table indexed by CFTypeID, the same way generator callbacks are.
+typedef void (*__JSONPackerAppendCallBack)(__JSONPackerRef packer, CFTypeRef value);
+
+void __JSONPackerInitializeAppendCallBacks (void);
+void __JSONPackerAppendValue               (__JSONPackerRef packer, CFTypeRef value);
+
+// Containers being decoded, remaining elements count keys and values of maps separately.
+typedef struct {
+  CFIndex remaining;
+  bool    isMap;
+} __JSONUnpackerContainer;
+
+#pragma Snapshot
+
+// Snapshot is a header followed by entries of a tape and a string table, all offsets are relative,
+// so it can be mapped at any address. Values are indices of their entries, the root is 0. Entries
+// of array elements and object keys and values follow their container, the container points past
+// its last descendant. Numbers are stored in native byte order, snapshots are not portable between
+// architectures with other byte order.
+typedef enum {
+  kJSONSnapshotTypeNull    = 0,
+  kJSONSnapshotTypeBoolean = 1,
+  kJSONSnapshotTypeInteger = 2,
+  kJSONSnapshotTypeDouble  = 3,
+  kJSONSnapshotTypeString  = 4,
+  kJSONSnapshotTypeArray   = 5,
+  kJSONSnapshotTypeObject  = 6
+} JSONSnapshotType;
+
+typedef struct {
+  UInt32 magic;
+  UInt16 version;
+  UInt16 byteOrder;     // 0x0102 in byte order of the writer
+  UInt64 checksum;      // Of entries and strings
+  UInt64 entriesCount;
+  UInt64 stringsLength;
+} __JSONSnapshotHeader;
+
+typedef struct {
+  UInt32 type;
+  UInt32 length;        // Elements of arrays, pairs of objects, bytes of strings
+  UInt64 value;         // Integer, double, boolean, string offset or index past container
+} __JSONSnapshotEntry;
+
+// Loaded or mapped snapshot, data keeps the bytes alive (and unmaps them).
+typedef struct {
+  CFAllocatorRef             allocator;
+  CFIndex                    retainCount;
+  CFDataRef                  data;
+  const __JSONSnapshotEntry *entries;
+  CFIndex                    entriesCount;
+  const UInt8               *strings;
+  CFIndex                    stringsLength;
+} __JSONSnapshot;
+
+typedef __JSONSnapshot *JSONSnapshotRef;
+
+// Writer state, strings up to CORE_JSON_STRING_TABLE_MAXIMUM_LENGTH are stored once.
+typedef struct {
+  __JSONPacker           entries;
+  __JSONPacker           strings;
+  CFMutableDictionaryRef offsets;
+  bool                   failed;    // Non-string key or value of other than JSON type
+} __JSONSnapshotWriter;
+
+UInt64 __JSONSnapshotChecksum (const UInt8 *bytes, CFIndex length);
+
+#pragma Compression
+
+// Source of compressed input, should fill bytes and return number of bytes read, 0 at the end of
+// input, negative value on error.
+typedef CFIndex (*JSONReadCallBack)(void *info, UInt8 *bytes, CFIndex length);
+
+// Compressing sink in front of another sink, compressed output is buffered until the downstream
+// sink takes it. Writes are refused (0 bytes consumed) while more than
+// CORE_JSON_WRITER_MAXIMUM_SIZE bytes are waiting.
+typedef struct {
+  CFAllocatorRef          allocator;
+  CFIndex                 retainCount;
+  z_stream                stream;
+  bool                    initialized;
+  
+  JSONWriterWriteCallBack callBack;
+  void                   *info;
+  
+  UInt8                  *buffer;
+  CFIndex                 bufferIndex;  // Start of not yet written bytes
+  CFIndex                 bufferLength; // End of not yet written bytes
+  CFIndex                 bufferSize;
+  
+  bool                    finished;
+  bool                    failed;
+} __JSONDeflater;
+
+typedef __JSONDeflater *JSONDeflaterRef;
+
+voidpf __JSONZlibAllocate   (voidpf opaque, uInt items, uInt size);
+void   __JSONZlibDeallocate (voidpf opaque, voidpf address);
+bool   __JSONParseWithInflate (__JSONRef json, const UInt8 *bytes, CFIndex length, JSONReadCallBack callBack, void *info, CFErrorRef *error);
+
+#pragma Transcoder
+
+// Parser events generated straight to a writer, no CF objects are created. Offset counts bytes
+// parsed in previous chunks.
+typedef struct {
+  CFAllocatorRef   allocator;
+  CFIndex          retainCount;
+  JSONWriterRef    writer;
+  yajl_handle      yajlParser;
+  yajl_alloc_funcs yajlAllocFuncs;
+  CFIndex          offset;
+} __JSONTranscoder;
+
+typedef __JSONTranscoder *JSONTranscoderRef;
+
+bool __JSONTranscoderParse    (JSONTranscoderRef transcoder, const UInt8 *bytes, CFIndex length, JSONParseError *error);
+bool __JSONTranscoderComplete (JSONTranscoderRef transcoder, JSONParseError *error);
+
+#pragma Tracing
+
+typedef enum {
+  kJSONTraceOperationParse    = 0,
+  kJSONTraceOperationGenerate = 1
+} JSONTraceOperation;
+
+// Document size classes of latency histograms.
+typedef enum {
+  kJSONTraceSizeClassTiny   = 0, // Less than 1KB
+  kJSONTraceSizeClassSmall  = 1, // Less than 16KB
+  kJSONTraceSizeClassMedium = 2, // Less than 256KB
+  kJSONTraceSizeClassLarge  = 3, // Less than 4MB
+  kJSONTraceSizeClassHuge   = 4
+} JSONTraceSizeClass;
+
+// Called before parsing or generating with input size in UTF-8 bytes (kCFNotFound for generating
+// and streams). Returned context is passed to the end callback with output size in UTF-8 bytes
+// for generating, outcome and duration of the call.
+typedef void *(*JSONTraceBeginCallBack) (JSONTraceOperation operation, CFIndex size, void *info);
+typedef void  (*JSONTraceEndCallBack)   (JSONTraceOperation operation, CFIndex size, bool success, CFTimeInterval time, void *context, void *info);
+
+// Latency counts of a single thread, owned by the thread until it exits and then reused by
+// another one. Only the owner writes counts, so recording doesn't need locks or atomic adds.
+typedef struct __JSONTraceHistogram {
+  struct __JSONTraceHistogram *next;
+  int                          inUse;
+  uint64_t                     counts[2][CORE_JSON_TRACE_SIZE_CLASSES][CORE_JSON_TRACE_HISTOGRAM_BUCKETS];
+} __JSONTraceHistogram;
+
+typedef __JSONTraceHistogram *__JSONTraceHistogramRef;
+
+// Traced call in progress, lives on the stack of the traced function.
+typedef struct {
+  uint64_t time;
+  void    *context;
+} __JSONTrace;
+
+void __JSONTraceBegin (__JSONTrace *trace, JSONTraceOperation operation, CFIndex size);
+void __JSONTraceEnd   (__JSONTrace *trace, JSONTraceOperation operation, CFIndex size, bool success);
 
 #pragma Public API
 
 CFTypeRef JSONCreateWithString(CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, CFErrorRef *error);
-//CFTypeRef     JSONCreateWithData       (CFAllocatorRef allocator, CFDataRef data);
 
+// Parses UTF-8 data. With kJSONReadOptionNoCopyStrings strings without escapes are created with
+// CFStringCreateWithBytesNoCopy pointing into data, which is retained until the last of them is
+// released. Data must not be mutated afterwards.
+CFTypeRef JSONCreateWithData(CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, CFErrorRef *error);
+
+// MessagePack encoding of the same object graphs. Values of types without JSON representation are
+// encoded as nil, except data (binary) and dates (timestamp extension). Decoding builds objects
+// the same way as parsing JSON, with the same options and optional limits. Map keys have to be
+// strings. Use JSONParserCreateObjectWithMessagePackData for converters.
+CFDataRef JSONCreateMessagePackData              (CFAllocatorRef allocator, CFTypeRef value, CFErrorRef *error);
+CFTypeRef JSONCreateWithMessagePackData          (CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, CFErrorRef *error);
+CFTypeRef JSONCreateWithMessagePackDataAndLimits (CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error);
+
+// Same as above with budgets for untrusted input, limits are optional.
+CFTypeRef JSONCreateWithStringAndLimits (CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error);
+CFTypeRef JSONCreateWithDataAndLimits   (CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error);
+
+// Checks whether input is well formed JSON without creating any objects. yajl runs without
+// callbacks and with memory on the stack, so validation doesn't allocate. Strings are converted
+// to UTF-8 in chunks. Error is optional.
+bool JSONValidateWithBytes  (const UInt8 *bytes, CFIndex length, JSONParseError *error);
+bool JSONValidateWithString (CFStringRef string, JSONParseError *error);
+
+// Parsing to event callbacks without creating objects. Nothing is allocated unless nesting or
+// tokens outgrow the validator's stack memory, as with validation.
+bool JSONParseEventsWithBytes  (const UInt8 *bytes, CFIndex length, const JSONEventCallBacks *callBacks, void *info, JSONParseError *error);
+bool JSONParseEventsWithString (CFStringRef string, const JSONEventCallBacks *callBacks, void *info, JSONParseError *error);
+
+// Line and column of the error, computed from the same UTF-8 bytes when they're needed.
+void        JSONParseErrorGetLineAndColumn (JSONParseError error, const UInt8 *bytes, CFIndex length, CFIndex *line, CFIndex *column);
+CFStringRef JSONParseErrorGetDescription   (JSONParseError error);
+
+// Returns NULL with kJSONErrorKindGenerator if the value or any of its children can't be
+// generated (no append callback for its type, NaN or infinity).
 CFStringRef JSONCreateString(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, CFErrorRef *error);
 //CFDataRef     JSONCreateData           (CFAllocatorRef allocator, CFTypeRef value);
+
+// Accessors for parsed objects, work with both CFDictionaryRef and compact objects created
+// with kJSONReadOptionCompactObjects. Keys and values of compact objects are in parse order.
+bool            JSONObjectIsCompact          (CFTypeRef object);
+CFIndex         JSONObjectGetCount           (CFTypeRef object);
+CFTypeRef       JSONObjectGetValue           (CFTypeRef object, CFTypeRef key);
+void            JSONObjectGetKeysAndValues   (CFTypeRef object, CFTypeRef *keys, CFTypeRef *values);
+CFDictionaryRef JSONObjectCreateDictionary   (CFAllocatorRef allocator, CFTypeRef object);
+
+// Accessors for parsed numbers, work with both CFNumberRef and lazy numbers created with
+// kJSONReadOptionLazyNumbers. Lazy numbers are decoded on every access. JSONNumberGetLongLong
+// returns false if the conversion is lossy (out of range or with fraction) like CFNumberGetValue,
+// value is saturated or truncated then.
+bool        JSONNumberIsLazy      (CFTypeRef number);
+bool        JSONNumberIsFloatType (CFTypeRef number);
+bool        JSONNumberGetLongLong (CFTypeRef number, long long *value);
+double      JSONNumberGetDouble   (CFTypeRef number);
+CFNumberRef JSONNumberCreateNumber (CFAllocatorRef allocator, CFTypeRef number);
+
+// Set append callback for values of typeID, NULL removes it (values of this type are skipped).
+// Built-in callbacks can be overriden as well. Returns false if typeID is out of the table range.
+// Safe to call while other threads generate, values already being appended keep the old callback.
+bool                        JSONGeneratorSetAppendCallBack (CFTypeID typeID, JSONGeneratorAppendCallBack callBack);
+JSONGeneratorAppendCallBack JSONGeneratorGetAppendCallBack (CFTypeID typeID);
+
+// Generates values as newline delimited JSON (one document per line) into a single data buffer,
+// reusing one generator for all values. Values which can't be generated are skipped, error is
+// set for the first of them with kJSONErrorKindGenerator and its index in JSONErrorOffset.
+// Data with the other values is still returned.
+CFDataRef JSONCreateNewlineDelimitedData             (CFAllocatorRef allocator, CFArrayRef values, JSONWriteOptions options, CFErrorRef *error);
+CFDataRef JSONCreateNewlineDelimitedDataWithCallBack (CFAllocatorRef allocator, JSONNewlineDelimitedNextValueCallBack callBack, void *info, JSONWriteOptions options, CFErrorRef *error);
+
+// Number of threads used with kJSONWriteOptionParallel, 0 (default) uses number of online CPUs.
+void    JSONGeneratorSetParallelThreadsCount (CFIndex threadsCount);
+CFIndex JSONGeneratorGetParallelThreadsCount (void);
+
+// Same as JSONCreateString, registered immutable arrays and dictionaries are spliced from the cache.
+CFStringRef JSONCreateStringWithCache(CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, JSONGeneratorCacheRef cache, CFErrorRef *error);
+
+JSONGeneratorCacheRef JSONGeneratorCacheCreate          (CFAllocatorRef allocator, CFIndex maximumSize);
+JSONGeneratorCacheRef JSONGeneratorCacheRetain          (JSONGeneratorCacheRef cache);
+JSONGeneratorCacheRef JSONGeneratorCacheRelease         (JSONGeneratorCacheRef cache);
+bool                  JSONGeneratorCacheAddValue        (JSONGeneratorCacheRef cache, CFTypeRef value);
+void                  JSONGeneratorCacheRemoveValue     (JSONGeneratorCacheRef cache, CFTypeRef value);
+void                  JSONGeneratorCacheRemoveAllValues (JSONGeneratorCacheRef cache);
+CFIndex               JSONGeneratorCacheGetSize         (JSONGeneratorCacheRef cache);
+CFIndex               JSONGeneratorCacheGetHitsCount    (JSONGeneratorCacheRef cache);
+CFIndex               JSONGeneratorCacheGetMissesCount  (JSONGeneratorCacheRef cache);
+
+JSONWriterRef    JSONWriterCreate                 (CFAllocatorRef allocator, JSONWriteOptions options, JSONWriterWriteCallBack callBack, void *info);
+JSONWriterRef    JSONWriterRetain                 (JSONWriterRef writer);
+JSONWriterRef    JSONWriterRelease                (JSONWriterRef writer);
+void             JSONWriterSetBufferSizes         (JSONWriterRef writer, CFIndex flushSize, CFIndex maximumSize);
+CFIndex          JSONWriterGetBufferedLength      (JSONWriterRef writer);
+
+// Returns false if statistics are not compiled in (CORE_JSON_STATISTICS).
+bool                    JSONWriterSetStatisticsEnabled (JSONWriterRef writer, bool enabled);
+JSONGeneratorStatistics JSONWriterGetStatistics        (JSONWriterRef writer);
+void                    JSONWriterResetStatistics      (JSONWriterRef writer);
+JSONWriterStatus JSONWriterFlush                  (JSONWriterRef writer);
+JSONWriterStatus JSONWriterBeginObject            (JSONWriterRef writer);
+JSONWriterStatus JSONWriterEndObject              (JSONWriterRef writer);
+JSONWriterStatus JSONWriterBeginArray             (JSONWriterRef writer);
+JSONWriterStatus JSONWriterEndArray               (JSONWriterRef writer);
+JSONWriterStatus JSONWriterAppendKey              (JSONWriterRef writer, CFStringRef key);
+JSONWriterStatus JSONWriterAppendKeyWithBytes     (JSONWriterRef writer, const UInt8 *bytes, CFIndex length);
+JSONWriterStatus JSONWriterAppendString           (JSONWriterRef writer, CFStringRef value);
+JSONWriterStatus JSONWriterAppendStringWithBytes  (JSONWriterRef writer, const UInt8 *bytes, CFIndex length);
+JSONWriterStatus JSONWriterAppendLongLong         (JSONWriterRef writer, long long value);
+JSONWriterStatus JSONWriterAppendDouble           (JSONWriterRef writer, double value);
+JSONWriterStatus JSONWriterAppendBoolean          (JSONWriterRef writer, bool value);
+JSONWriterStatus JSONWriterAppendNull             (JSONWriterRef writer);
+JSONWriterStatus JSONWriterAppendValue            (JSONWriterRef writer, CFTypeRef value);
+
+JSONDocumentRef JSONDocumentCreateWithString (CFAllocatorRef allocator, CFStringRef string, JSONReadOptions options, CFErrorRef *error);
+JSONDocumentRef JSONDocumentRetain           (JSONDocumentRef document);
+JSONDocumentRef JSONDocumentRelease          (JSONDocumentRef document);
+CFTypeRef       JSONDocumentGetObject        (JSONDocumentRef document);
+CFIndex         JSONDocumentGetSize          (JSONDocumentRef document);
+
+// Snapshots of parsed objects for fast loading. Values of a snapshot are accessed in place without
+// creating objects, JSONSnapshotCreateObject creates objects of a value and its descendants with
+// the same read options as parsing. Loading rejects snapshots with other version or checksum
+// mismatch with kJSONErrorKindSnapshot, creating fails with kJSONErrorKindGenerator for non-string
+// keys and values of other than JSON types.
+CFDataRef        JSONSnapshotCreateData               (CFAllocatorRef allocator, CFTypeRef object, CFErrorRef *error);
+bool             JSONSnapshotWriteToFile              (CFTypeRef object, const char *path, CFErrorRef *error);
+JSONSnapshotRef  JSONSnapshotCreateWithData           (CFAllocatorRef allocator, CFDataRef data, CFErrorRef *error);
+JSONSnapshotRef  JSONSnapshotCreateWithContentsOfFile (CFAllocatorRef allocator, const char *path, CFErrorRef *error); // Maps the file
+JSONSnapshotRef  JSONSnapshotRetain                   (JSONSnapshotRef snapshot);
+JSONSnapshotRef  JSONSnapshotRelease                  (JSONSnapshotRef snapshot);
+JSONSnapshotType JSONSnapshotGetType                  (JSONSnapshotRef snapshot, CFIndex value);
+CFIndex          JSONSnapshotGetCount                 (JSONSnapshotRef snapshot, CFIndex value); // Elements, pairs or bytes
+CFIndex          JSONSnapshotGetNext                  (JSONSnapshotRef snapshot, CFIndex value); // Following sibling (first child is value + 1)
+CFIndex          JSONSnapshotGetValueAtIndex          (JSONSnapshotRef snapshot, CFIndex array, CFIndex index); // kCFNotFound if out of bounds
+CFIndex          JSONSnapshotGetValueForKey           (JSONSnapshotRef snapshot, CFIndex object, CFStringRef key); // kCFNotFound if missing
+bool             JSONSnapshotGetBoolean               (JSONSnapshotRef snapshot, CFIndex value);
+long long        JSONSnapshotGetLongLong              (JSONSnapshotRef snapshot, CFIndex value);
+double           JSONSnapshotGetDouble                (JSONSnapshotRef snapshot, CFIndex value);
+const UInt8     *JSONSnapshotGetStringBytes           (JSONSnapshotRef snapshot, CFIndex value, CFIndex *length); // UTF-8, not terminated
+CFTypeRef        JSONSnapshotCreateObject             (CFAllocatorRef allocator, JSONSnapshotRef snapshot, CFIndex value, JSONReadOptions options);
+
+// Parsing gzip or zlib compressed input, decompressed chunk by chunk straight into the parser, so
+// the whole decompressed document never exists in memory. Concatenated gzip members are parsed
+// as one document. Limits apply to decompressed input, maximumBytes guards against compression
+// bombs. Errors have offsets in decompressed input.
+CFTypeRef JSONCreateWithCompressedData   (CFAllocatorRef allocator, CFDataRef data, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error);
+CFTypeRef JSONCreateWithCompressedStream (CFAllocatorRef allocator, JSONReadCallBack callBack, void *info, JSONReadOptions options, const JSONParseLimits *limits, CFErrorRef *error);
+
+// Gzip compressing sink for JSONWriterCreate, pass JSONDeflaterWrite as the callback and the
+// deflater as info. Level is 0 - 9 or Z_DEFAULT_COMPRESSION. JSONDeflaterFinish writes the gzip
+// trailer after the last event, call it again while it returns kJSONWriterStatusWouldBlock.
+JSONDeflaterRef  JSONDeflaterCreate  (CFAllocatorRef allocator, int level, JSONWriterWriteCallBack callBack, void *info);
+JSONDeflaterRef  JSONDeflaterRetain  (JSONDeflaterRef deflater);
+JSONDeflaterRef  JSONDeflaterRelease (JSONDeflaterRef deflater);
+CFIndex          JSONDeflaterWrite   (void *deflater, const UInt8 *bytes, CFIndex length);
+JSONWriterStatus JSONDeflaterFinish  (JSONDeflaterRef deflater);
+
+// Generates gzip compressed JSON without keeping all of the uncompressed output in memory. Values
+// which can't be generated fail with kJSONErrorKindGenerator.
+CFDataRef JSONCreateCompressedData (CFAllocatorRef allocator, CFTypeRef value, JSONWriteOptions options, CFErrorRef *error);
+
+// Transcoding parses JSON and generates it again with write options (minified by default, indented
+// with kJSONWriteOptionIndent) without creating objects. Input is parsed in chunks as it arrives,
+// output goes to the sink as with JSONWriterCreate, buffered output is flushed after each chunk.
+// Parse returns kJSONWriterStatusWouldBlock when the sink doesn't keep up and buffered output
+// exceeds maximum size, flush until kJSONWriterStatusOK before passing the next chunk. Complete
+// returns it while some output is still buffered. Errors have the writer's failure cause
+// (kJSONErrorKindFile for the sink). Strings are validated and escaped again, numbers are passed
+// through as they are.
+JSONTranscoderRef JSONTranscoderCreate         (CFAllocatorRef allocator, JSONWriteOptions options, JSONWriterWriteCallBack callBack, void *info);
+JSONTranscoderRef JSONTranscoderRetain         (JSONTranscoderRef transcoder);
+JSONTranscoderRef JSONTranscoderRelease        (JSONTranscoderRef transcoder);
+void              JSONTranscoderSetBufferSizes (JSONTranscoderRef transcoder, CFIndex flushSize, CFIndex maximumSize);
+JSONWriterStatus  JSONTranscoderParse          (JSONTranscoderRef transcoder, const UInt8 *bytes, CFIndex length, CFErrorRef *error);
+JSONWriterStatus  JSONTranscoderComplete       (JSONTranscoderRef transcoder, CFErrorRef *error); // After the last chunk
+JSONWriterStatus  JSONTranscoderFlush          (JSONTranscoderRef transcoder);
+CFDataRef         JSONCreateTranscodedData     (CFAllocatorRef allocator, CFDataRef data, JSONWriteOptions options, CFErrorRef *error);
+
+// Releases value on a background thread if it's the last reference to an array or dictionary
+// with at least threshold elements (counting nested containers not shared with other owners),
+// otherwise releases it straight away. Values are released
+// inline as well when maximumQueueLength values are already waiting, so the reclamation thread
+// can't fall behind without bounds.
+void    JSONReleaseDeferred                      (CFTypeRef value);
+void    JSONSetDeferredReleaseThreshold          (CFIndex threshold);
+void    JSONSetDeferredReleaseMaximumQueueLength (CFIndex maximumQueueLength);
+CFIndex JSONGetDeferredReleaseQueueLength        (void); // Values waiting or being released
+CFIndex JSONGetDeferredReleaseQueueHighWaterMark (void);
+CFIndex JSONGetDeferredReleaseInlineCount        (void); // Values released inline because the queue was full
+
+// Trace callbacks for JSONCreateWithString, JSONCreateWithData, JSONParserCreateObjectWithString,
+// JSONCreateString and JSONCreateStringWithCache. When begin is NULL, end is called only for calls
+// taking at least minimumTime, otherwise for every call. Set them before tracing calls on other
+// threads, NULL callbacks disable tracing.
+void JSONTraceSetCallBacks (JSONTraceBeginCallBack begin, JSONTraceEndCallBack end, CFTimeInterval minimumTime, void *info);
+
+// Log-linear latency histograms (8 sub-buckets per power of two, precise to 12.5%) per operation
+// and size class, recorded per thread. Percentile is 0 - 100, returns 0 if nothing was recorded.
+// Reset while calls are in progress may leave counts of these calls behind.
+void               JSONTraceSetHistogramsEnabled (bool enabled);
+JSONTraceSizeClass JSONTraceGetSizeClass         (CFIndex size);
+uint64_t           JSONTraceGetCount             (JSONTraceOperation operation, JSONTraceSizeClass sizeClass);
+CFTimeInterval     JSONTraceGetPercentile        (JSONTraceOperation operation, JSONTraceSizeClass sizeClass, double percentile);
+void               JSONTraceResetHistograms      (void);
+
+JSONParserRef JSONParserCreate                 (CFAllocatorRef allocator, JSONReadOptions options);
+JSONParserRef JSONParserRetain                 (JSONParserRef parser);
+JSONParserRef JSONParserRelease                (JSONParserRef parser);
+CFTypeRef     JSONParserCreateObjectWithString (JSONParserRef parser, CFStringRef string, CFErrorRef *error);
+
+// Decodes MessagePack with parser's limits, converters and learned shapes.
+CFTypeRef     JSONParserCreateObjectWithMessagePackData (JSONParserRef parser, CFDataRef data, CFErrorRef *error);
+
+// Returns false if statistics are not compiled in (CORE_JSON_STATISTICS).
+bool                 JSONParserSetStatisticsEnabled (JSONParserRef parser, bool enabled);
+JSONParserStatistics JSONParserGetStatistics        (JSONParserRef parser);
+void                 JSONParserResetStatistics      (JSONParserRef parser);
+
+// Limits are copied, NULL disables them.
+void          JSONParserSetLimits              (JSONParserRef parser, const JSONParseLimits *limits);
+
+// Registers callBack converting string values of key in all objects, NULL removes it. Converters
+// run inside the parser on raw bytes, without creating intermediate strings.
+bool          JSONParserSetConvertCallBack     (JSONParserRef parser, CFStringRef key, JSONParserConvertCallBack callBack, void *info);
+
+// Built-in converters. ISO 8601 dates (with optional milliseconds and time zone offset, UTC if not
+// specified) to CFDateRef, UUID strings to CFUUIDRef, URL strings to CFURLRef, base64 to CFDataRef.
+CFTypeRef     JSONConvertISO8601Date           (CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info);
+CFTypeRef     JSONConvertUUID                  (CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info);
+CFTypeRef     JSONConvertURL                   (CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info);
+CFTypeRef     JSONConvertBase64Data            (CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length, void *info);
+
+// With kJSONReadOptionUniqueStrings, number of strings shared instead of created and their
+// total UTF-8 length, over all parses.
+CFIndex       JSONParserGetSavedStringsCount   (JSONParserRef parser);
+CFIndex       JSONParserGetSavedStringsSize    (JSONParserRef parser);
+
+// With kJSONReadOptionUniqueContainers, number of arrays and dictionaries shared instead of
+// created and the total number of values (key-value pairs for dictionaries) they hold.
+CFIndex       JSONParserGetSavedContainersCount      (JSONParserRef parser);
+CFIndex       JSONParserGetSavedContainerValuesCount (JSONParserRef parser);
@@ -0,0 +1,352 @@
+//
+// CoreJSONBenchmarks.c
+// CoreJSON Framework
+//
+// Copyright 2011 Mirek Rusin <mirek [at] me [dot] com>
+//                http://github.com/mirek/CoreJSON
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+//
+// Standalone benchmark of JSONCreateWithString and JSONCreateString. Runs over
+// CoreJSONTests/tests/sample.json and generated corpora, measures throughput and counts
+// allocations made through a counting CFAllocator passed to both calls.
+//
+// On Linux, with CoreFoundation from swift-corelibs-foundation (or CF-Lite), yajl 2 and zlib
+// installed, build and run from the repository root:
+//
+//   cc -O2 -std=gnu99 -ICoreJSON -o corejson-benchmarks CoreJSON/CoreJSON.c
+//      CoreJSONBenchmarks/CoreJSONBenchmarks.c -lCoreFoundation -lyajl -lz -lpthread -lm
+//   ./corejson-benchmarks [path/to/sample.json] [seconds per benchmark] > results.jsonl
+//
+// Human readable table goes to stderr, one JSON object per benchmark and phase to stdout:
+//
+//   {"benchmark":"numbers","phase":"parse","bytes":..., "documents":..., "seconds":...,
+//    "mbPerSecond":..., "documentsPerSecond":..., "allocationsPerDocument":...,
+//    "allocatedBytesPerDocument":..., "peakBytes":...}
+//
+
+#include "CoreJSON.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#pragma Counting allocator
+
+typedef struct {
+  CFIndex allocationsCount;
+  CFIndex allocatedSize;
+  CFIndex size;
+  CFIndex peakSize;
+} CoreJSONBenchmarksAllocatorInfo;
+
+// Every block has a header with its size, so deallocations can update the live size.
+#define CORE_JSON_BENCHMARKS_HEADER_SIZE 16
+
+// Parallel generation allocates from worker threads, counters are updated atomically and the
+// peak is raised with compare and swap.
+static inline void CoreJSONBenchmarksCount(CoreJSONBenchmarksAllocatorInfo *counters, CFIndex allocatedSize, CFIndex sizeDelta) {
+  __atomic_fetch_add(&counters->allocationsCount, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->allocatedSize, allocatedSize, __ATOMIC_RELAXED);
+  CFIndex size = __atomic_add_fetch(&counters->size, sizeDelta, __ATOMIC_RELAXED);
+  CFIndex peakSize = __atomic_load_n(&counters->peakSize, __ATOMIC_RELAXED);
+  while (size > peakSize && !__atomic_compare_exchange_n(&counters->peakSize, &peakSize, size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void *CoreJSONBenchmarksAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+  CoreJSONBenchmarksAllocatorInfo *counters = (CoreJSONBenchmarksAllocatorInfo *)info;
+  unsigned char *block = malloc(size + CORE_JSON_BENCHMARKS_HEADER_SIZE);
+  if (block == NULL)
+    return NULL;
+  *(CFIndex *)block = size;
+  CoreJSONBenchmarksCount(counters, size, size);
+  return block + CORE_JSON_BENCHMARKS_HEADER_SIZE;
+}
+
+static void CoreJSONBenchmarksDeallocate(void *ptr, void *info) {
+  CoreJSONBenchmarksAllocatorInfo *counters = (CoreJSONBenchmarksAllocatorInfo *)info;
+  unsigned char *block = (unsigned char *)ptr - CORE_JSON_BENCHMARKS_HEADER_SIZE;
+  __atomic_fetch_sub(&counters->size, *(CFIndex *)block, __ATOMIC_RELAXED);
+  free(block);
+}
+
+static void *CoreJSONBenchmarksReallocate(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info) {
+  CoreJSONBenchmarksAllocatorInfo *counters = (CoreJSONBenchmarksAllocatorInfo *)info;
+  unsigned char *block = (unsigned char *)ptr - CORE_JSON_BENCHMARKS_HEADER_SIZE;
+  CFIndex size = *(CFIndex *)block;
+  if (NULL == (block = realloc(block, newsize + CORE_JSON_BENCHMARKS_HEADER_SIZE)))
+    return NULL;
+  *(CFIndex *)block = newsize;
+  CoreJSONBenchmarksCount(counters, newsize, newsize - size);
+  return block + CORE_JSON_BENCHMARKS_HEADER_SIZE;
+}
+
+static CFAllocatorRef CoreJSONBenchmarksAllocatorCreate(CoreJSONBenchmarksAllocatorInfo *counters) {
+  CFAllocatorContext context = {
+    0, counters, NULL, NULL, NULL,
+    CoreJSONBenchmarksAllocate, CoreJSONBenchmarksReallocate, CoreJSONBenchmarksDeallocate, NULL
+  };
+  return CFAllocatorCreate(kCFAllocatorDefault, &context);
+}
+
+#pragma Corpora
+
+typedef struct {
+  char   *bytes;
+  size_t  length;
+  size_t  size;
+} CoreJSONBenchmarksBuffer;
+
+static void CoreJSONBenchmarksAppend(CoreJSONBenchmarksBuffer *buffer, const char *format, ...) {
+  va_list arguments;
+  for (;;) {
+    va_start(arguments, format);
+    int n = vsnprintf(buffer->bytes + buffer->length, buffer->size - buffer->length, format, arguments);
+    va_end(arguments);
+    if (n >= 0 && buffer->length + n < buffer->size) {
+      buffer->length += n;
+      return;
+    }
+    buffer->size = buffer->size ? buffer->size << 1 : 65536;
+    buffer->bytes = realloc(buffer->bytes, buffer->size);
+  }
+}
+
+static CFStringRef CoreJSONBenchmarksCreateString(CoreJSONBenchmarksBuffer *buffer) {
+  CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)buffer->bytes, buffer->length, kCFStringEncodingUTF8, 0);
+  free(buffer->bytes);
+  return string;
+}
+
+static CFStringRef CoreJSONBenchmarksCreateNumbers(void) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  CoreJSONBenchmarksAppend(&buffer, "[");
+  for (int i = 0; i < 100000; i++) {
+    if (i % 2)
+      CoreJSONBenchmarksAppend(&buffer, ",%d", i * 7919);
+    else
+      CoreJSONBenchmarksAppend(&buffer, "%s%.6f", i ? "," : "", i * 0.001);
+  }
+  CoreJSONBenchmarksAppend(&buffer, "]");
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+static CFStringRef CoreJSONBenchmarksCreateStrings(void) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  CoreJSONBenchmarksAppend(&buffer, "[");
+  for (int i = 0; i < 50000; i++)
+    CoreJSONBenchmarksAppend(&buffer, i % 10 ? "%s\"lorem ipsum dolor sit amet %d\"" : "%s\"line\\nwith \\\"escapes\\\" \\u00e1 %d\"", i ? "," : "", i);
+  CoreJSONBenchmarksAppend(&buffer, "]");
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+static CFStringRef CoreJSONBenchmarksCreateNested(void) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  CoreJSONBenchmarksAppend(&buffer, "[");
+  for (int i = 0; i < 1000; i++) {
+    CoreJSONBenchmarksAppend(&buffer, i ? "," : "");
+    for (int depth = 0; depth < 64; depth++)
+      CoreJSONBenchmarksAppend(&buffer, depth % 2 ? "[" : "{\"a\":");
+    CoreJSONBenchmarksAppend(&buffer, "null");
+    for (int depth = 63; depth >= 0; depth--)
+      CoreJSONBenchmarksAppend(&buffer, depth % 2 ? "]" : "}");
+  }
+  CoreJSONBenchmarksAppend(&buffer, "]");
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+static CFStringRef CoreJSONBenchmarksCreateWide(void) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  CoreJSONBenchmarksAppend(&buffer, "{");
+  for (int i = 0; i < 100000; i++)
+    CoreJSONBenchmarksAppend(&buffer, "%s\"key%d\":%d", i ? "," : "", i, i);
+  CoreJSONBenchmarksAppend(&buffer, "}");
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+static CFStringRef CoreJSONBenchmarksCreateTiny(void) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  CoreJSONBenchmarksAppend(&buffer, "{\"id\":42,\"ok\":true,\"name\":\"tiny\"}");
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+static CFStringRef CoreJSONBenchmarksCreateWithContentsOfFile(const char *path) {
+  CoreJSONBenchmarksBuffer buffer = { NULL, 0, 0 };
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  size_t n = 0;
+  do {
+    if (buffer.length == buffer.size)
+      buffer.bytes = realloc(buffer.bytes, buffer.size = buffer.size ? buffer.size << 1 : 65536);
+    buffer.length += (n = fread(buffer.bytes + buffer.length, 1, buffer.size - buffer.length, file));
+  } while (n > 0);
+  fclose(file);
+  return CoreJSONBenchmarksCreateString(&buffer);
+}
+
+#pragma Benchmarks
+
+static double CoreJSONBenchmarksGetTime(void) {
+  struct timespec time_;
+  clock_gettime(CLOCK_MONOTONIC, &time_);
+  return time_.tv_sec + time_.tv_nsec * 1e-9;
+}
+
+static void CoreJSONBenchmarksReport(const char *name, const char *phase, CFIndex bytes, CFIndex documents, double seconds, CoreJSONBenchmarksAllocatorInfo *counters) {
+  double mbPerSecond = bytes * documents / seconds / (1024 * 1024);
+  double documentsPerSecond = documents / seconds;
+  double allocationsPerDocument = (double)counters->allocationsCount / documents;
+  double allocatedBytesPerDocument = (double)counters->allocatedSize / documents;
+  fprintf(stderr, "%-10s %-8s %10.2f MB/s %12.1f docs/s %12.1f allocs/doc %14.1f bytes/doc %12ld peak\n",
+          name, phase, mbPerSecond, documentsPerSecond, allocationsPerDocument, allocatedBytesPerDocument, (long)counters->peakSize);
+  printf("{\"benchmark\":\"%s\",\"phase\":\"%s\",\"bytes\":%ld,\"documents\":%ld,\"seconds\":%.6f,"
+         "\"mbPerSecond\":%.3f,\"documentsPerSecond\":%.3f,\"allocationsPerDocument\":%.3f,"
+         "\"allocatedBytesPerDocument\":%.3f,\"peakBytes\":%ld}\n",
+         name, phase, (long)bytes, (long)documents, seconds,
+         mbPerSecond, documentsPerSecond, allocationsPerDocument, allocatedBytesPerDocument, (long)counters->peakSize);
+}
+
+// Parses (and generates back) the string until at least minimumSeconds elapsed for each phase.
+static void CoreJSONBenchmarksRun(const char *name, CFStringRef string, double minimumSeconds) {
+  CFIndex bytes = CFStringGetMaximumSizeForEncoding(CFStringGetLength(string), kCFStringEncodingUTF8);
+  CFDataRef data = CFStringCreateExternalRepresentation(kCFAllocatorDefault, string, kCFStringEncodingUTF8, 0);
+  if (data)
+    bytes = CFDataGetLength(data);
+
+  CoreJSONBenchmarksAllocatorInfo counters = { 0, 0, 0, 0 };
+  CFAllocatorRef allocator = CoreJSONBenchmarksAllocatorCreate(&counters);
+
+  CFIndex documents = 0;
+  double start = CoreJSONBenchmarksGetTime(), seconds = 0;
+  do {
+    CFTypeRef object = JSONCreateWithString(allocator, string, kJSONReadOptionsDefault, NULL);
+    if (object == NULL) {
+      fprintf(stderr, "%s: parse failed\n", name);
+      CFRelease(allocator);
+      if (data)
+        CFRelease(data);
+      return;
+    }
+    CFRelease(object);
+    documents++;
+  } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+  CoreJSONBenchmarksReport(name, "parse", bytes, documents, seconds, &counters);
+
+  CFTypeRef object = JSONCreateWithString(kCFAllocatorDefault, string, kJSONReadOptionsDefault, NULL);
+  counters = (CoreJSONBenchmarksAllocatorInfo){ 0, 0, 0, 0 };
+  documents = 0;
+  start = CoreJSONBenchmarksGetTime();
+  do {
+    CFStringRef generated = JSONCreateString(allocator, object, kJSONWriteOptionsDefault, NULL);
+    if (generated)
+      CFRelease(generated);
+    documents++;
+  } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+  CoreJSONBenchmarksReport(name, "generate", bytes, documents, seconds, &counters);
+
+  // Scaling of kJSONWriteOptionParallel by number of threads, corpora below the parallel
+  // threshold are generated serially
+  CFIndex threadsCount = JSONGeneratorGetParallelThreadsCount();
+  for (CFIndex n = 1; n <= threadsCount; n <<= 1) {
+    char phase[32];
+    snprintf(phase, sizeof(phase), "parallel%ld", (long)n);
+    JSONGeneratorSetParallelThreadsCount(n);
+    counters = (CoreJSONBenchmarksAllocatorInfo){ 0, 0, 0, 0 };
+    documents = 0;
+    start = CoreJSONBenchmarksGetTime();
+    do {
+      CFStringRef generated = JSONCreateString(allocator, object, kJSONWriteOptionParallel, NULL);
+      if (generated)
+        CFRelease(generated);
+      documents++;
+    } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+    CoreJSONBenchmarksReport(name, phase, bytes, documents, seconds, &counters);
+  }
+  JSONGeneratorSetParallelThreadsCount(0);
+
+  // MessagePack throughput is reported against the size of the packed document
+  CFDataRef packed = JSONCreateMessagePackData(kCFAllocatorDefault, object, NULL);
+  if (packed) {
+    CFIndex packedBytes = CFDataGetLength(packed);
+    counters = (CoreJSONBenchmarksAllocatorInfo){ 0, 0, 0, 0 };
+    documents = 0;
+    start = CoreJSONBenchmarksGetTime();
+    do {
+      CFDataRef data_ = JSONCreateMessagePackData(allocator, object, NULL);
+      if (data_)
+        CFRelease(data_);
+      documents++;
+    } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+    CoreJSONBenchmarksReport(name, "pack", packedBytes, documents, seconds, &counters);
+
+    counters = (CoreJSONBenchmarksAllocatorInfo){ 0, 0, 0, 0 };
+    documents = 0;
+    start = CoreJSONBenchmarksGetTime();
+    do {
+      CFTypeRef unpacked = JSONCreateWithMessagePackData(allocator, packed, kJSONReadOptionsDefault, NULL);
+      if (unpacked)
+        CFRelease(unpacked);
+      documents++;
+    } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+    CoreJSONBenchmarksReport(name, "unpack", packedBytes, documents, seconds, &counters);
+    CFRelease(packed);
+  }
+
+  // Minifying without creating objects, compare with parse and generate together
+  if (data) {
+    counters = (CoreJSONBenchmarksAllocatorInfo){ 0, 0, 0, 0 };
+    documents = 0;
+    start = CoreJSONBenchmarksGetTime();
+    do {
+      CFDataRef transcoded = JSONCreateTranscodedData(allocator, data, kJSONWriteOptionsDefault, NULL);
+      if (transcoded)
+        CFRelease(transcoded);
+      documents++;
+    } while ((seconds = CoreJSONBenchmarksGetTime() - start) < minimumSeconds);
+    CoreJSONBenchmarksReport(name, "transcode", bytes, documents, seconds, &counters);
+    CFRelease(data);
+  }
+
+  CFRelease(object);
+  CFRelease(allocator);
+}
+
+int main(int argc, const char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : "CoreJSONTests/tests/sample.json";
+  double minimumSeconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+  struct {
+    const char  *name;
+    CFStringRef  string;
+  } corpora[] = {
+    { "sample",  CoreJSONBenchmarksCreateWithContentsOfFile(path) },
+    { "numbers", CoreJSONBenchmarksCreateNumbers() },
+    { "strings", CoreJSONBenchmarksCreateStrings() },
+    { "nested",  CoreJSONBenchmarksCreateNested() },
+    { "wide",    CoreJSONBenchmarksCreateWide() },
+    { "tiny",    CoreJSONBenchmarksCreateTiny() }
+  };
+
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+    if (corpora[i].string) {
+      CoreJSONBenchmarksRun(corpora[i].name, corpora[i].string, minimumSeconds);
+      CFRelease(corpora[i].string);
+    } else {
+      fprintf(stderr, "%s: couldn't read %s\n", corpora[i].name, path);
+    }
+  }
+  return 0;
+}
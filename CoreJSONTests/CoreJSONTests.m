@@ -20,6 +20,33 @@
 
 #import "CoreJSONTests.h"
 
+static void CoreJSONTestsAppendBooleanAsNumber(CFAllocatorRef allocator, yajl_gen *g, CFTypeRef value) {
+  yajl_gen_integer(*g, CFBooleanGetValue(value) ? 1 : 0);
+}
+
+static CFIndex CoreJSONTestsWriteToData(void *info, const UInt8 *bytes, CFIndex length) {
+  CFDataAppendBytes((CFMutableDataRef)info, bytes, length);
+  return length;
+}
+
+static CFIndex CoreJSONTestsCountWrites(void *info, const UInt8 *bytes, CFIndex length) {
+  (*(CFIndex *)info)++;
+  return length;
+}
+
+static CFIndex CoreJSONTestsWriteNothing(void *info, const UInt8 *bytes, CFIndex length) {
+  return 0;
+}
+
+static CFIndex CoreJSONTestsWriteFailing(void *info, const UInt8 *bytes, CFIndex length) {
+  return -1;
+}
+
+static void CoreJSONTestsTraceEnd(JSONTraceOperation operation, CFIndex size, bool success, CFTimeInterval time, void *context, void *info) {
+  if (success)
+    (*(CFIndex *)info)++;
+}
+
 @implementation CoreJSONTests
 
 - (void) setUp {
@@ -54,6 +81,618 @@
   CFRelease(uuid);
 }
 
+- (void) testGeneratorAppendCallBacks {
+  {
+    NSArray *array = [NSArray arrayWithObject: [NSData dataWithBytes: "foo" length: 3]];
+    NSString *json = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, NULL);
+    STAssertEqualObjects(json, @"[\"Zm9v\"]", @"Data should be generated as base64 string");
+    [json release];
+  }
+  {
+    NSArray *array = [NSArray arrayWithObject: [NSDate dateWithTimeIntervalSince1970: 0]];
+    NSString *json = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, NULL);
+    STAssertEqualObjects(json, @"[\"1970-01-01T00:00:00Z\"]", @"Date should be generated as ISO 8601 string");
+    [json release];
+  }
+  {
+    JSONGeneratorAppendCallBack callBack = JSONGeneratorGetAppendCallBack(CFBooleanGetTypeID());
+    STAssertTrue(JSONGeneratorSetAppendCallBack(CFBooleanGetTypeID(), CoreJSONTestsAppendBooleanAsNumber), @"Should set callback");
+    NSArray *array = [NSArray arrayWithObjects: (id)kCFBooleanTrue, (id)kCFBooleanFalse, nil];
+    NSString *json = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, NULL);
+    STAssertEqualObjects(json, @"[1,0]", @"Custom callback should be used");
+    [json release];
+    JSONGeneratorSetAppendCallBack(CFBooleanGetTypeID(), callBack);
+  }
+}
+
+- (void) testGeneratorCache {
+  JSONGeneratorCacheRef cache = JSONGeneratorCacheCreate(testAllocator, 1024);
+  NSArray *fragment = [NSArray arrayWithObjects: @"foo", [NSNumber numberWithInt: 1], nil];
+  STAssertTrue(JSONGeneratorCacheAddValue(cache, fragment), @"Should register value");
+  for (int i = 0; i < 2; i++) {
+    NSDictionary *dictionary = [NSDictionary dictionaryWithObject: fragment forKey: @"a"];
+    NSString *json = (NSString *)JSONCreateStringWithCache(testAllocator, dictionary, kJSONWriteOptionsDefault, cache, NULL);
+    STAssertEqualObjects(json, @"{\"a\":[\"foo\",1]}", @"Cached fragment should be spliced");
+    [json release];
+  }
+  STAssertEquals(JSONGeneratorCacheGetMissesCount(cache), (CFIndex)1, @"First use should miss");
+  STAssertEquals(JSONGeneratorCacheGetHitsCount(cache), (CFIndex)1, @"Second use should hit");
+  STAssertEquals(JSONGeneratorCacheGetSize(cache), (CFIndex)9, @"Cache should hold [\"foo\",1]");
+  JSONGeneratorCacheRelease(cache);
+}
+
+- (void) testParallelGenerator {
+  
+  // Just enough elements for three chunks, throughput is measured in CoreJSONBenchmarks
+  NSMutableArray *array = [[NSMutableArray alloc] init];
+  for (int i = 0; i < 3 * CORE_JSON_GENERATOR_PARALLEL_MINIMUM_SIZE; i++)
+    [array addObject: [NSDictionary dictionaryWithObjectsAndKeys:
+                       [NSNumber numberWithInt: i], @"id",
+                       [NSArray arrayWithObjects: (id)kCFBooleanTrue, [NSNumber numberWithDouble: i / 3.0], nil], @"values",
+                       nil]];
+  
+  NSString *serial = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, NULL);
+  JSONGeneratorSetParallelThreadsCount(3);
+  STAssertEquals(JSONGeneratorGetParallelThreadsCount(), (CFIndex)3, @"Threads count should be set");
+  NSString *parallel = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionParallel, NULL);
+  STAssertEqualObjects(parallel, serial, @"Parallel output should be the same as serial one");
+  JSONGeneratorSetParallelThreadsCount(0);
+  
+  [parallel release];
+  [serial release];
+  [array release];
+}
+
+- (void) testWriter {
+  NSMutableData *data = [[NSMutableData alloc] init];
+  JSONWriterRef writer = JSONWriterCreate(testAllocator, kJSONWriteOptionsDefault, CoreJSONTestsWriteToData, data);
+  STAssertEquals(JSONWriterBeginObject(writer), kJSONWriterStatusOK, @"Should begin object");
+  JSONWriterAppendKey(writer, CFSTR("rows"));
+  JSONWriterBeginArray(writer);
+  for (int i = 0; i < 3; i++)
+    JSONWriterAppendLongLong(writer, i);
+  JSONWriterAppendValue(writer, [NSArray arrayWithObject: @"foo"]);
+  JSONWriterEndArray(writer);
+  JSONWriterAppendKeyWithBytes(writer, (const UInt8 *)"ok", 2);
+  JSONWriterAppendBoolean(writer, true);
+  STAssertEquals(JSONWriterAppendNull(writer), kJSONWriterStatusError, @"Null is not a valid key");
+  JSONWriterEndObject(writer);
+  STAssertTrue([data length] == 0, @"Output should be buffered until flushed");
+  JSONWriterFlush(writer);
+  NSString *json = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+  STAssertEqualObjects(json, @"{\"rows\":[0,1,2,[\"foo\"]],\"ok\":true}", @"Writer output expected");
+  STAssertEquals(JSONWriterAppendNull(writer), kJSONWriterStatusError, @"Document is complete");
+  [json release];
+  JSONWriterRelease(writer);
+  
+  // Values which can't be generated fail the writer
+  CFBagRef bag = CFBagCreate(testAllocator, NULL, 0, &kCFTypeBagCallBacks);
+  writer = JSONWriterCreate(testAllocator, kJSONWriteOptionsDefault, CoreJSONTestsWriteToData, data);
+  STAssertEquals(JSONWriterAppendValue(writer, [NSArray arrayWithObject: (id)bag]), kJSONWriterStatusError, @"CFBag is not supported");
+  STAssertEquals(JSONWriterFlush(writer), kJSONWriterStatusError, @"Writer should fail");
+  JSONWriterRelease(writer);
+  NSError *error = nil;
+  NSString *string = (NSString *)JSONCreateString(testAllocator, [NSDictionary dictionaryWithObjectsAndKeys: (id)bag, @"a", @"b", @"c", nil], kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(string, @"Dictionary with unsupported value should not be generated");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  [error release];
+  CFRelease(bag);
+  [data release];
+  
+  // Large values are flushed while they're generated
+  CFIndex writesCount = 0;
+  writer = JSONWriterCreate(testAllocator, kJSONWriteOptionsDefault, CoreJSONTestsCountWrites, &writesCount);
+  JSONWriterSetBufferSizes(writer, 16, 64);
+  NSMutableArray *values = [NSMutableArray array];
+  for (int i = 0; i < 100; i++)
+    [values addObject: [NSNumber numberWithInt: i]];
+  STAssertEquals(JSONWriterAppendValue(writer, values), kJSONWriterStatusOK, @"Should append array");
+  STAssertTrue(writesCount > 1, @"Output should be flushed while generating");
+  STAssertTrue(JSONWriterGetBufferedLength(writer) < 16, @"Buffered output should stay below flush size");
+  JSONWriterRelease(writer);
+}
+
+- (void) testNewlineDelimitedGenerator {
+  NSArray *values = [NSArray arrayWithObjects:
+                     [NSDictionary dictionaryWithObject: @"GET" forKey: @"method"],
+                     [NSArray arrayWithObjects: [NSNumber numberWithInt: 1], [NSNumber numberWithInt: 2], nil],
+                     @"foo",
+                     nil];
+  NSData *data = (NSData *)JSONCreateNewlineDelimitedData(testAllocator, (CFArrayRef)values, kJSONWriteOptionsDefault, NULL);
+  NSString *json = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+  STAssertEqualObjects(json, @"{\"method\":\"GET\"}\n[1,2]\n\"foo\"\n", @"One document per line expected");
+  [json release];
+  [data release];
+  
+  // Record which can't be generated is skipped and reported, the following ones are intact
+  NSError *error = nil;
+  CFBagRef bag = CFBagCreate(testAllocator, NULL, 0, &kCFTypeBagCallBacks);
+  values = [NSArray arrayWithObjects: @"a", [NSArray arrayWithObjects: @"b", (id)bag, nil], [NSArray arrayWithObject: @"c"], nil];
+  data = (NSData *)JSONCreateNewlineDelimitedData(testAllocator, (CFArrayRef)values, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  json = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+  STAssertEqualObjects(json, @"\"a\"\n[\"c\"]\n", @"Failed record should be skipped");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  STAssertEqualObjects([[error userInfo] objectForKey: (NSString *)kJSONErrorOffsetKey], [NSNumber numberWithInt: 1], @"Second record should fail");
+  [json release];
+  [data release];
+  [error release];
+  CFRelease(bag);
+  
+  // Types without callback are skipped the same way
+  JSONGeneratorAppendCallBack callBack = JSONGeneratorGetAppendCallBack(CFNullGetTypeID());
+  JSONGeneratorSetAppendCallBack(CFNullGetTypeID(), NULL);
+  json = (NSString *)JSONCreateString(testAllocator, [NSArray arrayWithObject: [NSNull null]], kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  JSONGeneratorSetAppendCallBack(CFNullGetTypeID(), callBack);
+  STAssertNil(json, @"Value without callback should not be generated");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  [error release];
+}
+
+- (void) testParser {
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionsDefault);
+  STAssertTrue(parser != NULL, @"Should have parser");
+  for (int i = 0; i < 3; i++) {
+    NSError *error = nil;
+    NSArray *array = (NSArray *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"[{ \"a\": 1, \"b\": [true, false] }, 2]", (CFErrorRef *)&error);
+    STAssertNil(error, @"Error should be nil");
+    STAssertTrue([array count] == 2, @"Array should have 2 elements");
+    STAssertEqualObjects([[[array objectAtIndex: 0] objectForKey: @"b"] objectAtIndex: 1], [NSNumber numberWithBool: NO], @"false expected");
+    [array release];
+  }
+  JSONParserRelease(parser);
+  
+  // Larger sizes are learned right away, smaller ones by half of the difference per parse
+  __JSONShape shape;
+  __JSONShapeInitialize(&shape);
+  __JSONShapeObserve(shape.observedArraySizes, 0, 2);
+  __JSONShapeObserve(shape.observedMapSizes, 1, 5000);
+  __JSONShapeLearn(&shape, 5002);
+  STAssertEquals(shape.mapSizes[1], (CFIndex)5000, @"Larger map size should be learned right away");
+  STAssertEquals(shape.arraySizes[0], (CFIndex)(CORE_JSON_STACK_ENTRY_VALUES_INITIAL_SIZE + 2) >> 1, @"Smaller array size should shrink by half");
+  for (int i = 0; i < 16; i++) {
+    __JSONShapeObserve(shape.observedArraySizes, 0, 2);
+    __JSONShapeLearn(&shape, 2);
+  }
+  STAssertEquals(shape.arraySizes[0], (CFIndex)2, @"Same-shaped documents should settle on their size");
+}
+
+- (void) testUniqueStrings {
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionUniqueStrings);
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"[{ \"status\": \"ok\" }, { \"status\": \"ok\" }, { \"status\": \"failed\" }]", (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue([array count] == 3, @"Array should have 3 elements");
+  STAssertTrue([[array objectAtIndex: 0] objectForKey: @"status"] == [[array objectAtIndex: 1] objectForKey: @"status"], @"Strings should be shared");
+  STAssertEqualObjects([[array objectAtIndex: 2] objectForKey: @"status"], @"failed", @"'failed' expected");
+  STAssertTrue(JSONParserGetSavedStringsCount(parser) == 3, @"2 keys and 1 value should be shared");
+  STAssertTrue(JSONParserGetSavedStringsSize(parser) == 14, @"2 x 'status' and 'ok' should be saved");
+  [array release];
+  JSONParserRelease(parser);
+}
+
+- (void) testUniqueContainers {
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionUniqueContainers);
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"[{ \"a\": [1, 2], \"b\": 3 }, { \"b\": 3, \"a\": [1, 2] }, { \"a\": [1.0, 2], \"b\": 3 }]", (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue([array count] == 3, @"Array should have 3 elements");
+  STAssertTrue([array objectAtIndex: 0] == [array objectAtIndex: 1], @"Dictionaries should be shared");
+  STAssertTrue([array objectAtIndex: 0] != [array objectAtIndex: 2], @"1.0 should not be shared with 1");
+  STAssertTrue(JSONParserGetSavedContainersCount(parser) == 2, @"Nested array and dictionary should be shared");
+  STAssertTrue(JSONParserGetSavedContainerValuesCount(parser) == 4, @"2 array values and 2 dictionary pairs should be saved");
+  [array release];
+  JSONParserRelease(parser);
+}
+
+- (void) testNoCopyStrings {
+  NSError *error = nil;
+  NSData *data = [@"{ \"a\": \"foo\", \"b\": \"b\\u00e1r\" }" dataUsingEncoding: NSUTF8StringEncoding];
+  NSDictionary *dictionary = (NSDictionary *)JSONCreateWithData(testAllocator, (CFDataRef)data, kJSONReadOptionNoCopyStrings, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertEqualObjects([dictionary objectForKey: @"a"], @"foo", @"'foo' expected");
+  STAssertEqualObjects([dictionary objectForKey: @"b"], @"b\u00e1r", @"Escaped string should be decoded");
+  [dictionary release];
+}
+
+- (void) testCompactObjects {
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONCreateWithString(testAllocator, (CFStringRef)@"[{ \"b\": 1, \"a\": [true] }, { \"a\": 1, \"a\": 2 }]", kJSONReadOptionCompactObjects, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  CFTypeRef object = [array objectAtIndex: 0];
+  STAssertTrue(JSONObjectIsCompact(object), @"Small object should be compact");
+  STAssertTrue(JSONObjectGetCount(object) == 2, @"Object should have 2 keys");
+  STAssertEqualObjects((id)JSONObjectGetValue(object, CFSTR("b")), [NSNumber numberWithInt: 1], @"1 expected");
+  STAssertTrue(JSONObjectGetValue(object, CFSTR("c")) == NULL, @"Missing key should be NULL");
+  STAssertFalse(JSONObjectIsCompact([array objectAtIndex: 1]), @"Object with duplicate keys should be a dictionary");
+  NSString *string = (NSString *)JSONCreateString(testAllocator, object, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertEqualObjects(string, @"{\"b\":1,\"a\":[true]}", @"Compact object should be generated in parse order");
+  NSDictionary *dictionary = (NSDictionary *)JSONObjectCreateDictionary(testAllocator, object);
+  STAssertEqualObjects([dictionary objectForKey: @"a"], [NSArray arrayWithObject: [NSNumber numberWithBool: YES]], @"[true] expected");
+  [dictionary release];
+  [string release];
+  [array release];
+}
+
+- (void) testLazyNumbers {
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONCreateWithString(testAllocator, (CFStringRef)@"[12, -3.50, 1e3, 12, 92233720368547758070]", kJSONReadOptionLazyNumbers, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue(JSONNumberIsLazy([array objectAtIndex: 0]), @"Number should be lazy");
+  long long value = 0;
+  STAssertTrue(JSONNumberGetLongLong([array objectAtIndex: 0], &value) && value == 12, @"12 expected");
+  STAssertEqualObjects([array objectAtIndex: 0], [array objectAtIndex: 3], @"Numbers with the same digits should be equal");
+  STAssertTrue(JSONNumberIsFloatType([array objectAtIndex: 4]), @"Integer out of range should be float");
+  STAssertFalse(JSONNumberGetLongLong([array objectAtIndex: 4], &value), @"Overflow should be reported");
+  STAssertFalse(JSONNumberGetLongLong([array objectAtIndex: 1], &value), @"Fraction should be reported");
+  STAssertFalse(JSONNumberIsFloatType([array objectAtIndex: 0]), @"12 should not be float");
+  STAssertTrue(JSONNumberGetDouble([array objectAtIndex: 1]) == -3.5, @"-3.5 expected");
+  STAssertTrue(JSONNumberIsFloatType([array objectAtIndex: 2]), @"1e3 should be float");
+  NSNumber *number = (NSNumber *)JSONNumberCreateNumber(testAllocator, [array objectAtIndex: 2]);
+  STAssertEqualObjects(number, [NSNumber numberWithDouble: 1000], @"1000 expected");
+  [number release];
+  NSString *string = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertEqualObjects(string, @"[12,-3.50,1e3,12,92233720368547758070]", @"Digits should be generated verbatim");
+  [string release];
+  [array release];
+}
+
+- (void) testConverters {
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionsDefault);
+  JSONParserSetConvertCallBack(parser, CFSTR("date"), JSONConvertISO8601Date, NULL);
+  JSONParserSetConvertCallBack(parser, CFSTR("id"), JSONConvertUUID, NULL);
+  JSONParserSetConvertCallBack(parser, CFSTR("data"), JSONConvertBase64Data, NULL);
+  NSError *error = nil;
+  NSDictionary *dictionary = (NSDictionary *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"{ \"date\": \"2011-02-18T12:30:00.250Z\", \"id\": \"E621E1F8-C36C-495A-93FC-0C247A3E6E5F\", \"data\": \"Zm9vYg==\", \"other\": [\"Zm9vYg==\"] }", (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertEqualObjects([dictionary objectForKey: @"date"], [NSDate dateWithTimeIntervalSince1970: 1298032200.25], @"Date expected");
+  STAssertTrue(CFGetTypeID([dictionary objectForKey: @"id"]) == CFUUIDGetTypeID(), @"UUID expected");
+  STAssertEqualObjects([dictionary objectForKey: @"data"], [@"foob" dataUsingEncoding: NSUTF8StringEncoding], @"Data expected");
+  STAssertEqualObjects([[dictionary objectForKey: @"other"] objectAtIndex: 0], @"Zm9vYg==", @"Values of other keys should not be converted");
+  NSString *string = (NSString *)JSONCreateString(testAllocator, dictionary, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertTrue([string rangeOfString: @"\"2011-02-18T12:30:00.250Z\""].location != NSNotFound, @"Date should be generated back");
+  STAssertTrue([string rangeOfString: @"\"Zm9vYg==\""].location != NSNotFound, @"Data should be generated back");
+  [string release];
+  [dictionary release];
+  JSONParserRelease(parser);
+}
+
+- (void) testStatistics {
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionsDefault);
+  bool enabled = JSONParserSetStatisticsEnabled(parser, 1);
+  STAssertEquals(enabled, (bool)CORE_JSON_STATISTICS, @"Statistics should be enabled when compiled in");
+  if (enabled) {
+    NSError *error = nil;
+    NSArray *array = (NSArray *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"[1, \"a\", { \"b\": [null, true] }]", (CFErrorRef *)&error);
+    STAssertNil(error, @"Error should be nil");
+    JSONParserStatistics statistics = JSONParserGetStatistics(parser);
+    STAssertEquals(statistics.arraysCount, (CFIndex)2, @"2 arrays expected");
+    STAssertEquals(statistics.dictionariesCount, (CFIndex)1, @"1 dictionary expected");
+    STAssertEquals(statistics.keysCount, (CFIndex)1, @"1 key expected");
+    STAssertEquals(statistics.maximumDepth, (CFIndex)3, @"Depth 3 expected");
+    STAssertTrue(statistics.bytesCount > 0, @"Bytes should be counted");
+    STAssertTrue(statistics.scratchAllocationsCount > 0, @"Scratch allocations should be counted");
+    STAssertTrue(statistics.lexingTime >= 0, @"Lexing time should not be negative");
+    JSONParserResetStatistics(parser);
+    STAssertEquals(JSONParserGetStatistics(parser).arraysCount, (CFIndex)0, @"Statistics should be reset");
+    [array release];
+  }
+  JSONParserRelease(parser);
+}
+
+- (void) testTracing {
+  CFIndex tracedCount = 0;
+  JSONTraceSetCallBacks(NULL, CoreJSONTestsTraceEnd, 0, &tracedCount);
+  JSONTraceSetHistogramsEnabled(1);
+  JSONTraceResetHistograms();
+  for (int i = 0; i < 3; i++) {
+    NSArray *array = (NSArray *)JSONCreateWithString(testAllocator, (CFStringRef)@"[1, 2, 3]", kJSONReadOptionsDefault, NULL);
+    NSString *string = (NSString *)JSONCreateString(testAllocator, array, kJSONWriteOptionsDefault, NULL);
+    [string release];
+    [array release];
+  }
+  JSONTraceSetHistogramsEnabled(0);
+  JSONTraceSetCallBacks(NULL, NULL, 0, NULL);
+  STAssertEquals(tracedCount, (CFIndex)6, @"6 traced calls expected");
+  STAssertEquals(JSONTraceGetCount(kJSONTraceOperationParse, kJSONTraceSizeClassTiny), (uint64_t)3, @"3 parses expected");
+  STAssertEquals(JSONTraceGetCount(kJSONTraceOperationGenerate, kJSONTraceSizeClassTiny), (uint64_t)3, @"3 generates expected");
+  STAssertTrue(JSONTraceGetPercentile(kJSONTraceOperationParse, kJSONTraceSizeClassTiny, 99) > 0, @"Latency expected");
+  STAssertTrue(JSONTraceGetSizeClass(16384) == kJSONTraceSizeClassMedium, @"Medium size class expected");
+}
+
+- (void) testValidate {
+  JSONParseError error;
+  STAssertTrue(JSONValidateWithString((CFStringRef)@"{ \"a\": [1, 2.5, \"b\", null] }", &error), @"Valid JSON expected");
+  STAssertTrue(error.kind == kJSONErrorKindNone, @"No error expected");
+  STAssertFalse(JSONValidateWithString((CFStringRef)@"[1, 2", &error), @"Truncated JSON expected");
+  STAssertTrue(error.kind == kJSONErrorKindTruncated, @"Truncated error expected");
+  STAssertFalse(JSONValidateWithBytes((const UInt8 *)"[1] 2", 5, &error), @"Trailing garbage expected");
+  STAssertTrue(error.kind == kJSONErrorKindTrailingGarbage, @"Trailing garbage error expected");
+  const UInt8 *bytes = (const UInt8 *)"[1,\n  x]";
+  STAssertFalse(JSONValidateWithBytes(bytes, 8, &error), @"Invalid JSON expected");
+  STAssertTrue(error.kind == kJSONErrorKindLexical, @"Lexical error expected");
+  CFIndex line = 0;
+  JSONParseErrorGetLineAndColumn(error, bytes, 8, &line, NULL);
+  STAssertEquals(line, (CFIndex)2, @"Error on line 2 expected");
+}
+
+- (void) testParseError {
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONCreateWithString(testAllocator, (CFStringRef)@"[1, 2", kJSONReadOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(array, @"Should be nil");
+  STAssertEqualObjects([error domain], (NSString *)kJSONErrorDomain, @"CoreJSON error domain expected");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindTruncated, @"Truncated error expected");
+  STAssertEqualObjects([[error userInfo] objectForKey: (NSString *)kJSONErrorOffsetKey], [NSNumber numberWithInteger: 5], @"Offset 5 expected");
+  [error release];
+}
+
+- (void) testLimits {
+  JSONParseLimits limits = { 0 };
+  limits.maximumDepth = 2;
+  limits.maximumStringLength = 3;
+  limits.maximumContainerSize = 4;
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONCreateWithStringAndLimits(testAllocator, (CFStringRef)@"[[1, \"abc\"], { \"a\": 1 }]", kJSONReadOptionsDefault, &limits, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue([array count] == 2, @"Array should have 2 elements");
+  [array release];
+  
+  array = (NSArray *)JSONCreateWithStringAndLimits(testAllocator, (CFStringRef)@"[[[1]]]", kJSONReadOptionsDefault, &limits, (CFErrorRef *)&error);
+  STAssertNil(array, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindDepthLimit, @"Depth limit error expected");
+  [error release];
+  
+  array = (NSArray *)JSONCreateWithStringAndLimits(testAllocator, (CFStringRef)@"[\"abcd\"]", kJSONReadOptionsDefault, &limits, (CFErrorRef *)&error);
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindStringLengthLimit, @"String length limit error expected");
+  [error release];
+  
+  array = (NSArray *)JSONCreateWithStringAndLimits(testAllocator, (CFStringRef)@"[1, 2, 3, 4, 5]", kJSONReadOptionsDefault, &limits, (CFErrorRef *)&error);
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindContainerSizeLimit, @"Container size limit error expected");
+  [error release];
+  
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionsDefault);
+  limits = (JSONParseLimits){ 0 };
+  limits.maximumBytes = 8;
+  JSONParserSetLimits(parser, &limits);
+  array = (NSArray *)JSONParserCreateObjectWithString(parser, (CFStringRef)@"[1, 2, 3, 4]", (CFErrorRef *)&error);
+  STAssertNil(array, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindBytesLimit, @"Bytes limit error expected");
+  [error release];
+  JSONParserRelease(parser);
+}
+
+- (void) testMessagePack {
+  NSError *error = nil;
+  NSDictionary *dictionary = (NSDictionary *)JSONCreateWithString(testAllocator, (CFStringRef)@"{ \"a\": [1, -200, 70000, 2.5, true, null], \"b\": \"c\u00e9\" }", kJSONReadOptionsDefault, NULL);
+  NSData *data = (NSData *)JSONCreateMessagePackData(testAllocator, (CFTypeRef)dictionary, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue([data length] == 30, @"30 bytes expected");
+  NSDictionary *unpacked = (NSDictionary *)JSONCreateWithMessagePackData(testAllocator, (CFDataRef)data, kJSONReadOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertEqualObjects(unpacked, dictionary, @"Round trip should be equal");
+  [unpacked release];
+  [data release];
+  [dictionary release];
+  
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970: 1234567890.5];
+  data = (NSData *)JSONCreateMessagePackData(testAllocator, (CFTypeRef)[NSArray arrayWithObjects: date, [NSData dataWithBytes: "abc" length: 3], nil], NULL);
+  NSArray *array = (NSArray *)JSONCreateWithMessagePackData(testAllocator, (CFDataRef)data, kJSONReadOptionsDefault, NULL);
+  STAssertEqualObjects([array objectAtIndex: 0], date, @"Date expected");
+  STAssertEqualObjects([array objectAtIndex: 1], [NSData dataWithBytes: "abc" length: 3], @"Data expected");
+  [array release];
+  [data release];
+  
+  array = (NSArray *)JSONCreateWithMessagePackData(testAllocator, (CFDataRef)[NSData dataWithBytes: "\x92\x01" length: 2], kJSONReadOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(array, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindTruncated, @"Truncated error expected");
+  [error release];
+  
+  array = (NSArray *)JSONCreateWithMessagePackData(testAllocator, (CFDataRef)[NSData dataWithBytes: "\x91\xcf\xff\xff\xff\xff\xff\xff\xff\xff" length: 10], kJSONReadOptionsDefault, NULL);
+  STAssertEqualObjects([array objectAtIndex: 0], [NSNumber numberWithDouble: 18446744073709551615.0], @"UInt64 out of long long range should be double");
+  [array release];
+  
+  JSONParseLimits limits = { 0 };
+  limits.maximumContainerSize = 2;
+  array = (NSArray *)JSONCreateWithMessagePackDataAndLimits(testAllocator, (CFDataRef)[NSData dataWithBytes: "\x93\x01\x02\x03" length: 4], kJSONReadOptionsDefault, &limits, (CFErrorRef *)&error);
+  STAssertNil(array, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindContainerSizeLimit, @"Container size limit error expected");
+  [error release];
+  
+  JSONParserRef parser = JSONParserCreate(testAllocator, kJSONReadOptionsDefault);
+  JSONParserSetConvertCallBack(parser, CFSTR("id"), JSONConvertUUID, NULL);
+  dictionary = (NSDictionary *)JSONCreateWithString(testAllocator, (CFStringRef)@"{ \"id\": \"E621E1F8-C36C-495A-93FC-0C247A3E6E5F\" }", kJSONReadOptionsDefault, NULL);
+  data = (NSData *)JSONCreateMessagePackData(testAllocator, (CFTypeRef)dictionary, NULL);
+  unpacked = (NSDictionary *)JSONParserCreateObjectWithMessagePackData(parser, (CFDataRef)data, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue(CFGetTypeID([unpacked objectForKey: @"id"]) == CFUUIDGetTypeID(), @"UUID expected");
+  [unpacked release];
+  [data release];
+  [dictionary release];
+  JSONParserRelease(parser);
+}
+
+- (void) testSnapshot {
+  NSError *error = nil;
+  NSDictionary *dictionary = (NSDictionary *)JSONCreateWithString(testAllocator, (CFStringRef)@"{ \"a\": [1, 2.5, \"b\", true, null], \"c\": { \"a\": \"b\" } }", kJSONReadOptionsDefault, NULL);
+  NSData *data = (NSData *)JSONSnapshotCreateData(testAllocator, (CFTypeRef)dictionary, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  JSONSnapshotRef snapshot = JSONSnapshotCreateWithData(testAllocator, (CFDataRef)data, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue(JSONSnapshotGetType(snapshot, 0) == kJSONSnapshotTypeObject, @"Object expected");
+  CFIndex array = JSONSnapshotGetValueForKey(snapshot, 0, CFSTR("a"));
+  STAssertEquals(JSONSnapshotGetCount(snapshot, array), (CFIndex)5, @"5 elements expected");
+  STAssertEquals(JSONSnapshotGetLongLong(snapshot, JSONSnapshotGetValueAtIndex(snapshot, array, 0)), 1LL, @"1 expected");
+  STAssertEquals(JSONSnapshotGetDouble(snapshot, JSONSnapshotGetValueAtIndex(snapshot, array, 1)), 2.5, @"2.5 expected");
+  STAssertTrue(JSONSnapshotGetBoolean(snapshot, JSONSnapshotGetValueAtIndex(snapshot, array, 3)), @"true expected");
+  STAssertEquals(JSONSnapshotGetValueForKey(snapshot, 0, CFSTR("b")), kCFNotFound, @"Missing key expected");
+  NSDictionary *object = (NSDictionary *)JSONSnapshotCreateObject(testAllocator, snapshot, 0, kJSONReadOptionsDefault);
+  STAssertEqualObjects(object, dictionary, @"Snapshot object should be equal");
+  [object release];
+  JSONSnapshotRelease(snapshot);
+  
+  NSMutableData *stale = [NSMutableData dataWithData: data];
+  ((UInt8 *)[stale mutableBytes])[[stale length] - 1] ^= 1;
+  snapshot = JSONSnapshotCreateWithData(testAllocator, (CFDataRef)stale, (CFErrorRef *)&error);
+  STAssertTrue(snapshot == NULL, @"Should be NULL");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindSnapshot, @"Snapshot error expected");
+  [error release];
+  [data release];
+  [dictionary release];
+  
+  data = (NSData *)JSONSnapshotCreateData(testAllocator, (CFTypeRef)[NSArray arrayWithObject: [NSDate date]], (CFErrorRef *)&error);
+  STAssertNil(data, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  [error release];
+  data = (NSData *)JSONSnapshotCreateData(testAllocator, (CFTypeRef)[NSDictionary dictionaryWithObject: @"a" forKey: [NSNumber numberWithInt: 1]], (CFErrorRef *)&error);
+  STAssertNil(data, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  [error release];
+}
+
+static CFIndex CoreJSONTestsRead(void *info, UInt8 *bytes, CFIndex length) {
+  NSInputStream *stream = (NSInputStream *)info;
+  return [stream read: bytes maxLength: length < 3 ? length : 3];
+}
+
+- (void) testCompression {
+  NSError *error = nil;
+  NSArray *array = (NSArray *)JSONCreateWithString(testAllocator, (CFStringRef)@"[1, \"a\", { \"b\": [true, null] }]", kJSONReadOptionsDefault, NULL);
+  NSData *data = (NSData *)JSONCreateCompressedData(testAllocator, (CFTypeRef)array, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue([data length] > 2 && ((const UInt8 *)[data bytes])[0] == 0x1f && ((const UInt8 *)[data bytes])[1] == 0x8b, @"Gzip header expected");
+  NSArray *decompressed = (NSArray *)JSONCreateWithCompressedData(testAllocator, (CFDataRef)data, kJSONReadOptionsDefault, NULL, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertEqualObjects(decompressed, array, @"Round trip should be equal");
+  [decompressed release];
+  
+  NSInputStream *stream = [NSInputStream inputStreamWithData: data];
+  [stream open];
+  decompressed = (NSArray *)JSONCreateWithCompressedStream(testAllocator, CoreJSONTestsRead, stream, kJSONReadOptionsDefault, NULL, (CFErrorRef *)&error);
+  STAssertEqualObjects(decompressed, array, @"Streamed round trip should be equal");
+  [decompressed release];
+  [stream close];
+  
+  decompressed = (NSArray *)JSONCreateWithCompressedData(testAllocator, (CFDataRef)[data subdataWithRange: NSMakeRange(0, [data length] - 4)], kJSONReadOptionsDefault, NULL, (CFErrorRef *)&error);
+  STAssertNil(decompressed, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindTruncated, @"Truncated error expected");
+  [error release];
+  [data release];
+  [array release];
+  
+  CFBagRef bag = CFBagCreate(testAllocator, NULL, 0, &kCFTypeBagCallBacks);
+  data = (NSData *)JSONCreateCompressedData(testAllocator, (CFTypeRef)[NSArray arrayWithObject: (id)bag], kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(data, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindGenerator, @"Generator error expected");
+  [error release];
+  CFRelease(bag);
+}
+
+- (void) testTranscoder {
+  NSError *error = nil;
+  NSData *input = [@"{ \"a\" : [ 1.50, \"b\\u0063\", true ],\n  \"d\": null }" dataUsingEncoding: NSUTF8StringEncoding];
+  NSData *data = (NSData *)JSONCreateTranscodedData(testAllocator, (CFDataRef)input, kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  NSString *string = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+  STAssertEqualObjects(string, @"{\"a\":[1.50,\"bc\",true],\"d\":null}", @"Minified JSON expected");
+  [string release];
+  [data release];
+  
+  data = (NSData *)JSONCreateTranscodedData(testAllocator, (CFDataRef)input, kJSONWriteOptionIndent, NULL);
+  string = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+  STAssertTrue([string rangeOfString: @"\n  \"a\": [\n"].location != NSNotFound, @"Indented JSON expected");
+  [string release];
+  [data release];
+  
+  data = (NSData *)JSONCreateTranscodedData(testAllocator, (CFDataRef)[@"[1, 2" dataUsingEncoding: NSUTF8StringEncoding], kJSONWriteOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(data, @"Should be nil");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindTruncated, @"Truncated error expected");
+  [error release];
+  
+  // Sink taking nothing applies backpressure, failing sink fails with file error
+  JSONTranscoderRef transcoder = JSONTranscoderCreate(testAllocator, kJSONWriteOptionsDefault, CoreJSONTestsWriteNothing, NULL);
+  JSONTranscoderSetBufferSizes(transcoder, 8, 16);
+  STAssertEquals(JSONTranscoderParse(transcoder, [input bytes], [input length], NULL), kJSONWriterStatusWouldBlock, @"Backpressure expected");
+  STAssertEquals(JSONTranscoderFlush(transcoder), kJSONWriterStatusWouldBlock, @"Output should stay buffered");
+  JSONTranscoderRelease(transcoder);
+  transcoder = JSONTranscoderCreate(testAllocator, kJSONWriteOptionsDefault, CoreJSONTestsWriteFailing, NULL);
+  STAssertEquals(JSONTranscoderParse(transcoder, [input bytes], [input length], (CFErrorRef *)&error), kJSONWriterStatusError, @"Sink failure expected");
+  STAssertEquals([error code], (NSInteger)kJSONErrorKindFile, @"File error expected");
+  [error release];
+  JSONTranscoderRelease(transcoder);
+}
+
+typedef struct {
+  long long sum;
+  CFIndex   strings;
+  CFIndex   maximumDepth;
+  CFIndex   floats;
+} CoreJSONTestsEvents;
+
+static bool CoreJSONTestsEventsNumber(void *info, const UInt8 *bytes, CFIndex length, bool isFloat, long long integerValue, double doubleValue, CFIndex depth) {
+  CoreJSONTestsEvents *events = (CoreJSONTestsEvents *)info;
+  events->sum += integerValue;
+  if (isFloat)
+    events->floats++;
+  if (depth > events->maximumDepth)
+    events->maximumDepth = depth;
+  return 1;
+}
+
+static bool CoreJSONTestsEventsString(void *info, const UInt8 *bytes, CFIndex length, CFIndex depth) {
+  CoreJSONTestsEvents *events = (CoreJSONTestsEvents *)info;
+  events->strings++;
+  return length < 5; // Stops at a long string
+}
+
+- (void) testEvents {
+  JSONEventCallBacks callBacks = { 0 };
+  callBacks.number = CoreJSONTestsEventsNumber;
+  callBacks.string = CoreJSONTestsEventsString;
+  CoreJSONTestsEvents events = { 0, 0, 0 };
+  JSONParseError error;
+  STAssertTrue(JSONParseEventsWithString((CFStringRef)@"[1, { \"a\": [2, \"b\"] }, 3]", &callBacks, &events, &error), @"Parse expected");
+  STAssertEquals(events.sum, 6LL, @"Sum 6 expected");
+  STAssertEquals(events.strings, (CFIndex)1, @"1 string expected");
+  STAssertEquals(events.maximumDepth, (CFIndex)3, @"Depth 3 expected");
+  
+  events = (CoreJSONTestsEvents){ 0, 0, 0 };
+  STAssertFalse(JSONParseEventsWithString((CFStringRef)@"[\"a\", \"long string\", 1]", &callBacks, &events, &error), @"Stopped parse expected");
+  STAssertTrue(error.kind == kJSONErrorKindCanceled, @"Canceled error expected");
+  STAssertEquals(events.sum, 0LL, @"No numbers expected after stop");
+  
+  events = (CoreJSONTestsEvents){ 0, 0, 0 };
+  STAssertTrue(JSONParseEventsWithString((CFStringRef)@"[92233720368547758070]", &callBacks, &events, &error), @"Parse expected");
+  STAssertEquals(events.floats, (CFIndex)1, @"Integer out of range should be float");
+  STAssertEquals(events.sum, LLONG_MAX, @"Saturated integer value expected");
+}
+
+- (void) testDocument {
+  NSError *error = nil;
+  JSONDocumentRef document = JSONDocumentCreateWithString(testAllocator, (CFStringRef)@"{ \"a\": [1, \"foo\", { \"b\": null }] }", kJSONReadOptionsDefault, (CFErrorRef *)&error);
+  STAssertNil(error, @"Error should be nil");
+  STAssertTrue(document != NULL, @"Should have document");
+  NSDictionary *dictionary = (NSDictionary *)JSONDocumentGetObject(document);
+  STAssertTrue([[dictionary objectForKey: @"a"] count] == 3, @"Array should have 3 elements");
+  STAssertEqualObjects([[dictionary objectForKey: @"a"] objectAtIndex: 1], @"foo", @"'foo' expected");
+  STAssertTrue(JSONDocumentGetSize(document) > 0, @"Region should have chunks");
+  JSONDocumentRelease(document);
+}
+
+- (void) testDeferredRelease {
+  
+  // Top level container is small, size of nested ones counts
+  NSMutableString *string = [NSMutableString stringWithString: @"{\"data\": ["];
+  for (int i = 0; i < 10000; i++)
+    [string appendFormat: @"%@{\"id\": %d}", i ? @"," : @"", i];
+  [string appendString: @"]}"];
+  NSDictionary *dictionary = (NSDictionary *)JSONCreateWithString(testAllocator, (CFStringRef)string, kJSONReadOptionsDefault, NULL);
+  STAssertTrue([[dictionary objectForKey: @"data"] count] == 10000, @"Array should have 10000 elements");
+  STAssertTrue(__JSONDeferredReleaseShouldDefer(dictionary), @"Nested array should be counted");
+  JSONReleaseDeferred(dictionary);
+  while (JSONGetDeferredReleaseQueueLength() > 0)
+    usleep(1000);
+  STAssertTrue(JSONGetDeferredReleaseQueueHighWaterMark() > 0, @"Dictionary should have been released on the background thread");
+}
+
 - (void) testSimpleStuff {
   {
     NSError *error = nil;